@@ -0,0 +1,39 @@
+// Codec lists as the ACCEPT messages carry them: names separated by
+// commas. Shared by the client and the server's multicast.
+#include <string.h>
+#include "codec.h"
+
+int codec_listed(const char *codecs, const char *name, size_t len)
+{
+    while (*codecs)
+    {
+        size_t n = strcspn(codecs, ",");
+        if (n == len && strncmp(codecs, name, len) == 0)
+            return 1;
+        codecs += n;
+        if (*codecs == ',')
+            codecs++;
+    }
+    return 0;
+}
+
+void codecs_common(char *common, const char *codecs)
+{
+    char *out = common;
+    const char *name = common;
+    while (*name)
+    {
+        size_t n = strcspn(name, ",");
+        if (codec_listed(codecs, name, n))
+        {
+            if (out != common)
+                *out++ = ',';
+            memmove(out, name, n);
+            out += n;
+        }
+        name += n;
+        if (*name == ',')
+            name++;
+    }
+    *out = '\0';
+}
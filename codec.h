@@ -0,0 +1,11 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stddef.h>
+
+// Whether a comma separated codec list has the len bytes at name
+int codec_listed(const char *codecs, const char *name, size_t len);
+// Keep the codecs in common that codecs also lists
+void codecs_common(char *common, const char *codecs);
+
+#endif
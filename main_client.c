@@ -11,20 +11,97 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <endian.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <ctype.h>
+#include "sha256.h"
+#include "codec.h"
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #define PORT_NUM 3000
 #define BUFFER_SIZE 512
 #define FILE_CHUNK_SIZE 4096
+#define FILE_FRAME_SIZE (64 * 1024) // file bytes per data frame, the most chat waits behind
+#define TRANSFER_BUCKETS 64
+#define FILE_ACK_INTERVAL (1 << 20) // received bytes between progress ACKs
+#define FILE_MAX_STREAMS 8            // must match the server
+#define FILE_STREAMS 4                // ranges a large file is sent in at once
+#define FILE_STREAM_MIN (16 << 20)    // smaller files go as a single range
+#define FILE_CODEC_LZ4 "lz4"
+#define FILE_CODECS FILE_CODEC_LZ4    // compression we read, offered when accepting
+#define FILE_PACK_BACKOFF 64          // most frames sent raw before trying again
+#define FILE_OFFER_MIN (1 << 20)      // smaller files are sent without keying them first
+#define RECONNECT_TRIES 30            // seconds spent getting a lost connection back
 
 // AI Assisted list. See report.pdf for details.
 #define FILE_TRANSFER_CMD "SEND"
+#define FILE_TO_ROOM "*" // SEND * file offers the file to the whole room
 #define FILE_TRANSFER_REQUEST "FILE_TRANSFER_REQUEST"
+#define FILE_TRANSFER_ID "FILE_TRANSFER_ID"
 #define FILE_TRANSFER_ACCEPT "FILE_TRANSFER_ACCEPT"
 #define FILE_TRANSFER_REJECT "FILE_TRANSFER_REJECT"
 #define FILE_TRANSFER_START "FILE_TRANSFER_START"
 #define FILE_TRANSFER_CHUNK "FILE_TRANSFER_CHUNK"
 #define FILE_TRANSFER_END "FILE_TRANSFER_END"
 #define FILE_TRANSFER_ERROR "FILE_TRANSFER_ERROR"
+#define FILE_TRANSFER_ACK "FILE_TRANSFER_ACK"
+#define FILE_TRANSFER_SUSPEND "FILE_TRANSFER_SUSPEND"
+#define FILE_TRANSFER_RESUME "FILE_TRANSFER_RESUME"
+#define DATA_TOKEN "DATA_TOKEN"
+#define SESSION_TOKEN "SESSION"
+#define CHUNK_STORE "CHUNK_STORE"
+#define FILE_TRANSFER_STORED "FILE_TRANSFER_STORED"
+#define FILE_TRANSFER_UPLOAD "FILE_TRANSFER_UPLOAD"
+
+// Framed protocol, must match the server
+#define PROTO_MAGIC "CHT"
+#define PROTO_VERSION 1
+#define FRAME_HDR_LEN 16
+#define FRAME_MAX_PAYLOAD (1 << 20)
+
+#define MSG_HELLO 1
+#define MSG_LIST 2
+#define MSG_JOIN 3
+#define MSG_TEXT 4
+#define MSG_CTRL 5
+#define MSG_DATA 6
+#define MSG_ATTACH 7
+#define MSG_RESUME 8
+
+#define FRAME_CRC 0x01 // data frame: the offset is followed by a CRC32C of the bytes
+#define FRAME_LZ4 0x02 // data frame: the bytes are an LZ4 block, the CRC is of the original
+#define CRC32C_POLY 0x82f63b78 // Castagnoli, bit reversed
+
+typedef struct {
+    uint32_t len;
+    uint8_t type;
+    uint8_t flags;
+    uint16_t reserved;
+    uint64_t id;
+} FRAME_HDR;
+
+// Buffered reader, a frame stays valid until the next read_frame() call
+typedef struct {
+    int fd;
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t consumed;
+} FrameReader;
+
+// A connection frames go out on. Senders hold lock while they write, and
+// fd is only read and replaced under it.
+typedef struct {
+    int fd;             // -1 while there is none
+    pthread_mutex_t lock;
+} Channel;
 
 #define RESET "\x1B[0m"
 #define RED "\x1B[31m"
@@ -40,17 +117,60 @@
 #define BRIGHT_MAGENTA "\x1B[95m"
 #define BRIGHT_CYAN "\x1B[96m"
 
-// AI Assisted. See report.pdf for details.
+typedef enum {
+    XFER_REQUESTED, // we asked to send, waiting for ACCEPT
+    XFER_PROMPT,    // incoming request, waiting for the user's Y/N
+    XFER_ACCEPTED,  // we said yes, waiting for START
+    XFER_SENDING,   // owned by the send pump
+    XFER_RECEIVING,
+    XFER_OFFERED,   // START offered the file to the chunk store, waiting for its answer
+    XFER_SUSPENDED, // receiver dropped, sending waits for FILE_TRANSFER_RESUME
+    XFER_CANCELLED  // sending stopped, the pump drops it on its next turn
+} TransferState;
+
+// A data frame as the chunk store will know it
 typedef struct {
+    uint64_t offset;
+    unsigned char key[SHA256_LEN];
+} OfferFrame;
+
+// AI Assisted. See report.pdf for details.
+typedef struct _FileTransfer {
     int transfer_id;
+    TransferState state;
     char sender_name[50];
     char receiver_name[50];
     char filename[256];
     char output_filename[256];
     size_t filesize;
-    int active;
-    int socket_fd;
-    pthread_t thread_id;
+    int file_fd;        // file being sent or written
+    int nstreams;       // ranges the file is split into, sent interleaved
+    size_t pos[FILE_MAX_STREAMS]; // per range: next byte to send, or
+                                  // written in order up to here
+    int next_stream;    // sending: range the next frame comes from
+    size_t done;        // bytes sent or written so far over all ranges
+    size_t acked;       // receiving: done at the last progress ACK
+    int epoch;          // receiving: resume epoch the ACKs must carry
+    int in_pump;        // sending: queued or being sent by the pump
+    int refcnt;         // the table, plus each data frame being written
+    int resume;         // sending: restart from resume_pos on the next turn
+    size_t resume_pos[FILE_MAX_STREAMS];
+    uint32_t crc[FILE_MAX_STREAMS]; // per range: CRC32C of the bytes before pos
+    int crc_stale;      // a resume moved pos, the digest is read back from the file
+    int compress;       // sending: the receiver reads FRAME_LZ4
+    int pack_skip;      // sending: frames left to send raw before trying again
+    int pack_backoff;   // sending: the last pack_skip, doubled while nothing shrinks
+    size_t sent;        // sending: file bytes put in data frames, resends included
+    size_t wire;        // sending: what they took on the wire after compression
+    int offer;          // sending: 1 while the frames are keyed for the chunk store,
+                        // 2 once START offered them
+    OfferFrame *offer_frames;
+    int offer_count;
+    int offer_cap;
+    time_t last_update; // last progress line
+    unsigned long seq;  // creation order, the oldest prompt is answered first
+    struct _FileTransfer *next;      // hash chain
+    struct _FileTransfer *send_next; // send pump queue
 } FileTransfer;
 
 char *color_palette[] = {
@@ -68,12 +188,37 @@ int color_count = 0;
 
 // Global variables
 char username[50];
-int sockfd;
 int room_number;
-int waiting_for_transfer_response = 0;
-int receiving_file = 0;
-FileTransfer current_transfer = {0};
+// Brings us back to the room after a lost connection, with the messages
+// after the last one we saw
+char session[64];
+unsigned long last_seq = 0;
+// Every transfer in flight, keyed by transfer id. The server hands out
+// the IDs; until it has, our own requests go by a negative tag.
+FileTransfer *transfers[TRANSFER_BUCKETS];
+unsigned long transfer_seq = 0;
+int transfer_tag = 0;
+// Outgoing transfers with data left, served round robin by the pump
+FileTransfer *send_head = NULL;
+FileTransfer *send_tail = NULL;
 pthread_mutex_t transfer_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pump_cond = PTHREAD_COND_INITIALIZER;
+// The chat connection. Its lock keeps frames from the chat and file
+// threads from interleaving. Chat frames go first: the pump waits while
+// chat_pending is non zero.
+Channel chat = {-1, PTHREAD_MUTEX_INITIALIZER};
+pthread_cond_t send_cond = PTHREAD_COND_INITIALIZER;
+atomic_int chat_pending;
+FrameReader reader;
+// File data connection, no fd until the server let it attach. Transfers
+// go over it so chat never waits behind file data.
+struct sockaddr_in serv_addr;
+Channel data = {-1, PTHREAD_MUTEX_INITIALIZER};
+FrameReader data_reader;
+atomic_int data_running;
+atomic_int data_attaching; // a thread is opening the data connection
+// The server keeps what it relays and can send a file it has seen again
+int chunk_store = 0;
 
 char *get_color_for_user(const char *name) {
     for (int i = 0; i < color_count; i++) {
@@ -115,6 +260,476 @@ void error(const char *msg) {
     exit(1);
 }
 
+void frame_encode(char *out, int type, int flags, uint64_t id, uint32_t len) {
+    uint32_t nlen = htonl(len);
+    uint64_t nid = htobe64(id);
+    memcpy(out, &nlen, 4);
+    out[4] = (char)type;
+    out[5] = (char)flags;
+    out[6] = out[7] = 0;
+    memcpy(out + 8, &nid, 8);
+}
+
+void frame_decode(const char *in, FRAME_HDR *hdr) {
+    memcpy(&hdr->len, in, 4);
+    hdr->len = ntohl(hdr->len);
+    hdr->type = (uint8_t)in[4];
+    hdr->flags = (uint8_t)in[5];
+    hdr->reserved = 0;
+    memcpy(&hdr->id, in + 8, 8);
+    hdr->id = be64toh(hdr->id);
+}
+
+// CRC32C, with the SSE4.2 instruction when the CPU has it
+uint32_t crc32c_table[256];
+uint32_t crc32c_x2n[32]; // x^(2^n) mod P, for joining CRCs of adjacent blocks
+uint32_t (*crc32c_block)(uint32_t crc, const unsigned char *p, size_t len);
+
+uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len--)
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+// a * b modulo the CRC polynomial, both bit reversed
+uint32_t crc32c_multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31, p = 0;
+    while (1) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+// x^(8 * len) modulo the CRC polynomial, shifts a CRC over len zero bytes
+uint32_t crc32c_x8nmodp(size_t len) {
+    uint32_t p = 1u << 31; // x^0
+    for (int k = 3; len > 0; len >>= 1, k++) {
+        if (len & 1)
+            p = crc32c_multmodp(crc32c_x2n[k & 31], p);
+    }
+    return p;
+}
+
+#if defined(__x86_64__)
+// The crc32 instruction takes three cycles but can start one every cycle, so
+// long blocks run three independent lanes and join them afterwards
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+    size_t lane = len / 24 * 8;
+    if (lane >= 256) {
+        uint64_t a = crc, b = 0, c = 0;
+        const unsigned char *q = p + lane, *r = q + lane;
+        for (size_t i = 0; i < lane; i += sizeof(uint64_t)) {
+            uint64_t va, vb, vc;
+            memcpy(&va, p + i, sizeof(va));
+            memcpy(&vb, q + i, sizeof(vb));
+            memcpy(&vc, r + i, sizeof(vc));
+            a = _mm_crc32_u64(a, va);
+            b = _mm_crc32_u64(b, vb);
+            c = _mm_crc32_u64(c, vc);
+        }
+        uint32_t shift = crc32c_x8nmodp(lane);
+        crc = crc32c_multmodp(shift, (uint32_t)a) ^ (uint32_t)b;
+        crc = crc32c_multmodp(shift, crc) ^ (uint32_t)c;
+        p += 3 * lane;
+        len -= 3 * lane;
+    }
+    uint64_t c = crc;
+    while (len >= sizeof(uint64_t)) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+        p += sizeof(v);
+        len -= sizeof(v);
+    }
+    crc = (uint32_t)c;
+    while (len--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+void crc32c_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc32c_table[i] = c;
+    }
+    uint32_t p = 1u << 30; // x^1
+    crc32c_x2n[0] = p;
+    for (int n = 1; n < 32; n++)
+        crc32c_x2n[n] = p = crc32c_multmodp(p, p);
+
+    crc32c_block = crc32c_sw;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c_block = crc32c_hw;
+#endif
+}
+
+// Continue crc, the CRC32C of what came before, over len more bytes
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    return ~crc32c_block(~crc, buf, len);
+}
+
+// CRC32C of two adjacent blocks from the CRC of each, len2 is the second's size
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2) {
+    return crc32c_multmodp(crc32c_x8nmodp(len2), crc1) ^ crc2;
+}
+
+// Read exactly len bytes at offset, returns -1 if the file is shorter
+int pread_all(int fd, char *buf, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// CRC32C of the first len bytes of a file, returns -1 if they cannot be read
+int file_crc32c(int fd, size_t len, uint32_t *crc) {
+    char buf[FILE_FRAME_SIZE];
+    uint32_t c = 0;
+    off_t offset = 0;
+    while ((size_t)offset < len) {
+        size_t want = len - offset < sizeof(buf) ? len - offset : sizeof(buf);
+        ssize_t n = pread(fd, buf, want, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        c = crc32c(c, buf, n);
+        offset += n;
+    }
+    *crc = c;
+    return 0;
+}
+
+// LZ4 block format, so transfers of text shrink without a library
+#define LZ4_HASH_LOG 12
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5 // a block ends in at least this many literals
+#define LZ4_MF_LIMIT 12     // no match starts this close to the end
+#define LZ4_MAX_OFFSET 65535
+
+uint32_t lz4_read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint32_t lz4_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+// Length past the 15 that fits in the token, as 255s and a remainder
+unsigned char *lz4_put_len(unsigned char *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+// One sequence: literals, then a match unless it is the last one.
+// Returns NULL if it does not fit before oend.
+unsigned char *lz4_put_seq(unsigned char *op, unsigned char *oend, const unsigned char *lit,
+                           size_t nlit, size_t offset, size_t mlen) {
+    if (nlit / 255 + mlen / 255 + nlit + 5 > (size_t)(oend - op))
+        return NULL;
+    unsigned char *token = op++;
+    *token = (nlit < 15 ? nlit : 15) << 4;
+    if (nlit >= 15)
+        op = lz4_put_len(op, nlit - 15);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (offset == 0)
+        return op;
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    mlen -= LZ4_MIN_MATCH;
+    *token |= mlen < 15 ? mlen : 15;
+    if (mlen >= 15)
+        op = lz4_put_len(op, mlen - 15);
+    return op;
+}
+
+// Compress len bytes into at most cap. Returns the block size, or 0 if it
+// does not fit. Misses make the search step grow, so data that does not
+// compress is given up on quickly.
+size_t lz4_compress(const char *src, size_t len, char *dst, size_t cap) {
+    const unsigned char *base = (const unsigned char *)src, *end = base + len;
+    const unsigned char *ip = base, *anchor = base;
+    unsigned char *op = (unsigned char *)dst, *oend = op + cap;
+
+    if (len > LZ4_MF_LIMIT) {
+        const unsigned char *mflimit = end - LZ4_MF_LIMIT;
+        const unsigned char *matchlimit = end - LZ4_LAST_LITERALS;
+        uint32_t table[1 << LZ4_HASH_LOG] = {0}; // offsets into src
+        ip++;
+        while (ip < mflimit) {
+            const unsigned char *ref;
+            unsigned misses = 1 << 6;
+            while (1) {
+                uint32_t h = lz4_hash(lz4_read32(ip));
+                ref = base + table[h];
+                table[h] = ip - base;
+                if (ref < ip && ip - ref <= LZ4_MAX_OFFSET && lz4_read32(ref) == lz4_read32(ip))
+                    break;
+                ip += misses++ >> 6;
+                if (ip >= mflimit)
+                    goto last;
+            }
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const unsigned char *mp = ip + LZ4_MIN_MATCH, *rp = ref + LZ4_MIN_MATCH;
+            while (mp < matchlimit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+            op = lz4_put_seq(op, oend, anchor, ip - anchor, ip - ref, mp - ip);
+            if (op == NULL)
+                return 0;
+            ip = anchor = mp;
+        }
+    }
+last:
+    op = lz4_put_seq(op, oend, anchor, end - anchor, 0, 0);
+    return op == NULL ? 0 : op - (unsigned char *)dst;
+}
+
+// Length past the 15 in the token. Returns -1 if src runs out first.
+int lz4_get_len(const unsigned char **ip, const unsigned char *iend, size_t *len) {
+    unsigned char b;
+    do {
+        if (*ip >= iend)
+            return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+// Returns the decompressed size, or -1 if src is not a block that fits in cap
+ssize_t lz4_decompress(const char *src, size_t len, char *dst, size_t cap) {
+    const unsigned char *ip = (const unsigned char *)src, *iend = ip + len;
+    unsigned char *op = (unsigned char *)dst, *oend = op + cap;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t nlit = token >> 4;
+        if (nlit == 15 && lz4_get_len(&ip, iend, &nlit) < 0)
+            return -1;
+        if (nlit > (size_t)(iend - ip) || nlit > (size_t)(oend - op))
+            return -1;
+        memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+        if (ip == iend)
+            break; // the last sequence has no match
+
+        if (iend - ip < 2)
+            return -1;
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15 && lz4_get_len(&ip, iend, &mlen) < 0)
+            return -1;
+        mlen += LZ4_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - (unsigned char *)dst) || mlen > (size_t)(oend - op))
+            return -1;
+        // A match may overlap what it writes. Its bytes repeat every
+        // offset bytes, so each copy can take twice as much as the last.
+        const unsigned char *ref = op - offset;
+        while (mlen > 0) {
+            size_t n = (size_t)(op - ref) < mlen ? (size_t)(op - ref) : mlen;
+            memcpy(op, ref, n);
+            op += n;
+            mlen -= n;
+        }
+    }
+    return op - (unsigned char *)dst;
+}
+
+// Write header and payload as one frame to a connection nobody else
+// writes to, returns -1 on failure
+int write_frame(int fd, int type, uint64_t id, const void *payload, uint32_t len) {
+    char hdr[FRAME_HDR_LEN];
+    frame_encode(hdr, type, 0, id, len);
+
+    struct iovec iov[2] = {
+        {hdr, FRAME_HDR_LEN},
+        {(void *)payload, len}};
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = len > 0 ? 2 : 1;
+
+    size_t left = FRAME_HDR_LEN + len;
+    while (left > 0) {
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        left -= n;
+        // Skip what went out on a partial write
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov[0].iov_len) {
+            n -= msg.msg_iov[0].iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov[0].iov_base = (char *)msg.msg_iov[0].iov_base + n;
+            msg.msg_iov[0].iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Send one frame on a channel, returns -1 on failure
+int send_frame(Channel *ch, int type, uint64_t id, const void *payload, uint32_t len) {
+    atomic_fetch_add(&chat_pending, 1);
+    pthread_mutex_lock(&ch->lock);
+    atomic_fetch_sub(&chat_pending, 1);
+    int ret = ch->fd >= 0 ? write_frame(ch->fd, type, id, payload, len) : -1;
+    pthread_cond_broadcast(&send_cond);
+    pthread_mutex_unlock(&ch->lock);
+    return ret;
+}
+
+// Lock and return the channel file data goes out on: the data connection
+// once it is up, the chat connection until then
+Channel *data_channel() {
+    pthread_mutex_lock(&data.lock);
+    if (data.fd >= 0)
+        return &data;
+    pthread_mutex_unlock(&data.lock);
+    pthread_mutex_lock(&chat.lock);
+    return &chat;
+}
+
+// Write all of buf, caller holds the channel lock
+int send_all(int fd, const char *buf, size_t len, int flags) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, flags | MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Data frame carrying the file at offset, len bytes of it or with FRAME_LZ4
+// len bytes of their LZ4 block, and the CRC32C of the file bytes. Without
+// buf the bytes go from the page cache to the socket with sendfile().
+int send_file_frame(int transfer_id, int flags, int filefd, off_t offset, const char *buf,
+                    size_t len, uint32_t crc) {
+    char hdr[FRAME_HDR_LEN + sizeof(uint64_t) + sizeof(uint32_t)];
+    uint64_t noffset = htobe64(offset);
+    uint32_t ncrc = htonl(crc);
+    frame_encode(hdr, MSG_DATA, FRAME_CRC | flags, transfer_id, sizeof(noffset) + sizeof(ncrc) + len);
+    memcpy(hdr + FRAME_HDR_LEN, &noffset, sizeof(noffset));
+    memcpy(hdr + FRAME_HDR_LEN + sizeof(noffset), &ncrc, sizeof(ncrc));
+
+    // Let queued chat frames out first if they share the socket
+    Channel *ch = data_channel();
+    while (ch == &chat && atomic_load(&chat_pending) > 0)
+        pthread_cond_wait(&send_cond, &chat.lock);
+    // MSG_MORE lets the header share a segment with the body
+    int ok = send_all(ch->fd, hdr, sizeof(hdr), MSG_MORE) == 0;
+    if (buf != NULL)
+        ok = ok && send_all(ch->fd, buf, len, 0) == 0;
+    while (buf == NULL && ok && len > 0) {
+        ssize_t n = sendfile(ch->fd, filefd, &offset, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            ok = 0;
+        } else if (n == 0) {
+            // File shrank under us, pad so the frame still ends where announced
+            char zeros[FILE_CHUNK_SIZE] = {0};
+            while (ok && len > 0) {
+                size_t pad = len < sizeof(zeros) ? len : sizeof(zeros);
+                ok = send_all(ch->fd, zeros, pad, 0) == 0;
+                len -= pad;
+            }
+            ok = 0;
+        } else {
+            len -= n;
+        }
+    }
+    pthread_mutex_unlock(&ch->lock);
+    return ok ? 0 : -1;
+}
+
+// Commands and transfer control go out as text in a control frame
+int send_ctrl(const char *text) {
+    return send_frame(&chat, MSG_CTRL, 0, text, strlen(text));
+}
+
+// Sender side transfer control that has to stay in order with the data
+int send_data_ctrl(const char *text) {
+    Channel *ch = data_channel();
+    int ret = write_frame(ch->fd, MSG_CTRL, 0, text, strlen(text));
+    pthread_cond_broadcast(&send_cond);
+    pthread_mutex_unlock(&ch->lock);
+    return ret;
+}
+
+// Read the next complete frame, returns 0 on close and -1 on error
+int read_frame(FrameReader *r, FRAME_HDR *hdr, char **payload) {
+    memmove(r->buf, r->buf + r->consumed, r->len - r->consumed);
+    r->len -= r->consumed;
+    r->consumed = 0;
+
+    while (1) {
+        if (r->len >= FRAME_HDR_LEN) {
+            frame_decode(r->buf, hdr);
+            if (hdr->len > FRAME_MAX_PAYLOAD)
+                return -1;
+            size_t total = FRAME_HDR_LEN + hdr->len;
+            if (r->len >= total) {
+                *payload = r->buf + FRAME_HDR_LEN;
+                r->consumed = total;
+                return 1;
+            }
+            if (r->cap < total) {
+                r->buf = realloc(r->buf, total);
+                r->cap = total;
+            }
+        }
+        if (r->cap - r->len < BUFFER_SIZE) {
+            r->cap = r->cap ? r->cap * 2 : FILE_CHUNK_SIZE * 4;
+            r->buf = realloc(r->buf, r->cap);
+        }
+        ssize_t n = recv(r->fd, r->buf + r->len, r->cap - r->len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n;
+        r->len += n;
+    }
+}
+
 // Generate a unique output filename to avoid overwriting existing files
 void generate_unique_filename(const char *base_filename, char *output) {
     // First check if file exists
@@ -163,127 +778,404 @@ void generate_unique_filename(const char *base_filename, char *output) {
     strcpy(output, temp);
 }
 
-// Send a file to another user
-// AI Assisted. See report.pdf for details.
-void *send_file_thread(void *arg) {
-    FileTransfer *transfer = (FileTransfer *)arg;
-    // Header + chuck size
-    char buffer[FILE_CHUNK_SIZE + 256];
-    FILE *file = fopen(transfer->filename, "rb");
-    
-    if (file == NULL) {
-        sprintf(buffer, "%s %d %s", FILE_TRANSFER_ERROR, transfer->transfer_id, "Could not open file");
-        send(transfer->socket_fd, buffer, strlen(buffer), 0);
-        pthread_mutex_lock(&transfer_mutex);
-        transfer->active = 0;
-        pthread_mutex_unlock(&transfer_mutex);
-        return NULL;
-    }
-    
-    // Get file size
-    fseek(file, 0, SEEK_END);
-    transfer->filesize = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    
-    // Send file start message with metadata
-    sprintf(buffer, "%s %d %s %zu", FILE_TRANSFER_START, transfer->transfer_id, transfer->filename, transfer->filesize);
-    send(transfer->socket_fd, buffer, strlen(buffer), 0);
-    
-    size_t bytes_read;
-    size_t total_sent = 0;
-    int chunk_num = 0;
-    
-    // Send file in chunks
-    while ((bytes_read = fread(buffer + 256, 1, FILE_CHUNK_SIZE, file)) > 0) {
-        // Create header for this chunk
-        int header_len = sprintf(buffer, "%s %d %d %zu ", FILE_TRANSFER_CHUNK, transfer->transfer_id, chunk_num, bytes_read);
-        
-        // Move data to make room for header
-        memmove(buffer + header_len, buffer + 256, bytes_read);
-        
-        // Send the chunk
-        int bytes_sent = send(transfer->socket_fd, buffer, header_len + bytes_read, 0);
-        if (bytes_sent <= 0) {
-            fclose(file);
-            pthread_mutex_lock(&transfer_mutex);
-            transfer->active = 0;
-            pthread_mutex_unlock(&transfer_mutex);
-            return NULL;
+// Caller holds transfer_mutex
+FileTransfer *transfer_find(int transfer_id) {
+    FileTransfer *cur = transfers[(unsigned int)transfer_id % TRANSFER_BUCKETS];
+    while (cur != NULL && cur->transfer_id != transfer_id)
+        cur = cur->next;
+    return cur;
+}
+
+// Caller holds transfer_mutex
+FileTransfer *transfer_add(int transfer_id, TransferState state) {
+    FileTransfer *transfer = calloc(1, sizeof(FileTransfer));
+    transfer->transfer_id = transfer_id;
+    transfer->state = state;
+    transfer->file_fd = -1;
+    transfer->nstreams = 1;
+    transfer->refcnt = 1;
+    transfer->seq = ++transfer_seq;
+
+    FileTransfer **bucket = &transfers[(unsigned int)transfer_id % TRANSFER_BUCKETS];
+    transfer->next = *bucket;
+    *bucket = transfer;
+    return transfer;
+}
+
+// Take a transfer out of its bucket, caller holds transfer_mutex
+void transfer_unhash(FileTransfer *transfer) {
+    FileTransfer **link = &transfers[(unsigned int)transfer->transfer_id % TRANSFER_BUCKETS];
+    while (*link != transfer)
+        link = &(*link)->next;
+    *link = transfer->next;
+}
+
+// Move a request from its tag to the ID the server gave it, caller
+// holds transfer_mutex
+void transfer_rekey(FileTransfer *transfer, int transfer_id) {
+    transfer_unhash(transfer);
+    transfer->transfer_id = transfer_id;
+    FileTransfer **bucket = &transfers[(unsigned int)transfer_id % TRANSFER_BUCKETS];
+    transfer->next = *bucket;
+    *bucket = transfer;
+}
+
+// Drop a reference, the last one closes the file and frees. Caller holds
+// transfer_mutex.
+void transfer_put(FileTransfer *transfer) {
+    if (--transfer->refcnt > 0)
+        return;
+    if (transfer->file_fd >= 0)
+        close(transfer->file_fd);
+    free(transfer->offer_frames);
+    free(transfer);
+}
+
+// Unlink and drop the table's reference, caller holds transfer_mutex
+void transfer_remove(FileTransfer *transfer) {
+    transfer_unhash(transfer);
+    transfer_put(transfer);
+}
+
+// Incoming request the next Y/N answers, caller holds transfer_mutex
+FileTransfer *transfer_oldest_prompt() {
+    FileTransfer *oldest = NULL;
+    for (int i = 0; i < TRANSFER_BUCKETS; i++) {
+        for (FileTransfer *cur = transfers[i]; cur != NULL; cur = cur->next) {
+            if (cur->state == XFER_PROMPT && (oldest == NULL || cur->seq < oldest->seq))
+                oldest = cur;
         }
-        
-        total_sent += bytes_read;
-        chunk_num++;
-        
-        // Show progress
-        printf("\rSending %s: %.2f%% (%zu/%zu bytes)", transfer->filename, (float)total_sent / transfer->filesize * 100, total_sent, transfer->filesize);
-        fflush(stdout);
-        
-        // Delay to prevent CPU flooding, inspired by AI
-        usleep(1000);
     }
-    
-    fclose(file);
-    
-    // Send end message
-    sprintf(buffer, "%s %d", FILE_TRANSFER_END, transfer->transfer_id);
-    send(transfer->socket_fd, buffer, strlen(buffer), 0);
-    
-    printf("\nFile %s sent successfully!\n", transfer->filename);
-    
+    return oldest;
+}
+
+// The connection dropped, and the server suspended or cancelled every
+// transfer we were part of. Ours stop too, so nothing goes out under their
+// IDs on the new connection. A file we were receiving is offered again once
+// we are back, one we were sending resumes when it is sent again.
+void transfers_lost() {
     pthread_mutex_lock(&transfer_mutex);
-    transfer->active = 0;
+    for (int i = 0; i < TRANSFER_BUCKETS; i++) {
+        FileTransfer *cur = transfers[i];
+        while (cur != NULL) {
+            FileTransfer *next = cur->next;
+            if (cur->state == XFER_RECEIVING)
+                printf("Receiving %s stopped, it resumes when we are back.\n", cur->filename);
+            else if (cur->state == XFER_SENDING || cur->state == XFER_OFFERED || cur->state == XFER_SUSPENDED)
+                printf("Sending %s stopped, send it again to resume.\n", cur->filename);
+            else if (cur->state != XFER_CANCELLED)
+                printf("Transfer of %s cancelled.\n", cur->filename);
+            // A sending transfer belongs to the pump, it drops it on its turn
+            if (cur->in_pump)
+                cur->state = XFER_CANCELLED;
+            else
+                transfer_remove(cur);
+            cur = next;
+        }
+    }
     pthread_mutex_unlock(&transfer_mutex);
-    
-    return NULL;
 }
 
-// Handle receiving a file
-// AI Assisted. See report.pdf for details.
-void *receive_file_thread(void *arg) {
-    FileTransfer *transfer = (FileTransfer *)arg;
-    FILE *file = fopen(transfer->output_filename, "wb");
-    
-    if (file == NULL) {
-        printf("Error: Could not create file %s\n", transfer->output_filename);
-        pthread_mutex_lock(&transfer_mutex);
-        transfer->active = 0;
-        receiving_file = 0;
-        pthread_mutex_unlock(&transfer_mutex);
-        return NULL;
+// First byte of range i, the server splits files the same way
+size_t stream_start(size_t filesize, int nstreams, int i) {
+    return i >= nstreams ? filesize : filesize / nstreams * i;
+}
+
+// Split a file into ranges, each starting at its first byte
+void transfer_set_streams(FileTransfer *transfer, int nstreams) {
+    transfer->nstreams = nstreams;
+    for (int i = 0; i < nstreams; i++)
+        transfer->pos[i] = stream_start(transfer->filesize, nstreams, i);
+    memset(transfer->crc, 0, sizeof(transfer->crc));
+    transfer->crc_stale = 0;
+    transfer->sent = 0;
+    transfer->wire = 0;
+    transfer->done = 0;
+}
+
+// Move every range to its offset and recount done. The running CRCs only
+// cover the bytes up to the old offsets.
+void transfer_set_pos(FileTransfer *transfer, const size_t *offsets) {
+    transfer->done = 0;
+    for (int i = 0; i < transfer->nstreams; i++) {
+        if (transfer->pos[i] != offsets[i])
+            transfer->crc_stale = 1;
+        transfer->pos[i] = offsets[i];
+        transfer->done += offsets[i] - stream_start(transfer->filesize, transfer->nstreams, i);
     }
-    
-    printf("Receiving file: %s (Size: %zu bytes)\n", transfer->filename, transfer->filesize);
-    
-    // File will be received in the main receive loop
-    // This thread just waits until the transfer is complete
+}
+
+// Whole file CRC32C: the range CRCs joined up, or read back from the file
+// once a resume left them short. Returns -1 if the file cannot be read.
+int transfer_digest(FileTransfer *transfer, uint32_t *digest) {
+    if (transfer->crc_stale)
+        return file_crc32c(transfer->file_fd, transfer->filesize, digest);
+    uint32_t crc = 0;
+    for (int i = 0; i < transfer->nstreams; i++) {
+        size_t len = stream_start(transfer->filesize, transfer->nstreams, i + 1) -
+                     stream_start(transfer->filesize, transfer->nstreams, i);
+        crc = crc32c_combine(crc, transfer->crc[i], len);
+    }
+    *digest = crc;
+    return 0;
+}
+
+// Per range offsets travel as one comma separated word
+void format_offsets(char *out, const size_t *offsets, int n) {
+    out += sprintf(out, "%zu", offsets[0]);
+    for (int i = 1; i < n; i++)
+        out += sprintf(out, ",%zu", offsets[i]);
+}
+
+// Number of ranges an offsets word describes
+int count_offsets(const char *word) {
+    int n = 1;
+    for (; *word; word++) {
+        if (*word == ',')
+            n++;
+    }
+    return n < FILE_MAX_STREAMS ? n : FILE_MAX_STREAMS;
+}
+
+// Returns 0 unless word holds one valid offset per range of the transfer
+int parse_offsets(const char *word, size_t *offsets, FileTransfer *transfer) {
+    int n = 0;
+    while (n < FILE_MAX_STREAMS) {
+        char *end;
+        offsets[n] = strtoull(word, &end, 10);
+        if (end == word || offsets[n] < stream_start(transfer->filesize, transfer->nstreams, n) ||
+            offsets[n] > stream_start(transfer->filesize, transfer->nstreams, n + 1))
+            return 0;
+        n++;
+        if (*end != ',')
+            break;
+        word = end + 1;
+    }
+    return n == transfer->nstreams;
+}
+
+// Hand a transfer to the pump, caller holds transfer_mutex
+void pump_enqueue(FileTransfer *transfer) {
+    transfer->in_pump = 1;
+    transfer->send_next = NULL;
+    if (send_tail != NULL)
+        send_tail->send_next = transfer;
+    else
+        send_head = transfer;
+    send_tail = transfer;
+    pthread_cond_signal(&pump_cond);
+}
+
+// Progress line, not more than once per second per transfer
+void show_progress(FileTransfer *transfer, const char *verb) {
+    time_t now = time(NULL);
+    if (now > transfer->last_update || transfer->done == transfer->filesize) {
+        printf("\r%s %s: %.2f%% (%zu/%zu bytes)", verb, transfer->filename, transfer->filesize ? (float)transfer->done / transfer->filesize * 100 : 100, transfer->done, transfer->filesize);
+        fflush(stdout);
+        transfer->last_update = now;
+    }
+}
+
+// LZ4 block of a frame into packed when that saves at least an eighth,
+// returns 0 to send it as is. Each frame that does not shrink doubles the
+// number sent raw before the next try, up to FILE_PACK_BACKOFF. A file
+// offered to the chunk store tries every frame, so the frames it uploads
+// are the ones it keyed.
+size_t pack_frame(FileTransfer *transfer, const char *chunk, size_t len, char *packed) {
+    if (!transfer->compress)
+        return 0;
+    if (transfer->offer)
+        return lz4_compress(chunk, len, packed, len - len / 8);
+    if (transfer->pack_skip > 0) {
+        transfer->pack_skip--;
+        return 0;
+    }
+    size_t n = lz4_compress(chunk, len, packed, len - len / 8);
+    if (n > 0) {
+        transfer->pack_backoff = 0;
+    } else {
+        transfer->pack_backoff = transfer->pack_backoff ? transfer->pack_backoff * 2 : 1;
+        if (transfer->pack_backoff > FILE_PACK_BACKOFF)
+            transfer->pack_backoff = FILE_PACK_BACKOFF;
+        transfer->pack_skip = transfer->pack_backoff;
+    }
+    return n;
+}
+
+// Remember a frame of an offered file by its chunk store key, the SHA-256
+// of its flags, CRC and body as they go on the wire
+void offer_add(FileTransfer *transfer, uint64_t offset, int flags, const char *body, size_t len,
+               uint32_t crc) {
+    if (transfer->offer_count == transfer->offer_cap) {
+        transfer->offer_cap = transfer->offer_cap ? transfer->offer_cap * 2 : 64;
+        transfer->offer_frames = realloc(transfer->offer_frames,
+                                         transfer->offer_cap * sizeof(OfferFrame));
+    }
+    OfferFrame *frame = &transfer->offer_frames[transfer->offer_count++];
+    unsigned char f = FRAME_CRC | flags;
+    uint32_t ncrc = htonl(crc);
+    SHA256_CTX ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, &f, 1);
+    sha256_update(&ctx, &ncrc, sizeof(ncrc));
+    sha256_update(&ctx, body, len);
+    sha256_final(&ctx, frame->key);
+    frame->offset = offset;
+}
+
+int offer_frame_cmp(const void *a, const void *b) {
+    uint64_t x = ((const OfferFrame *)a)->offset, y = ((const OfferFrame *)b)->offset;
+    return x < y ? -1 : x > y;
+}
+
+// What START offers: the SHA-256 of the file size, the range count and
+// every frame's offset and key in file order, in hex
+void offer_key(FileTransfer *transfer, char *hex) {
+    qsort(transfer->offer_frames, transfer->offer_count, sizeof(OfferFrame), offer_frame_cmp);
+    uint64_t size = htobe64(transfer->filesize);
+    uint32_t n = htonl(transfer->nstreams);
+    SHA256_CTX ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, &size, sizeof(size));
+    sha256_update(&ctx, &n, sizeof(n));
+    for (int i = 0; i < transfer->offer_count; i++) {
+        uint64_t offset = htobe64(transfer->offer_frames[i].offset);
+        sha256_update(&ctx, &offset, sizeof(offset));
+        sha256_update(&ctx, transfer->offer_frames[i].key, SHA256_LEN);
+    }
+    unsigned char key[SHA256_LEN];
+    sha256_final(&ctx, key);
+    for (int i = 0; i < SHA256_LEN; i++)
+        hex += sprintf(hex, "%02x", key[i]);
+}
+
+// Sends every outgoing file, one frame per transfer per turn, so several
+// transfers share the socket evenly and chat only waits for one frame.
+// Within a transfer the turns rotate over its ranges.
+// A file offered to the chunk store goes through once to be keyed first.
+void *send_pump_thread(void *args) {
+    pthread_detach(pthread_self());
+    char buffer[BUFFER_SIZE];
+    char *chunk = malloc(FILE_FRAME_SIZE);
+    char *packed = malloc(FILE_FRAME_SIZE);
+
     while (1) {
         pthread_mutex_lock(&transfer_mutex);
-        int active = transfer->active;
+        while (send_head == NULL)
+            pthread_cond_wait(&pump_cond, &transfer_mutex);
+        FileTransfer *transfer = send_head;
+        send_head = transfer->send_next;
+        if (send_head == NULL)
+            send_tail = NULL;
+        // A resume restarts from what the receiver has written
+        if (transfer->resume) {
+            transfer_set_pos(transfer, transfer->resume_pos);
+            transfer->resume = 0;
+        }
+        int sending = transfer->state == XFER_SENDING;
         pthread_mutex_unlock(&transfer_mutex);
-        
-        if (!active) {
+
+        // Only this thread touches a transfer while it is sending
+        int failed = 0;
+        for (int i = 0; sending && i < transfer->nstreams; i++) {
+            int s = (transfer->next_stream + i) % transfer->nstreams;
+            size_t end = stream_start(transfer->filesize, transfer->nstreams, s + 1);
+            if (transfer->pos[s] >= end)
+                continue;
+            size_t len = end - transfer->pos[s];
+            if (len > FILE_FRAME_SIZE)
+                len = FILE_FRAME_SIZE;
+            // The CRC is taken from a copy, but a frame that is not packed
+            // goes out with sendfile(). If the file changes in between, the
+            // receiver finds the frame does not match and the range stops.
+            int ok = pread_all(transfer->file_fd, chunk, len, transfer->pos[s]) == 0;
+            uint32_t crc = ok ? crc32c(0, chunk, len) : 0;
+            size_t packed_len = ok ? pack_frame(transfer, chunk, len, packed) : 0;
+            int flags = packed_len ? FRAME_LZ4 : 0;
+            const char *body = packed_len ? packed : chunk;
+            size_t body_len = packed_len ? packed_len : len;
+            if (!ok) {
+                failed = 1;
+            } else if (transfer->offer == 1) {
+                // Keying, nothing is sent before the store answers
+                offer_add(transfer, transfer->pos[s], flags, body, body_len, crc);
+            } else if (send_file_frame(transfer->transfer_id, flags, transfer->file_fd, transfer->pos[s],
+                                       packed_len ? packed : NULL, body_len, crc) < 0) {
+                failed = 1;
+            } else {
+                transfer->sent += len;
+                transfer->wire += body_len;
+            }
+            if (!failed) {
+                transfer->crc[s] = crc32c_combine(transfer->crc[s], crc, len);
+                transfer->pos[s] += len;
+                transfer->done += len;
+                show_progress(transfer, transfer->offer == 1 ? "Checking" : "Sending");
+            }
+            transfer->next_stream = s + 1;
             break;
         }
-        
-        // Sleep a bit to avoid CPU flooding, inspired by AI
-        usleep(100000);
+
+        pthread_mutex_lock(&transfer_mutex);
+        if (!failed && transfer->state == XFER_SENDING &&
+            (transfer->done < transfer->filesize || transfer->resume)) {
+            pump_enqueue(transfer);
+            pthread_mutex_unlock(&transfer_mutex);
+            continue;
+        }
+        if (!failed && transfer->state == XFER_SENDING && transfer->offer == 1) {
+            // Every frame is keyed: offer the file, the answer decides
+            // whether it is sent at all
+            char key[2 * SHA256_LEN + 1];
+            offer_key(transfer, key);
+            transfer->offer = 2;
+            transfer->state = XFER_OFFERED;
+            transfer->in_pump = 0;
+            sprintf(buffer, "%s %d %s %zu %d %s", FILE_TRANSFER_START, transfer->transfer_id,
+                    transfer->filename, transfer->filesize, transfer->nstreams, key);
+            pthread_mutex_unlock(&transfer_mutex);
+            send_data_ctrl(buffer);
+            continue;
+        }
+        if (!failed && transfer->state == XFER_SUSPENDED) {
+            // Parked until FILE_TRANSFER_RESUME queues it again
+            transfer->in_pump = 0;
+            pthread_mutex_unlock(&transfer_mutex);
+            continue;
+        }
+        int cancelled = transfer->state == XFER_CANCELLED;
+        pthread_mutex_unlock(&transfer_mutex);
+
+        uint32_t digest;
+        if (!failed && !cancelled && transfer_digest(transfer, &digest) < 0)
+            failed = 1;
+        if (failed && !cancelled) {
+            sprintf(buffer, "%s %d %s", FILE_TRANSFER_ERROR, transfer->transfer_id, "Could not read file");
+            send_data_ctrl(buffer);
+        } else if (!cancelled) {
+            // Send end message, the receiver checks the file against the digest
+            sprintf(buffer, "%s %d %08x", FILE_TRANSFER_END, transfer->transfer_id, digest);
+            send_data_ctrl(buffer);
+            printf("\nFile %s sent successfully!\n", transfer->filename);
+            if (transfer->wire < transfer->sent)
+                printf("Compressed to %zu%% of its size on the wire.\n",
+                       transfer->wire * 100 / transfer->sent);
+        }
+
+        pthread_mutex_lock(&transfer_mutex);
+        transfer_remove(transfer);
+        pthread_mutex_unlock(&transfer_mutex);
     }
-    
-    fclose(file);
-    printf("\nFile received and saved as: %s\n", transfer->output_filename);
-    
-    pthread_mutex_lock(&transfer_mutex);
-    receiving_file = 0;
-    pthread_mutex_unlock(&transfer_mutex);
-    
+
     return NULL;
 }
 
 // Parse the SEND file transfer command
 int parse_send_command(const char *buffer, char *receiver, char *filename) {
-    // Format is: SEND receiver_name filename
+    // Format is: SEND receiver_name filename, receiver_name * sends to
+    // everyone in the room
     char cmd[10];
-    int result = sscanf(buffer, "%s %s %s", cmd, receiver, filename);
+    int result = sscanf(buffer, "%9s %49s %255s", cmd, receiver, filename);
     
     if (result != 3) {
         return 0;
@@ -296,6 +1188,59 @@ int parse_send_command(const char *buffer, char *receiver, char *filename) {
     return 1;
 }
 
+void *thread_main_data(void *args);
+
+// Open the file data connection the server issued token for. Until it
+// is up, or if it cannot be opened, file data shares the chat connection.
+void open_data_channel(const char *token) {
+    pthread_mutex_lock(&data.lock);
+    int up = data.fd >= 0;
+    pthread_mutex_unlock(&data.lock);
+    if (up)
+        return;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return;
+    if (connect(fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+        close(fd);
+        return;
+    }
+
+    // Same handshake as the chat connection, then the token instead of a
+    // join. The server echoes MSG_ATTACH once the token checks out.
+    char hello[4];
+    memcpy(hello, PROTO_MAGIC, 3);
+    hello[3] = PROTO_VERSION;
+    data_reader.fd = fd;
+    data_reader.len = data_reader.consumed = 0;
+    FRAME_HDR hdr;
+    char *payload;
+    if (send(fd, hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello) ||
+        read_frame(&data_reader, &hdr, &payload) <= 0 || hdr.type != MSG_HELLO ||
+        write_frame(fd, MSG_ATTACH, 0, token, strlen(token)) < 0 ||
+        read_frame(&data_reader, &hdr, &payload) <= 0 || hdr.type != MSG_ATTACH) {
+        close(fd);
+        return;
+    }
+
+    pthread_mutex_lock(&data.lock);
+    data.fd = fd;
+    pthread_mutex_unlock(&data.lock);
+    atomic_store(&data_running, 1);
+    pthread_t tid;
+    pthread_create(&tid, NULL, thread_main_data, NULL);
+}
+
+// Connecting blocks, so the data connection is opened on a thread of its
+// own rather than the one that reads chat
+void *thread_attach_data(void *args) {
+    pthread_detach(pthread_self());
+    open_data_channel((char *)args);
+    free(args);
+    atomic_store(&data_attaching, 0);
+    return NULL;
+}
+
 // Handle special commands and file transfer messages
 // AI Assisted. See report.pdf for details.
 int handle_special_message(char *buffer) {
@@ -306,113 +1251,198 @@ int handle_special_message(char *buffer) {
         char sender[50], filename[256];
         size_t filesize;
         
-        sscanf(buffer, "%*s %d %s %s %zu", &transfer_id, sender, filename, &filesize);
+        if (sscanf(buffer, "%*s %d %49s %255s %zu", &transfer_id, sender, filename, &filesize) != 4)
+            return 1;
+        
+        pthread_mutex_lock(&transfer_mutex);
+        if (transfer_find(transfer_id) == NULL) {
+            FileTransfer *transfer = transfer_add(transfer_id, XFER_PROMPT);
+            strcpy(transfer->sender_name, sender);
+            strcpy(transfer->filename, filename);
+            transfer->filesize = filesize;
+            
+            printf("\nFile transfer request from %s:\n", sender);
+            printf("File: %s (Size: %zu bytes)\n", filename, filesize);
+            printf("Accept? (Y/N): ");
+            fflush(stdout);
+        }
+        pthread_mutex_unlock(&transfer_mutex);
         
-        printf("\nFile transfer request from %s:\n", sender);
-        printf("File: %s (Size: %zu bytes)\n", filename, filesize);
-        printf("Accept? (Y/N): ");
+        return 1;
+    }
+    else if (strncmp(buffer, FILE_TRANSFER_ID, strlen(FILE_TRANSFER_ID)) == 0) {
+        // Parse: FILE_TRANSFER_ID tag transfer_id
+        int tag, transfer_id;
+        if (sscanf(buffer, "%*s %d %d", &tag, &transfer_id) != 2)
+            return 1;
         
         pthread_mutex_lock(&transfer_mutex);
-        waiting_for_transfer_response = 1;
-        current_transfer.transfer_id = transfer_id;
-        strcpy(current_transfer.sender_name, sender);
-        strcpy(current_transfer.filename, filename);
-        current_transfer.filesize = filesize;
-        current_transfer.socket_fd = sockfd;
+        FileTransfer *transfer = transfer_find(tag);
+        if (tag < 0 && transfer_id > 0 && transfer != NULL && transfer->state == XFER_REQUESTED)
+            transfer_rekey(transfer, transfer_id);
         pthread_mutex_unlock(&transfer_mutex);
         
         return 1;
     }
-    else if (strncmp(buffer, FILE_TRANSFER_START, strlen(FILE_TRANSFER_START)) == 0) {
-        // Parse: FILE_TRANSFER_START transfer_id filename filesize
+    else if (strncmp(buffer, FILE_TRANSFER_ACCEPT, strlen(FILE_TRANSFER_ACCEPT)) == 0) {
+        // Parse: FILE_TRANSFER_ACCEPT transfer_id [codecs]
         int transfer_id;
-        char filename[256];
-        size_t filesize;
+        char codecs[32];
+        int fields = sscanf(buffer, "%*s %d %31s", &transfer_id, codecs);
         
-        sscanf(buffer, "%*s %d %s %zu", &transfer_id, filename, &filesize);
+        pthread_mutex_lock(&transfer_mutex);
+        FileTransfer *transfer = transfer_find(transfer_id);
+        if (transfer == NULL || transfer->state != XFER_REQUESTED) {
+            pthread_mutex_unlock(&transfer_mutex);
+            return 1;
+        }
         
-        // Generate unique filename to avoid overwriting
-        char output_filename[256];
-        generate_unique_filename(filename, output_filename);
+        // The server tells a room how many accepted
+        if (strcmp(transfer->receiver_name, FILE_TO_ROOM) != 0)
+            printf("%s accepted the transfer.\n", transfer->receiver_name);
         
-        pthread_mutex_lock(&transfer_mutex);
-        current_transfer.transfer_id = transfer_id;
-        strcpy(current_transfer.filename, filename);
-        strcpy(current_transfer.output_filename, output_filename);
-        current_transfer.filesize = filesize;
-        current_transfer.active = 1;
-        receiving_file = 1;
+        char msg[BUFFER_SIZE];
+        transfer->file_fd = open(transfer->filename, O_RDONLY);
+        if (transfer->file_fd < 0) {
+            transfer_remove(transfer);
+            pthread_mutex_unlock(&transfer_mutex);
+            sprintf(msg, "%s %d %s", FILE_TRANSFER_ERROR, transfer_id, "Could not open file");
+            send_ctrl(msg);
+            return 1;
+        }
+        
+        // Get file size
+        struct stat st;
+        fstat(transfer->file_fd, &st);
+        transfer->filesize = st.st_size;
+        transfer_set_streams(transfer, transfer->filesize >= FILE_STREAM_MIN ? FILE_STREAMS : 1);
+        transfer->compress = fields == 2 && codec_listed(codecs, FILE_CODEC_LZ4, strlen(FILE_CODEC_LZ4));
+        // With a chunk store the pump keys the file and sends START itself.
+        // Keying reads the whole file before anything is sent, which only
+        // pays off for files the store could save sending. Sending to a
+        // room is one upload already.
+        transfer->offer = chunk_store && transfer->filesize >= FILE_OFFER_MIN &&
+                          strcmp(transfer->receiver_name, FILE_TO_ROOM) != 0;
+        int offer = transfer->offer;
+        transfer->state = XFER_SENDING;
         pthread_mutex_unlock(&transfer_mutex);
         
-        // Create a new thread to handle the file reception
-        pthread_create(&current_transfer.thread_id, NULL, receive_file_thread, &current_transfer);
+        // Send file start message with metadata, then the pump sends the
+        // data. Nothing else removes a transfer that is not queued yet.
+        if (!offer) {
+            sprintf(msg, "%s %d %s %zu %d", FILE_TRANSFER_START, transfer_id, transfer->filename,
+                    transfer->filesize, transfer->nstreams);
+            send_data_ctrl(msg);
+        }
+        
+        pthread_mutex_lock(&transfer_mutex);
+        pump_enqueue(transfer);
+        pthread_mutex_unlock(&transfer_mutex);
         
         return 1;
     }
-    else if (strncmp(buffer, FILE_TRANSFER_CHUNK, strlen(FILE_TRANSFER_CHUNK)) == 0) {
-        // Parse: FILE_TRANSFER_CHUNK transfer_id chunk_num chunk_size [data]
-        int transfer_id, chunk_num;
-        size_t chunk_size;
-        char *header_end;
+    else if (strncmp(buffer, FILE_TRANSFER_REJECT, strlen(FILE_TRANSFER_REJECT)) == 0) {
+        // Parse: FILE_TRANSFER_REJECT transfer_id
+        int transfer_id;
+        sscanf(buffer, "%*s %d", &transfer_id);
         
-        // Find the fourth space which marks the end of the header
-        char *space1 = strchr(buffer, ' ');
-        if (!space1) return 0;
-        char *space2 = strchr(space1 + 1, ' ');
-        if (!space2) return 0;
-        char *space3 = strchr(space2 + 1, ' ');
-        if (!space3) return 0;
-        header_end = strchr(space3 + 1, ' ');
-        if (!header_end) return 0;
+        pthread_mutex_lock(&transfer_mutex);
+        FileTransfer *transfer = transfer_find(transfer_id);
+        if (transfer != NULL && transfer->state == XFER_REQUESTED) {
+            if (strcmp(transfer->receiver_name, FILE_TO_ROOM) != 0)
+                printf("%s rejected the transfer.\n", transfer->receiver_name);
+            transfer_remove(transfer);
+        }
+        pthread_mutex_unlock(&transfer_mutex);
         
-        // Parse header
-        sscanf(buffer, "%*s %d %d %zu", &transfer_id, &chunk_num, &chunk_size);
+        return 1;
+    }
+    else if (strncmp(buffer, FILE_TRANSFER_START, strlen(FILE_TRANSFER_START)) == 0) {
+        // Parse: FILE_TRANSFER_START transfer_id filename filesize [streams]
+        int transfer_id, nstreams = 1;
+        char filename[256];
+        size_t filesize;
         
-        // Get data portion
-        char *data = header_end + 1;
+        sscanf(buffer, "%*s %d %255s %zu %d", &transfer_id, filename, &filesize, &nstreams);
+        if (nstreams < 1 || nstreams > FILE_MAX_STREAMS)
+            nstreams = 1;
         
-        // Check if we're actively receiving a file
         pthread_mutex_lock(&transfer_mutex);
-        int is_receiving = receiving_file && current_transfer.active && current_transfer.transfer_id == transfer_id;
-        pthread_mutex_unlock(&transfer_mutex);
+        FileTransfer *transfer = transfer_find(transfer_id);
+        if (transfer == NULL || transfer->state != XFER_ACCEPTED) {
+            pthread_mutex_unlock(&transfer_mutex);
+            return 1;
+        }
         
-        if (is_receiving) {
-            // Write chunk to file
-            FILE *file = fopen(current_transfer.output_filename, "ab");
-            if (file) {
-                fwrite(data, 1, chunk_size, file);
-                fclose(file);
-                
-                // Show progress
-                static time_t last_update = 0;
-                time_t now = time(NULL);
-                
-                // Get current file size
-                struct stat st;
-                stat(current_transfer.output_filename, &st);
-                size_t current_size = st.st_size;
-                
-                // Update progress not more than once per second
-                if (now > last_update || current_size == current_transfer.filesize) {
-                    printf("\rReceiving %s: %.2f%% (%zu/%zu bytes)", current_transfer.filename, (float)current_size / current_transfer.filesize * 100, current_size, current_transfer.filesize);
-                    fflush(stdout);
-                    last_update = now;
-                }
-            }
+        // Kept open for the whole transfer, data frames are written at their
+        // offset. A resumed transfer reads it back for the digest.
+        transfer->file_fd = open(transfer->output_filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (transfer->file_fd < 0) {
+            printf("Error: Could not create file %s\n", transfer->output_filename);
+            transfer_remove(transfer);
+            pthread_mutex_unlock(&transfer_mutex);
+            char err[BUFFER_SIZE];
+            sprintf(err, "%s %d %s", FILE_TRANSFER_ERROR, transfer_id, "Receiver could not create file");
+            send_ctrl(err);
+            return 1;
         }
         
+        transfer->filesize = filesize;
+        transfer_set_streams(transfer, nstreams);
+        transfer->state = XFER_RECEIVING;
+        printf("Receiving file: %s (Size: %zu bytes)\n", transfer->filename, filesize);
+        
+        // The server offers our file name back if we drop, let it know
+        // before the first progress ACK would
+        char offsets[FILE_MAX_STREAMS * 21], ack[BUFFER_SIZE];
+        format_offsets(offsets, transfer->pos, transfer->nstreams);
+        sprintf(ack, "%s %s %d %s %d %s", "CMD", FILE_TRANSFER_ACK, transfer_id,
+                offsets, transfer->epoch, transfer->output_filename);
+        pthread_mutex_unlock(&transfer_mutex);
+        send_ctrl(ack);
+        
         return 1;
     }
     else if (strncmp(buffer, FILE_TRANSFER_END, strlen(FILE_TRANSFER_END)) == 0) {
-        // Parse: FILE_TRANSFER_END transfer_id
+        // Parse: FILE_TRANSFER_END transfer_id [digest]
         int transfer_id;
-        sscanf(buffer, "%*s %d", &transfer_id);
+        unsigned int expected;
+        int fields = sscanf(buffer, "%*s %d %x", &transfer_id, &expected);
         
+        // Out of the table the file can be read back for the digest
+        // without holding up the other transfers
         pthread_mutex_lock(&transfer_mutex);
-        if (receiving_file && current_transfer.transfer_id == transfer_id) {
-            current_transfer.active = 0;
+        FileTransfer *transfer = transfer_find(transfer_id);
+        if (transfer == NULL || transfer->state != XFER_RECEIVING) {
+            pthread_mutex_unlock(&transfer_mutex);
+            return 1;
+        }
+        transfer_unhash(transfer);
+        pthread_mutex_unlock(&transfer_mutex);
+        
+        // The sender hears how it went, with our END or an error
+        // Frames overtake each other when the data connection attaches
+        // midway, which leaves a range short of bytes that did arrive.
+        // The file itself decides then.
+        char verdict[BUFFER_SIZE];
+        uint32_t digest = 0;
+        if (transfer->done < transfer->filesize)
+            transfer->crc_stale = 1;
+        if (fields < 2 || (transfer_digest(transfer, &digest) == 0 && digest == expected)) {
             printf("\nFile transfer completed!\n");
+            printf("File received and saved as: %s\n", transfer->output_filename);
+            if (fields == 2)
+                printf("CRC32C %08x verified.\n", digest);
+            sprintf(verdict, "%s %d", FILE_TRANSFER_END, transfer_id);
+        } else {
+            printf("\nFile transfer failed: %s does not match what %s sent.\n",
+                   transfer->output_filename, transfer->sender_name);
+            sprintf(verdict, "%s %d %s", FILE_TRANSFER_ERROR, transfer_id,
+                    "Receiver's file does not match what was sent");
         }
+        send_ctrl(verdict);
+        pthread_mutex_lock(&transfer_mutex);
+        transfer_put(transfer);
         pthread_mutex_unlock(&transfer_mutex);
         
         return 1;
@@ -435,16 +1465,242 @@ int handle_special_message(char *buffer) {
         printf("\nFile transfer error: %s\n", error_msg);
         
         pthread_mutex_lock(&transfer_mutex);
-        if ((receiving_file || waiting_for_transfer_response) && 
-            current_transfer.transfer_id == transfer_id) {
-            receiving_file = 0;
-            waiting_for_transfer_response = 0;
-            current_transfer.active = 0;
+        FileTransfer *transfer = transfer_find(transfer_id);
+        if (transfer != NULL) {
+            // A sending transfer belongs to the pump, it drops it on its turn
+            if (transfer->in_pump)
+                transfer->state = XFER_CANCELLED;
+            else
+                transfer_remove(transfer);
+        }
+        pthread_mutex_unlock(&transfer_mutex);
+        
+        return 1;
+    }
+    
+    else if (strncmp(buffer, FILE_TRANSFER_SUSPEND, strlen(FILE_TRANSFER_SUSPEND)) == 0) {
+        // Parse: FILE_TRANSFER_SUSPEND transfer_id offsets epoch
+        int transfer_id, epoch;
+        char word[FILE_MAX_STREAMS * 21];
+        size_t offsets[FILE_MAX_STREAMS];
+        if (sscanf(buffer, "%*s %d %167s %d", &transfer_id, word, &epoch) != 3)
+            return 1;
+        
+        pthread_mutex_lock(&transfer_mutex);
+        FileTransfer *transfer = transfer_find(transfer_id);
+        if (transfer != NULL &&
+            (transfer->state == XFER_SENDING || transfer->state == XFER_OFFERED)) {
+            // An offered file is sent from the resume offsets, whatever
+            // the store says
+            transfer->state = XFER_SUSPENDED;
+            printf("\n%s dropped out, %s will resume when they are back.\n",
+                   transfer->receiver_name, transfer->filename);
+        } else if (transfer != NULL && transfer->state == XFER_RECEIVING &&
+                   parse_offsets(word, offsets, transfer)) {
+            // Data past the offsets may be padding from a cut-off frame
+            for (int i = 0; i < transfer->nstreams; i++) {
+                if (offsets[i] > transfer->pos[i])
+                    offsets[i] = transfer->pos[i];
+            }
+            transfer_set_pos(transfer, offsets);
+            transfer->acked = transfer->done;
+            transfer->epoch = epoch;
+            printf("\n%s dropped out, %s will resume when they are back.\n",
+                   transfer->sender_name, transfer->filename);
+        }
+        pthread_mutex_unlock(&transfer_mutex);
+        
+        return 1;
+    }
+    else if (strncmp(buffer, FILE_TRANSFER_RESUME, strlen(FILE_TRANSFER_RESUME)) == 0) {
+        int transfer_id, epoch, tag;
+        size_t filesize;
+        char word[FILE_MAX_STREAMS * 21], sender[50], filename[256], output[256];
+        size_t offsets[FILE_MAX_STREAMS];
+        char msg[BUFFER_SIZE];
+        
+        // Our SEND picked up a transfer we were sending when we dropped:
+        // FILE_TRANSFER_RESUME tag transfer_id offsets filesize [codecs]
+        if (sscanf(buffer, "%*s %d", &tag) == 1 && tag < 0) {
+            char codecs[32];
+            int fields = sscanf(buffer, "%*s %d %d %167s %zu %31s", &tag, &transfer_id, word, &filesize, codecs);
+            if (fields < 4)
+                return 1;
+            
+            pthread_mutex_lock(&transfer_mutex);
+            FileTransfer *transfer = transfer_find(tag);
+            if (transfer == NULL || transfer->state != XFER_REQUESTED) {
+                pthread_mutex_unlock(&transfer_mutex);
+                return 1;
+            }
+            transfer_rekey(transfer, transfer_id);
+            
+            // There is one offset per range the file was split into
+            transfer->filesize = filesize;
+            transfer_set_streams(transfer, count_offsets(word));
+            
+            // Only the same file may continue where the old one stopped
+            struct stat st;
+            transfer->file_fd = open(transfer->filename, O_RDONLY);
+            if (transfer->file_fd < 0 || fstat(transfer->file_fd, &st) < 0 ||
+                (size_t)st.st_size != filesize || !parse_offsets(word, offsets, transfer)) {
+                transfer_remove(transfer);
+                pthread_mutex_unlock(&transfer_mutex);
+                sprintf(msg, "%s %d %s", FILE_TRANSFER_ERROR, transfer_id, "File changed, cannot resume");
+                send_ctrl(msg);
+                return 1;
+            }
+            
+            transfer_set_pos(transfer, offsets);
+            transfer->compress = fields == 5 && codec_listed(codecs, FILE_CODEC_LZ4, strlen(FILE_CODEC_LZ4));
+            transfer->state = XFER_SENDING;
+            printf("Resuming %s at byte %zu of %zu.\n", transfer->filename, transfer->done, filesize);
+            pump_enqueue(transfer);
+            pthread_mutex_unlock(&transfer_mutex);
+            return 1;
+        }
+        
+        // Parse: FILE_TRANSFER_RESUME transfer_id offsets [epoch [sender filename filesize output_file]]
+        int fields = sscanf(buffer, "%*s %d %167s %d %49s %255s %zu %255s", &transfer_id, word,
+                            &epoch, sender, filename, &filesize, output);
+        if (fields < 2)
+            return 1;
+        
+        pthread_mutex_lock(&transfer_mutex);
+        FileTransfer *transfer = transfer_find(transfer_id);
+        if (fields == 2 && transfer != NULL &&
+            (transfer->state == XFER_SUSPENDED || transfer->state == XFER_SENDING) &&
+            parse_offsets(word, transfer->resume_pos, transfer)) {
+            // The receiver is back, send again from what it has
+            transfer->resume = 1;
+            transfer->state = XFER_SENDING;
+            if (!transfer->in_pump)
+                pump_enqueue(transfer);
+            printf("\n%s is back, resuming %s.\n", transfer->receiver_name, transfer->filename);
+        } else if (fields == 3 && transfer != NULL && transfer->state == XFER_RECEIVING &&
+                   parse_offsets(word, offsets, transfer)) {
+            // The sender is back and sends again from the offsets. Its
+            // first frames may have beaten this message here on the data
+            // connection, so never move a range forward.
+            for (int i = 0; i < transfer->nstreams; i++) {
+                if (offsets[i] > transfer->pos[i])
+                    offsets[i] = transfer->pos[i];
+            }
+            transfer_set_pos(transfer, offsets);
+            transfer->acked = transfer->done;
+            transfer->epoch = epoch;
+            printf("\n%s is back, resuming %s at byte %zu.\n", transfer->sender_name, transfer->filename, transfer->done);
+        } else if (fields == 7 && transfer == NULL) {
+            // We dropped while receiving, carry on writing the same file
+            int fd = open(output, O_RDWR | O_CREAT, 0644);
+            struct stat st;
+            if (fd < 0 || fstat(fd, &st) < 0) {
+                if (fd >= 0)
+                    close(fd);
+                pthread_mutex_unlock(&transfer_mutex);
+                printf("Error: Could not reopen %s\n", output);
+                sprintf(msg, "%s %d %s", FILE_TRANSFER_ERROR, transfer_id, "Receiver could not reopen file");
+                send_ctrl(msg);
+                return 1;
+            }
+            
+            transfer = transfer_add(transfer_id, XFER_RECEIVING);
+            strcpy(transfer->sender_name, sender);
+            strcpy(transfer->filename, filename);
+            strcpy(transfer->output_filename, output);
+            transfer->filesize = filesize;
+            transfer->file_fd = fd;
+            transfer->epoch = epoch;
+            transfer_set_streams(transfer, count_offsets(word));
+            if (!parse_offsets(word, offsets, transfer)) {
+                transfer_remove(transfer);
+                pthread_mutex_unlock(&transfer_mutex);
+                return 1;
+            }
+            
+            // What is on disk may be shorter than what the server knows of
+            for (int i = 0; i < transfer->nstreams; i++) {
+                size_t start = stream_start(filesize, transfer->nstreams, i);
+                if (offsets[i] > (size_t)st.st_size)
+                    offsets[i] = (size_t)st.st_size > start ? (size_t)st.st_size : start;
+            }
+            transfer_set_pos(transfer, offsets);
+            transfer->acked = transfer->done;
+            format_offsets(word, offsets, transfer->nstreams);
+            pthread_mutex_unlock(&transfer_mutex);
+            
+            printf("Resuming %s from %s into %s at byte %zu of %zu.\n", filename, sender, output, transfer->done, filesize);
+            sprintf(msg, "%s %s %d %s", "CMD", FILE_TRANSFER_RESUME, transfer_id, word);
+            send_ctrl(msg);
+            return 1;
+        }
+        pthread_mutex_unlock(&transfer_mutex);
+        
+        return 1;
+    }
+    else if (strncmp(buffer, FILE_TRANSFER_STORED, strlen(FILE_TRANSFER_STORED)) == 0) {
+        // Parse: FILE_TRANSFER_STORED transfer_id
+        // The receiver got the file from the chunk store, only the digest
+        // is left to send
+        int transfer_id;
+        if (sscanf(buffer, "%*s %d", &transfer_id) != 1)
+            return 1;
+        
+        pthread_mutex_lock(&transfer_mutex);
+        FileTransfer *transfer = transfer_find(transfer_id);
+        if (transfer == NULL || transfer->state != XFER_OFFERED) {
+            pthread_mutex_unlock(&transfer_mutex);
+            return 1;
+        }
+        char msg[BUFFER_SIZE];
+        uint32_t digest;
+        if (transfer_digest(transfer, &digest) == 0)
+            sprintf(msg, "%s %d %08x", FILE_TRANSFER_END, transfer_id, digest);
+        else
+            sprintf(msg, "%s %d %s", FILE_TRANSFER_ERROR, transfer_id, "Could not read file");
+        printf("\nFile %s sent from the server's chunk store!\n", transfer->filename);
+        transfer_remove(transfer);
+        pthread_mutex_unlock(&transfer_mutex);
+        send_data_ctrl(msg);
+        
+        return 1;
+    }
+    else if (strncmp(buffer, FILE_TRANSFER_UPLOAD, strlen(FILE_TRANSFER_UPLOAD)) == 0) {
+        // Parse: FILE_TRANSFER_UPLOAD transfer_id
+        // The store does not have it, send the file from the start
+        int transfer_id;
+        if (sscanf(buffer, "%*s %d", &transfer_id) != 1)
+            return 1;
+        
+        pthread_mutex_lock(&transfer_mutex);
+        FileTransfer *transfer = transfer_find(transfer_id);
+        if (transfer != NULL && transfer->state == XFER_OFFERED) {
+            transfer_set_streams(transfer, transfer->nstreams);
+            transfer->state = XFER_SENDING;
+            pump_enqueue(transfer);
         }
         pthread_mutex_unlock(&transfer_mutex);
         
         return 1;
     }
+    else if (strncmp(buffer, CHUNK_STORE, strlen(CHUNK_STORE)) == 0) {
+        chunk_store = 1;
+        return 1;
+    }
+    else if (strncmp(buffer, SESSION_TOKEN, strlen(SESSION_TOKEN)) == 0) {
+        // Parse: SESSION token
+        sscanf(buffer, "%*s %63s", session);
+        return 1;
+    }
+    else if (strncmp(buffer, DATA_TOKEN, strlen(DATA_TOKEN)) == 0) {
+        // Parse: DATA_TOKEN token
+        char token[64];
+        pthread_t tid;
+        if (sscanf(buffer, "%*s %63s", token) == 1 && !atomic_exchange(&data_attaching, 1))
+            pthread_create(&tid, NULL, thread_attach_data, strdup(token));
+        
+        return 1;
+    }
     
     // Check if it's a local SEND command
     if (strncmp(buffer, FILE_TRANSFER_CMD, strlen(FILE_TRANSFER_CMD)) == 0) {
@@ -460,23 +1716,26 @@ int handle_special_message(char *buffer) {
             // Construct and send file transfer request
             char req_buffer[BUFFER_SIZE];
 
-            // Make a simple transfer ID
-            int transfer_id = rand() % 10000;
-            
-            sprintf(req_buffer, "%s %s %d %s %s", "CMD", FILE_TRANSFER_CMD, transfer_id, receiver, filename);
-            send(sockfd, req_buffer, strlen(req_buffer), 0);
-            
-            printf("File transfer request sent to %s for file '%s'.\n", receiver, filename);
+            // The server assigns the transfer ID, name the request by a
+            // tag until FILE_TRANSFER_ID comes back
+            pthread_mutex_lock(&transfer_mutex);
+            int transfer_id = --transfer_tag;
             
             // Store transfer info
-            pthread_mutex_lock(&transfer_mutex);
-            current_transfer.transfer_id = transfer_id;
-            strcpy(current_transfer.receiver_name, receiver);
-            strcpy(current_transfer.filename, filename);
-            strcpy(current_transfer.sender_name, username);
-            current_transfer.socket_fd = sockfd;
+            FileTransfer *transfer = transfer_add(transfer_id, XFER_REQUESTED);
+            strcpy(transfer->receiver_name, receiver);
+            strcpy(transfer->filename, filename);
+            strcpy(transfer->sender_name, username);
             pthread_mutex_unlock(&transfer_mutex);
             
+            sprintf(req_buffer, "%s %s %d %s %s", "CMD", FILE_TRANSFER_CMD, transfer_id, receiver, filename);
+            send_ctrl(req_buffer);
+            
+            if (strcmp(receiver, FILE_TO_ROOM) == 0)
+                printf("File transfer request sent to the room for file '%s'.\n", filename);
+            else
+                printf("File transfer request sent to %s for file '%s'.\n", receiver, filename);
+            
             return 1;
         }
     }
@@ -484,44 +1743,343 @@ int handle_special_message(char *buffer) {
     return 0;
 }
 
+// Answer the oldest pending request if the user typed Y or N.
+// Returns 0 if the line is not an answer or nothing is waiting for one.
+int answer_transfer_prompt(const char *line) {
+    // Only accept Y/N for file transfer, other input stays usable meanwhile
+    char word[8] = "";
+    sscanf(line, " %7s", word);
+    for (char *c = word; *c; c++)
+        *c = tolower((unsigned char)*c);
+    int yes = strcmp(word, "y") == 0 || strcmp(word, "yes") == 0;
+    int no = strcmp(word, "n") == 0 || strcmp(word, "no") == 0;
+    if (!yes && !no)
+        return 0;
+    
+    pthread_mutex_lock(&transfer_mutex);
+    FileTransfer *transfer = transfer_oldest_prompt();
+    if (transfer == NULL) {
+        pthread_mutex_unlock(&transfer_mutex);
+        return 0;
+    }
+    
+    char req_buffer[BUFFER_SIZE];
+    if (yes) {
+        // Accept the transfer
+        generate_unique_filename(transfer->filename, transfer->output_filename);
+        transfer->state = XFER_ACCEPTED;
+        sprintf(req_buffer, "%s %s %d %s", "CMD", FILE_TRANSFER_ACCEPT, transfer->transfer_id, FILE_CODECS);
+        printf("Transfer accepted. File will be saved as %s\n", transfer->output_filename);
+    } else {
+        // Reject the transfer
+        sprintf(req_buffer, "%s %s %d", "CMD", FILE_TRANSFER_REJECT, transfer->transfer_id);
+        transfer_remove(transfer);
+        printf("Transfer rejected.\n");
+    }
+    pthread_mutex_unlock(&transfer_mutex);
+    
+    send_ctrl(req_buffer);
+    return 1;
+}
+
+// File data frame: 8 byte offset, with FRAME_CRC a CRC32C of the bytes,
+// then the bytes, with FRAME_LZ4 as an LZ4 block
+void handle_file_chunk(int transfer_id, int flags, const char *payload, size_t len) {
+    size_t skip = sizeof(uint64_t) + (flags & FRAME_CRC ? sizeof(uint32_t) : 0);
+    if (len < skip)
+        return;
+    uint64_t offset;
+    memcpy(&offset, payload, sizeof(offset));
+    offset = be64toh(offset);
+    const char *data = payload + skip;
+    size_t chunk_size = len - skip;
+
+    // Frames come in on the chat and the data connection, and either
+    // thread may end or drop the transfer while the other is writing to
+    // it. The reference keeps it and its file until this frame is done.
+    pthread_mutex_lock(&transfer_mutex);
+    FileTransfer *transfer = transfer_find(transfer_id);
+    if (transfer == NULL || transfer->state != XFER_RECEIVING) {
+        pthread_mutex_unlock(&transfer_mutex);
+        return;
+    }
+    transfer->refcnt++;
+    pthread_mutex_unlock(&transfer_mutex);
+
+    // Compressed frames are unpacked first, the CRC is of the file bytes
+    char raw[FILE_FRAME_SIZE];
+    if (flags & FRAME_LZ4) {
+        ssize_t n = lz4_decompress(data, chunk_size, raw, sizeof(raw));
+        if (n < 0)
+            goto out;
+        data = raw;
+        chunk_size = n;
+    }
+
+    // A chunk that does not match its CRC is dropped. Its range stops
+    // short, which the digest check at the end reports; a frame cut off
+    // by a dropped sender is padded out and is dropped here too.
+    uint32_t crc = crc32c(0, data, chunk_size);
+    if (flags & FRAME_CRC) {
+        uint32_t expected;
+        memcpy(&expected, payload + sizeof(uint64_t), sizeof(expected));
+        if (crc != ntohl(expected))
+            goto out;
+    }
+
+    // Write chunk to file at its offset
+    const char *chunk = data;
+    uint64_t start = offset, end = offset + chunk_size;
+    while (chunk_size > 0) {
+        ssize_t n = pwrite(transfer->file_fd, data, chunk_size, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            printf("\nError: Could not write %s\n", transfer->output_filename);
+            char err[BUFFER_SIZE];
+            sprintf(err, "%s %d %s", FILE_TRANSFER_ERROR, transfer_id, "Receiver could not write file");
+            send_ctrl(err);
+            // Unless the other thread already took it out
+            pthread_mutex_lock(&transfer_mutex);
+            if (transfer_find(transfer_id) == transfer)
+                transfer_remove(transfer);
+            transfer_put(transfer);
+            pthread_mutex_unlock(&transfer_mutex);
+            return;
+        }
+        data += n;
+        offset += n;
+        chunk_size -= n;
+    }
+    
+    // Each range only counts bytes with nothing missing before them in
+    // that range, that is where a resumed transfer would restart it.
+    // A resume on the chat connection may move the ranges meanwhile.
+    char ack[BUFFER_SIZE] = "";
+    pthread_mutex_lock(&transfer_mutex);
+    int i = 0;
+    while (i + 1 < transfer->nstreams &&
+           start >= stream_start(transfer->filesize, transfer->nstreams, i + 1))
+        i++;
+    if (start <= transfer->pos[i] && end > transfer->pos[i]) {
+        // Only the part past pos extends the range's CRC
+        size_t fresh = end - transfer->pos[i];
+        if (start < transfer->pos[i])
+            crc = crc32c(0, chunk + (transfer->pos[i] - start), fresh);
+        transfer->crc[i] = crc32c_combine(transfer->crc[i], crc, fresh);
+        transfer->done += end - transfer->pos[i];
+        transfer->pos[i] = end;
+    }
+    if (transfer->done - transfer->acked >= FILE_ACK_INTERVAL ||
+        (transfer->done == transfer->filesize && transfer->acked < transfer->done)) {
+        char offsets[FILE_MAX_STREAMS * 21];
+        format_offsets(offsets, transfer->pos, transfer->nstreams);
+        sprintf(ack, "%s %s %d %s %d %s", "CMD", FILE_TRANSFER_ACK, transfer_id,
+                offsets, transfer->epoch, transfer->output_filename);
+        transfer->acked = transfer->done;
+    }
+    pthread_mutex_unlock(&transfer_mutex);
+    
+    if (ack[0] != '\0')
+        send_ctrl(ack);
+    show_progress(transfer, "Receiving");
+out:
+    pthread_mutex_lock(&transfer_mutex);
+    transfer_put(transfer);
+    pthread_mutex_unlock(&transfer_mutex);
+}
+
 typedef struct {
     int clisockfd;
 } ThreadArgs;
 
+// One attempt at getting back into the room: the session if the server
+// still has it, otherwise a fresh join under the same name. Returns the
+// new connection, -1 to try again later, or -2 if there is no way back.
+int rejoin(FrameReader *r, int *expired) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    char hello[4];
+    memcpy(hello, PROTO_MAGIC, 3);
+    hello[3] = PROTO_VERSION;
+    r->fd = fd;
+    r->len = r->consumed = 0;
+    FRAME_HDR hdr;
+    char *payload;
+    if (send(fd, hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello) ||
+        read_frame(r, &hdr, &payload) <= 0 || hdr.type != MSG_HELLO) {
+        close(fd);
+        return -1;
+    }
+
+    char msg[sizeof(int32_t) + sizeof(username) + sizeof(session)];
+    int len;
+    if (!*expired) {
+        len = sprintf(msg, "%s %lu", session, last_seq);
+        write_frame(fd, MSG_RESUME, 0, msg, len);
+    } else {
+        int32_t nroom = htonl(room_number);
+        memcpy(msg, &nroom, sizeof(nroom));
+        memcpy(msg + sizeof(nroom), username, strlen(username));
+        write_frame(fd, MSG_JOIN, 0, msg, sizeof(nroom) + strlen(username));
+    }
+
+    // Welcome or error
+    if (read_frame(r, &hdr, &payload) <= 0) {
+        close(fd);
+        return -1;
+    }
+    char welcome[256];
+    len = hdr.len < sizeof(welcome) - 1 ? hdr.len : sizeof(welcome) - 1;
+    memcpy(welcome, payload, len);
+    welcome[len] = '\0';
+    if (strstr(welcome, "Error:") == NULL)
+        return fd;
+    close(fd);
+    if (strstr(welcome, "Error: Session expired") != NULL && !*expired) {
+        // Join as new, what was said meanwhile is gone
+        *expired = 1;
+        session[0] = '\0';
+        last_seq = 0;
+        return rejoin(r, expired);
+    }
+    if (strstr(welcome, "Error: Session is still connected") != NULL)
+        return -1; // the server is closing the old connection
+    printf("%s", welcome);
+    return -2;
+}
+
+// The chat connection dropped: keep trying to get back for a while.
+// Returns 0 if we could not.
+int reconnect() {
+    printf("Connection lost, reconnecting...\n");
+
+    // The data connection went down with it. One being opened is let
+    // finish first, so it is closed along with the rest. Only this thread
+    // closes either connection: shutting them down fails a sender stuck on
+    // one, and it lets go of the lock before the close.
+    while (atomic_load(&data_attaching))
+        usleep(10000);
+    pthread_mutex_lock(&data.lock);
+    int data_fd = data.fd;
+    pthread_mutex_unlock(&data.lock);
+    if (data_fd >= 0)
+        shutdown(data_fd, SHUT_RDWR);
+    shutdown(reader.fd, SHUT_RDWR);
+    while (atomic_load(&data_running))
+        usleep(10000);
+    pthread_mutex_lock(&data.lock);
+    if (data.fd >= 0)
+        close(data.fd);
+    data.fd = -1;
+    pthread_mutex_unlock(&data.lock);
+    transfers_lost();
+
+    FrameReader next = {0};
+    int expired = 0;
+    for (int i = 0; i < RECONNECT_TRIES; i++) {
+        sleep(1);
+        int fd = rejoin(&next, &expired);
+        if (fd == -2)
+            break;
+        if (fd < 0)
+            continue;
+
+        // Chat goes out on the new connection from here on
+        pthread_mutex_lock(&chat.lock);
+        close(chat.fd);
+        chat.fd = fd;
+        pthread_mutex_unlock(&chat.lock);
+        free(reader.buf);
+        reader = next;
+        printf("Reconnected to room %d.\n", room_number);
+        return 1;
+    }
+    free(next.buf);
+    printf("Could not reconnect.\n");
+    return 0;
+}
+
 void *thread_main_recv(void *args) {
     pthread_detach(pthread_self());
 
-    int sockfd = ((ThreadArgs *)args)->clisockfd;
     free(args);
 
-    // keep receiving and displaying message from server
-    char buffer[BUFFER_SIZE];
+    // keep receiving and displaying message from server. Resume offers
+    // carry two file names, so leave room for more than a chat line.
+    char buffer[2 * BUFFER_SIZE];
+    FRAME_HDR hdr;
+    char *payload;
     int n;
 
     while (1) {
-        memset(buffer, 0, BUFFER_SIZE);
-        n = recv(sockfd, buffer, BUFFER_SIZE - 1, 0);
+        n = read_frame(&reader, &hdr, &payload);
         
+        if (n <= 0 && session[0] != '\0' && reconnect())
+            continue;
         if (n < 0)
             error("ERROR recv() failed");
         if (n == 0)
             break; // connection closed
         
+        if (hdr.type == MSG_DATA) {
+            handle_file_chunk((int)hdr.id, hdr.flags, payload, hdr.len);
+            continue;
+        }
+        
+        size_t len = hdr.len < sizeof(buffer) - 1 ? hdr.len : sizeof(buffer) - 1;
+        memcpy(buffer, payload, len);
+        buffer[len] = '\0';
+        
         // Handle file transfer protocol messages first
-        if (handle_special_message(buffer)) {
+        if (hdr.type == MSG_CTRL) {
+            handle_special_message(buffer);
             continue;
         }
         
-        print_colored_message(buffer);
+        if (hdr.type == MSG_TEXT) {
+            if (hdr.id != 0)
+                last_seq = hdr.id;
+            print_colored_message(buffer);
+        }
+    }
+
+    return NULL;
+}
+
+// File data and the transfer control that has to stay in order with it
+void *thread_main_data(void *args) {
+    pthread_detach(pthread_self());
+
+    char buffer[BUFFER_SIZE];
+    FRAME_HDR hdr;
+    char *payload;
+
+    // The chat connection goes down with this one, its thread reports it
+    while (read_frame(&data_reader, &hdr, &payload) > 0) {
+        if (hdr.type == MSG_DATA) {
+            handle_file_chunk((int)hdr.id, hdr.flags, payload, hdr.len);
+        } else if (hdr.type == MSG_CTRL) {
+            size_t len = hdr.len < sizeof(buffer) - 1 ? hdr.len : sizeof(buffer) - 1;
+            memcpy(buffer, payload, len);
+            buffer[len] = '\0';
+            handle_special_message(buffer);
+        }
     }
 
+    atomic_store(&data_running, 0);
     return NULL;
 }
 
 void *thread_main_send(void *args) {
     pthread_detach(pthread_self());
 
-    int sockfd = ((ThreadArgs *)args)->clisockfd;
     free(args);
 
     char buffer[BUFFER_SIZE];
@@ -530,62 +2088,31 @@ void *thread_main_send(void *args) {
     while (1) {
         memset(buffer, 0, BUFFER_SIZE);
         
-        // Check if we're waiting for a file transfer response
-        pthread_mutex_lock(&transfer_mutex);
-        int waiting = waiting_for_transfer_response;
-        pthread_mutex_unlock(&transfer_mutex);
-        
-        if (!waiting) {
-            fgets(buffer, BUFFER_SIZE - 1, stdin);
-        } else {
-            // Only accept Y/N for file transfer
-            char response;
-            scanf(" %c", &response);
-            
-            // Clear input buffer
-            int c;
-            while ((c = getchar()) != '\n' && c != EOF);
-            
-            pthread_mutex_lock(&transfer_mutex);
-            waiting_for_transfer_response = 0;
-            pthread_mutex_unlock(&transfer_mutex);
-            
-            if (response == 'Y' || response == 'y') {
-                // Accept the transfer
-                char req_buffer[BUFFER_SIZE];
-                sprintf(req_buffer, "%s %s %d", "CMD", FILE_TRANSFER_ACCEPT, current_transfer.transfer_id);
-                send(sockfd, req_buffer, strlen(req_buffer), 0);
-                
-                // Generate unique filename
-                generate_unique_filename(current_transfer.filename, current_transfer.output_filename);
-                
-                printf("Transfer accepted. File will be saved as %s\n", current_transfer.output_filename);
-            } else {
-                // Reject the transfer
-                char req_buffer[BUFFER_SIZE];
-                sprintf(req_buffer, "%s %s %d", "CMD", FILE_TRANSFER_REJECT, current_transfer.transfer_id);
-                send(sockfd, req_buffer, strlen(req_buffer), 0);
-                
-                printf("Transfer rejected.\n");
-            }
-            
+        if (fgets(buffer, BUFFER_SIZE - 1, stdin) == NULL)
+            break;
+
+        // Check if a file transfer is waiting for an answer. The request
+        // usually arrives while this thread is already blocked in fgets, so
+        // the line typed after the prompt is the answer.
+        if (answer_transfer_prompt(buffer)) {
             continue;
         }
 
-        if (strlen(buffer) == 1)
-            buffer[0] = '\0';
+        if (strlen(buffer) <= 1)
+            break; // we stop transmission when user type empty string
             
         // Check if it's a special command
         if (handle_special_message(buffer)) {
             continue;
         }
 
-        n = send(sockfd, buffer, strlen(buffer), 0);
-        if (n < 0)
+        // Server commands travel as control frames, everything else is chat
+        int type = strncmp(buffer, "CMD ", 4) == 0 ? MSG_CTRL : MSG_TEXT;
+        n = send_frame(&chat, type, 0, buffer, strlen(buffer));
+        if (n < 0 && session[0] != '\0')
+            printf("Not sent, the connection is down.\n");
+        else if (n < 0)
             error("ERROR writing to socket");
-
-        if (n == 0)
-            break; // we stop transmission when user type empty string
     }
 
     return NULL;
@@ -597,16 +2124,20 @@ int main(int argc, char *argv[]) {
     }
 
     room_number = -1;
-    int already_sent_room_number = 0;
 
-    struct sockaddr_in serv_addr;
+    // A dropped connection should fail the send, not kill the client
+    signal(SIGPIPE, SIG_IGN);
+    crc32c_init();
+    sha256_init_cpu();
+
     socklen_t slen = sizeof(serv_addr);
     memset((char *)&serv_addr, 0, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_addr.s_addr = inet_addr(argv[1]);
     serv_addr.sin_port = htons(PORT_NUM);
 
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    // Only this thread runs until the join is done
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd < 0)
         error("ERROR opening socket");
 
@@ -614,42 +2145,37 @@ int main(int argc, char *argv[]) {
     if (connect(sockfd, (struct sockaddr *)&serv_addr, slen) < 0)
         error("ERROR connecting");
 
+    // Ask for the framed protocol, the server answers with the version it speaks
+    char hello[4];
+    memcpy(hello, PROTO_MAGIC, 3);
+    hello[3] = PROTO_VERSION;
+    send(sockfd, hello, sizeof(hello), 0);
+
+    reader.fd = sockfd;
+    FRAME_HDR hdr;
+    char *payload;
+    if (read_frame(&reader, &hdr, &payload) <= 0 || hdr.type != MSG_HELLO)
+        error("ERROR server does not speak the framed protocol");
+
     if (argc == 2) {
         // We did not specify room; ask server for room list
-        int special_code = -2; // tell server we want room list
-        send(sockfd, &special_code, sizeof(int), 0);
+        write_frame(sockfd, MSG_LIST, 0, NULL, 0);
 
-        char list[1024];
-        int n = recv(sockfd, list, sizeof(list) - 1, 0);
-        if (n <= 0)
+        if (read_frame(&reader, &hdr, &payload) <= 0)
             error("ERROR receiving room list");
-        list[n] = '\0';
 
-        printf("%s\n", list);
+        printf("%.*s\n", (int)hdr.len, payload);
         printf("Choose the room number or type [new] to create a new room: ");
 
         char choice[20];
         fgets(choice, sizeof(choice), stdin);
         choice[strcspn(choice, "\n")] = 0;
 
-        close(sockfd);
-
         if (strcmp(choice, "new") == 0) {
             room_number = -1;
         } else {
             room_number = atoi(choice);
         }
-
-        // reconnect
-        sockfd = socket(AF_INET, SOCK_STREAM, 0);
-        if (sockfd < 0)
-            error("ERROR reopening socket");
-
-        if (connect(sockfd, (struct sockaddr *)&serv_addr, slen) < 0)
-            error("ERROR reconnecting");
-
-        send(sockfd, &room_number, sizeof(int), 0);
-        already_sent_room_number = 1;
     } else if (argc == 3) {
         if (strcmp(argv[2], "new") != 0) {
             room_number = atoi(argv[2]);
@@ -657,34 +2183,40 @@ int main(int argc, char *argv[]) {
         // else room_number stays -1 (new)
     }
 
-    if (!already_sent_room_number) {
-        send(sockfd, &room_number, sizeof(int), 0);
-    }
-
     // Username
     printf("Type your user name: ");
     fgets(username, sizeof(username), stdin);
     username[strcspn(username, "\n")] = '\0';
-    send(sockfd, username, strlen(username), 0);
+
+    // Room number in network order followed by the name
+    char join[sizeof(int32_t) + sizeof(username)];
+    int32_t nroom = htonl(room_number);
+    memcpy(join, &nroom, sizeof(nroom));
+    memcpy(join + sizeof(nroom), username, strlen(username));
+    write_frame(sockfd, MSG_JOIN, 0, join, sizeof(nroom) + strlen(username));
 
     // Welcome or error
-    char welcome[256] = {0};
-    int n = recv(sockfd, welcome, sizeof(welcome) - 1, 0);
+    int n = read_frame(&reader, &hdr, &payload);
     if (n > 0) {
-        welcome[n] = '\0';
+        char welcome[256];
+        size_t len = hdr.len < sizeof(welcome) - 1 ? hdr.len : sizeof(welcome) - 1;
+        memcpy(welcome, payload, len);
+        welcome[len] = '\0';
         if (strstr(welcome, "Error:") != NULL) {
             printf("%s\n", welcome);
             close(sockfd);
             exit(1);
         }
         printf("%s", welcome);
+        // A new room gets its number here, and a reconnect needs it
+        char *number = strstr(welcome, "room number ");
+        if (number != NULL)
+            sscanf(number, "room number %d", &room_number);
     }
 
     printf("%s joined the chat room!\n", username);
+    chat.fd = sockfd;
     
-    // Initialize random number generator for transfer IDs
-    srand(time(NULL));
-
     // Threads to send and receive
     pthread_t tid1, tid2;
     ThreadArgs *args;
@@ -695,6 +2227,9 @@ int main(int argc, char *argv[]) {
     args->clisockfd = sockfd;
     pthread_create(&tid1, NULL, thread_main_send, args);
 
+    pthread_t pump;
+    pthread_create(&pump, NULL, send_pump_thread, NULL);
+
     args = malloc(sizeof(ThreadArgs));
     args->clisockfd = sockfd;
     pthread_create(&tid2, NULL, thread_main_recv, args);
@@ -702,7 +2237,7 @@ int main(int argc, char *argv[]) {
     pthread_join(tid1, NULL);
     pthread_cancel(tid2);
     pthread_join(tid2, NULL);
-    close(sockfd);
+    close(chat.fd);
 
     return 0;
 }
\ No newline at end of file
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // accept4, pthread_setaffinity_np, splice
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,22 +9,241 @@
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <endian.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <stddef.h>
+#include <sys/random.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <limits.h>
+#include "sha256.h"
+#include "codec.h"
 
 #define PORT_NUM 3000
 #define BUFFER_SIZE 512
-#define MAX_ROOMS 100
-#define MAX_TRANSFERS 100
+#define MAX_TRANSFERS 65536   // slots, the low 16 bits of a transfer ID
+#define TRANSFER_SLOT_BITS 16
+#define MAX_EVENTS 64
+#define READ_BUDGET (4 << 20) // bytes one connection reads before the loop moves on
+#define USER_BUCKETS 4096
+#define DEFAULT_QUEUE_LEN 256
+#define MAX_IOV 64
+#define RELAY_PIPE_SIZE (1 << 20)
+#define WHEEL_SLOTS 512       // timer wheel, one second per slot
+#define HANDSHAKE_TIMEOUT 30  // seconds a new connection has to join
+#define TRANSFER_TIMEOUT 600  // seconds a transfer may go without traffic
+#define FILE_MAX_STREAMS 8    // ranges a file may be sent in at once
+#define MULTICAST_WAIT 30     // seconds a room wide send waits for answers
+#define MULTICAST_STALL 10    // seconds a multicast receiver may stay behind
+#define MULTICAST_LAG 16      // queues a multicast receiver may fall behind the fastest
+#define CHUNK_BUCKETS 4096    // chunk store hash table
+#define MAX_MANIFESTS 1024    // files the chunk store can send again
+#define HISTORY_LEN 128       // recent messages each room keeps, a power of two
+#define DEFAULT_REPLAY 10     // of those, what a joining client is sent
+#define HISTORY_TEXT_LEN (BUFFER_SIZE + 52) // "[name] message\n" at its longest
+#define LOG_SEGMENT_SIZE (8 << 20) // bytes a message log segment grows to
+#define LOG_INDEX_EVERY 64    // log records per segment index entry
+#define SNAPSHOT_INTERVAL 10  // seconds between snapshots of rooms and sessions
+#define SNAPSHOT_MAGIC "chat-snapshot 3"
+#define SNAPSHOT_MAGIC_TOKENS "chat-snapshot 2" // older, kept session tokens as they are
+#define SESSION_TTL 3600      // seconds a session outlives its connection
+#define SESSION_TOKEN_LEN 32
+#define SESSION_KEY_LEN (2 * SHA256_LEN) // hex SHA-256 of a token, all the server keeps of it
+#define SESSION_BUCKETS 1024
+#define SESSION_SWEEP 60     // seconds between sweeps for expired sessions
+#define JOIN_RECENT ULONG_MAX // join_room() replays the usual last few
 
 // AI Assisted. See report.pdf for details.
 // File transfer protocol commands
 #define FILE_TRANSFER_CMD "SEND"
 #define FILE_TRANSFER_REQUEST "FILE_TRANSFER_REQUEST"
+#define FILE_TRANSFER_ID "FILE_TRANSFER_ID"
 #define FILE_TRANSFER_ACCEPT "FILE_TRANSFER_ACCEPT"
 #define FILE_TRANSFER_REJECT "FILE_TRANSFER_REJECT"
 #define FILE_TRANSFER_START "FILE_TRANSFER_START"
 #define FILE_TRANSFER_CHUNK "FILE_TRANSFER_CHUNK"
 #define FILE_TRANSFER_END "FILE_TRANSFER_END"
 #define FILE_TRANSFER_ERROR "FILE_TRANSFER_ERROR"
+#define FILE_TRANSFER_ACK "FILE_TRANSFER_ACK"
+#define FILE_TRANSFER_SUSPEND "FILE_TRANSFER_SUSPEND"
+#define FILE_TRANSFER_RESUME "FILE_TRANSFER_RESUME"
+#define DATA_TOKEN "DATA_TOKEN"
+#define SESSION_TOKEN "SESSION"
+#define CHUNK_STORE "CHUNK_STORE"
+#define FILE_TRANSFER_STORED "FILE_TRANSFER_STORED"
+#define FILE_TRANSFER_UPLOAD "FILE_TRANSFER_UPLOAD"
+
+// Framed protocol. A client opts in by sending PROTO_MAGIC plus a version
+// byte where a classic client sends its room number; every message after
+// that is a FRAME_HDR_LEN header followed by the payload.
+#define PROTO_MAGIC "CHT"
+#define PROTO_VERSION 1
+#define FRAME_HDR_LEN 16
+#define FRAME_MAX_PAYLOAD (1 << 20)
+
+// Frame types
+#define MSG_HELLO 1 // server -> client, payload is the negotiated version
+#define MSG_LIST 2  // client -> server, room list request
+#define MSG_JOIN 3  // client -> server, 4 byte room number + username
+#define MSG_TEXT 4  // chat line or text to display
+#define MSG_CTRL 5  // commands and transfer control, same text as classic
+#define MSG_DATA 6  // file data, id is the transfer, payload is offset + bytes
+#define MSG_ATTACH 7 // client -> server, payload is a data token; echoed on success
+#define MSG_RESUME 8 // client -> server, session token and last message seen, joins
+
+// A data token is the chat connection's socket in 8 hex digits followed
+// by 32 random hex digits
+#define DATA_TOKEN_LEN 40
+
+// Header fields, all in network byte order on the wire
+typedef struct
+{
+    uint32_t len;   // payload bytes following the header
+    uint8_t type;
+    uint8_t flags;
+    uint16_t reserved;
+    uint64_t id;    // transfer id for file frames
+} FRAME_HDR;
+
+// Connection handshake progress, replaces the blocking recv() sequence
+// that thread_main used to run for every client
+typedef enum
+{
+    CONN_ROOM, // waiting for the 4 byte room number
+    CONN_NAME, // waiting for the username
+    CONN_JOIN, // framed client, waiting for MSG_LIST or MSG_JOIN
+    CONN_CHAT, // joined, every read is a chat message or command
+    CONN_DATA  // file data connection of a joined user
+} CONN_STATE;
+
+struct _EVLOOP;
+struct _USR;
+struct _TIMER_WHEEL;
+
+// Intrusive timer, linked into a wheel slot while armed
+typedef struct _TIMER
+{
+    struct _TIMER *prev;
+    struct _TIMER *next;
+    struct _TIMER_WHEEL *wheel; // wheel it is always armed on
+    int armed;
+    long expires;               // monotonic second it is due
+    void (*fire)(struct _TIMER *timer);
+} TIMER;
+
+// Hashed timing wheel: a timer sits in slot expires % WHEEL_SLOTS, so
+// arming and cancelling are O(1) and each tick only visits its own slot.
+// Timers more than a turn out stay put until the turn they are due.
+typedef struct _TIMER_WHEEL
+{
+    pthread_mutex_t lock;
+    TIMER slots[WHEEL_SLOTS]; // list heads
+    long now;                 // last second processed
+    int tfd;                  // timerfd ticking once a second
+} TIMER_WHEEL;
+
+// Outgoing message formatted once and shared by every recipient
+typedef struct _MSGBUF
+{
+    atomic_int refcnt;
+    size_t len;
+    char data[];
+} MSGBUF;
+
+// One data frame of an upload, its offset and chunk store key
+typedef struct
+{
+    uint64_t offset;
+    unsigned char key[SHA256_LEN];
+} MANIFEST_ENTRY;
+
+// The frames a file was uploaded in, so the same file can be sent again
+// from the chunk store. Known by the SHA-256 of its layout.
+typedef struct _MANIFEST
+{
+    unsigned char key[SHA256_LEN];
+    size_t filesize;
+    int nstreams;
+    MANIFEST_ENTRY *entries;
+    int count;
+    int cap;
+    struct _MANIFEST *next; // stored manifests, newest first
+} MANIFEST;
+
+// Chunk store entry: a data frame's body, the CRC and bytes as the sender
+// framed them, known by the SHA-256 of its flags and body
+typedef struct _CHUNK
+{
+    unsigned char key[SHA256_LEN];
+    int flags;
+    MSGBUF *body;         // shared with every queued frame made from it
+    struct _CHUNK *next;  // hash chain
+    struct _CHUNK *newer; // LRU list
+    struct _CHUNK *older;
+} CHUNK;
+
+// A stored chunk going out as part of a file
+typedef struct
+{
+    uint64_t offset;
+    int flags;
+    MSGBUF *body;
+} STORED_FRAME;
+
+// What to do when a recipient's outbound queue is full
+typedef enum
+{
+    SLOW_DROP_OLDEST, // discard the oldest chat message not yet started
+    SLOW_DISCONNECT,  // cut the slow reader off
+    SLOW_BACKPRESSURE // keep it queued and stop reading from the producer
+} SLOW_POLICY;
+
+// Kernel pipe file data is spliced through, socket to pipe to socket,
+// so relayed bytes never enter userspace
+typedef struct _RELAY_PIPE
+{
+    atomic_int refcnt;
+    int fds[2];
+    int size; // pipe capacity
+} RELAY_PIPE;
+
+// Either a buffer or len bytes waiting in a relay pipe
+typedef struct
+{
+    MSGBUF *buf;
+    RELAY_PIPE *pipe;
+    size_t len;
+    int reliable; // file transfer data, never dropped
+} OUTQ_ITEM;
+
+// Per-connection outbound queue, drained when the socket is writable.
+// Any thread may queue, whoever holds the lock writes.
+typedef struct
+{
+    pthread_mutex_t lock;
+    OUTQ_ITEM *items; // ring buffer
+    int capacity;
+    int head;
+    int count;
+    size_t offset;    // bytes of the head item already written
+    int dead;         // connection is going away, drop everything
+    int high_water;   // deepest the queue has been
+    unsigned long dropped;
+    struct _USR **waiters; // producers paused by backpressure on this queue
+    int nwaiters;
+    int waiters_cap;
+} OUTQ;
 
 typedef struct _USR
 {
@@ -31,32 +251,267 @@ typedef struct _USR
     char username[50]; // username added
     int room_number;
     struct sockaddr_in cliaddr;
-    struct _USR *next; // for linked list queue
+    char addr[INET_ADDRSTRLEN]; // cliaddr as text, inet_ntoa() is not thread safe
+    CONN_STATE state;
+    int room_len;          // bytes of room_number received so far
+    struct _EVLOOP *loop;  // event loop the socket is registered with
+    atomic_int refcnt;     // registry, event loop and lookups each hold one
+    struct _USR *name_next; // chain in the (room, username) hash bucket
+    int room_slot;         // index in the room's member array, -1 outside
+    struct _ROOM *room;    // counted, from registration on
+    OUTQ outq;
+    atomic_int paused;     // queues this producer is waiting on
+    int framed;            // speaks the framed protocol
+    int version;           // negotiated protocol version
+    char *inbuf;           // framed input not yet decoded
+    size_t inlen;
+    size_t incap;
+    RELAY_PIPE *relay;     // file frame payload being spliced, if any
+    struct _USR *relay_to; // its receiver
+    uint32_t relay_left;   // payload bytes still in the socket
+    int relay_hint;        // read headers alone so payloads can be spliced
+    uint64_t relay_id;     // transfer and file offset of the relayed frame
+    uint64_t relay_offset;
+    struct _FileTransfer **xfers; // transfers this user sends or receives
+    int nxfers;
+    int xfers_cap;
+    TIMER idle_timer;      // handshake deadline, then idle timeout
+    long last_active;      // monotonic second of the last input
+    struct _USR *data;     // its file data connection, under transfer_lock
+    struct _USR *owner;    // data connection: the chat user it carries files for
+    char token[DATA_TOKEN_LEN + 1]; // lets one data connection attach, under transfer_lock
+    int closed;            // chat connection gone, under transfer_lock
+    char session[SESSION_KEY_LEN + 1]; // key of the session this connection holds, if any
 } USR;
 
+// Lets a framed client back into its room under its name with a token
+// instead of a new handshake, across reconnects and server restarts
+typedef struct _SESSION
+{
+    char key[SESSION_KEY_LEN + 1]; // only the client has the token itself
+    char username[50];
+    int room_number;
+    long expires;      // unix time, 0 while a connection holds it
+    int sockfd;        // the connection holding it
+    struct _SESSION *next;
+} SESSION;
+
+// One message in a room's history, a whole number of cache lines. seq is
+// 0 while the text is being replaced, readers copy the text and keep it
+// only if seq is the same before and after.
+typedef struct _HISTORY_ENTRY
+{
+    atomic_ulong seq;
+    int len;
+    char text[HISTORY_TEXT_LEN];
+} HISTORY_ENTRY;
+
+// Message log (-d): every room appends its messages to segment files in
+// a directory of its own, each named by its first message number. A
+// record is this header and the text, padded to 8 bytes.
+typedef struct
+{
+    uint32_t len;      // text bytes after the header
+    uint32_t check;    // FNV-1a of seq, time and text, finds torn writes
+    uint64_t seq;
+    int64_t time_ms;   // wall clock
+} LOG_RECORD;
+
+// A segment's .idx file has one of these every LOG_INDEX_EVERY records
+typedef struct
+{
+    uint64_t seq;
+    int64_t time_ms;
+    uint64_t offset;
+} LOG_INDEX;
+
+typedef struct
+{
+    unsigned long first_seq;
+    int64_t first_ms;
+    size_t size;       // bytes written, readers map no further
+    size_t nindex;     // index entries written
+} LOG_SEGMENT;
+
+typedef struct _ROOM_LOG
+{
+    pthread_mutex_t lock;
+    int room;
+    char *pending;     // records queued by broadcast(), not written yet
+    size_t pending_len;
+    size_t pending_cap;
+    int queued;        // on the writer's list
+    LOG_SEGMENT *segs; // oldest first, the writer appends to the last one
+    int nsegs;
+    int segs_cap;
+    int fd;            // last segment and its index, open on the writer
+    int idx_fd;        // while the room is open
+    int idle;          // room closed, the writer closes the files after its last batch
+    unsigned long nrecords; // in the last segment
+    unsigned long logged_seq; // last message written
+    unsigned long appended_seq; // last message queued, where a reopened room goes on
+} ROOM_LOG;
+
+// A chat room owns its member set, so fan-out only touches its members
+typedef struct _ROOM
+{
+    pthread_mutex_t lock;
+    atomic_int refcnt; // the room table while open, and each registered user
+    int number;
+    int nusers;    // registered users, the room closes when none are left; under the global lock
+    int active_slot; // index in active_rooms; under the global lock
+    USR **members; // contiguous, removal swaps the last member in
+    int nmembers;
+    int capacity;
+    // Ring of the last HISTORY_LEN messages, written under lock and read
+    // without it. history_seq is the newest message's number, from 1.
+    atomic_ulong history_seq;
+    ROOM_LOG *log; // NULL without -d
+    HISTORY_ENTRY history[HISTORY_LEN] __attribute__((aligned(64)));
+} ROOM;
+
+// A room number stays taken while its room is open, while a session may
+// still come back to it and, with -d, for good once it has a log
+typedef struct
+{
+    ROOM *room;        // NULL while nobody is in it
+    ROOM_LOG *log;     // NULL without -d
+    int sessions;      // sessions naming this room
+    char creator[50];
+    long created_at;   // unix time
+    unsigned long last_seq; // newest message of the closed room, where it goes on without -d
+} ROOM_SLOT;
+
+// One event loop thread, all of its sockets are multiplexed on epfd
+typedef struct _EVLOOP
+{
+    int epfd;
+    int listenfd; // own SO_REUSEPORT listener when sharded, -1 otherwise
+    int cpu;      // core the loop is pinned to, -1 if not pinned
+    pthread_t tid;
+    TIMER_WHEEL wheel; // timeouts of its connections and their transfers
+} EVLOOP;
+
+// Entries are refcounted: the table holds one reference while the transfer
+// is active, lookups take their own so an entry never vanishes mid-use.
+// A started transfer survives either end dropping: that end goes NULL and
+// the transfer waits on the suspended list for it to come back.
 typedef struct _FileTransfer
 {
     int transfer_id;
-    int sender_sockfd;
+    int sender_sockfd;     // -1 while that end is away
     int receiver_sockfd;
+    struct _USR *sender;   // counted references, change under transfer_lock
+    struct _USR *receiver;
+    int sender_slot;       // position in each user's transfer index
+    int receiver_slot;
     char sender_name[50];
     char receiver_name[50];
     char filename[256];
     size_t filesize;
-    int active;
-    time_t start_time;
-    struct _FileTransfer *next;
+    int active;        // still in the table
+    int accepted;      // receiver said yes, data may be relayed
+    int started;       // START went through, the transfer can be resumed
+    int ending;        // END went through, waiting for the receiver's verdict
+    int nstreams;      // ranges the sender split the file into
+    size_t acked[FILE_MAX_STREAMS]; // per range, written in order up to here
+    int epoch;         // bumped on every drop, stale ACKs carry an old one
+    char output_name[256]; // where the receiver writes the file
+    char codecs[32];   // compression the receiver reads, passed on to the sender
+    int suspended;     // on the suspended list
+    struct _FileTransfer *susp_next;
+    RELAY_PIPE *pipe;  // splice relay for framed data, made on accept
+    MANIFEST *upload;  // frames the chunk store is recording, under transfer_lock
+    unsigned char offer[SHA256_LEN]; // manifest key the sender's START offered
+    int *members;      // multicast: transfer IDs of the receivers' transfers
+    int nmembers;
+    struct _FileTransfer *group; // multicast receiver: the sender's transfer, counted
+    atomic_long last_active; // monotonic second of the last sender traffic,
+                             // for a multicast receiver the last time it kept up
+    TIMER timer;       // on the sender's loop, holds a reference while armed
+    atomic_int refcnt;
+    struct _FileTransfer *next; // local lists of unlinked entries
 } FileTransfer;
 
-USR *head = NULL;
-USR *tail = NULL;
-pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+// Transfer IDs are a slot index tagged with the slot's generation, so a
+// stale ID never reaches the transfer that reused its slot
+typedef struct _TRANSFER_SLOT
+{
+    FileTransfer *transfer;
+    uint16_t gen;
+    int next_free;
+} TRANSFER_SLOT;
+
+// User registry: O(1) lookup by socket and by (room, username).
+// Lookups hand out counted references, release them with user_put().
+USR **users_by_fd = NULL;
+int users_by_fd_size = 0;
+USR *users_by_name[USER_BUCKETS];
+pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Transfer table: indexed by the slot in the ID, each user also indexes
+// its own transfers. Free slots are chained through next_free.
+TRANSFER_SLOT *transfer_slots = NULL;
+int transfer_nslots = 0;
+int transfer_free = -1;
+FileTransfer *suspended_transfers = NULL;
+pthread_rwlock_t transfer_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Room table, indexed by room number - 1 and grown as numbers are handed
+// out. Numbers nothing refers to any more are handed out again from
+// free_rooms. Open rooms are also kept together in active_rooms, so
+// listing them does not walk the whole table. All under lock.
+ROOM_SLOT *room_table = NULL;
+int room_table_size = 0;
+int next_room = 1; // lowest number never handed out
+int *free_rooms = NULL;
+int nfree_rooms = 0;
+int free_rooms_cap = 0;
+ROOM **active_rooms = NULL;
+int nactive_rooms = 0;
+int active_rooms_cap = 0;
+long last_session_sweep = 0;
+
+SESSION *sessions[SESSION_BUCKETS];
+int nsessions = 0;
+pthread_mutex_t session_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int max_queue = DEFAULT_QUEUE_LEN;
+int history_replay = DEFAULT_REPLAY; // messages replayed to a joining client
 
-FileTransfer *transfer_head = NULL;
-pthread_mutex_t transfer_lock = PTHREAD_MUTEX_INITIALIZER;
+// Message log writer: rooms with records pending, taken a batch at a time
+char *log_dir = NULL;
+ROOM_LOG **log_queue = NULL;
+int log_nqueued = 0;
+int log_queue_cap = 0;
+pthread_mutex_t log_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t log_queue_cond = PTHREAD_COND_INITIALIZER;
+atomic_int snapshot_dirty; // something a snapshot keeps has changed
+// Spare descriptor given up to turn connections away when out of them
+int reserve_fd = -1;
+pthread_mutex_t reserve_lock = PTHREAD_MUTEX_INITIALIZER;
+int idle_timeout = 0; // seconds before a silent chat user is cut off, 0 never
+SLOW_POLICY slow_policy = SLOW_DROP_OLDEST;
 
-int room_user_counts[MAX_ROOMS] = {0};
-int active_rooms[MAX_ROOMS] = {0};
+// Chunk store (-c): uploads are kept by content so a file sent again
+// comes from here. Off while store_max is 0.
+size_t store_max = 0;   // bytes of chunks and manifests kept
+size_t store_bytes = 0;
+int store_chunks = 0;
+int store_files = 0;
+CHUNK *chunk_buckets[CHUNK_BUCKETS];
+CHUNK *chunk_newest = NULL;
+CHUNK *chunk_oldest = NULL;
+MANIFEST *manifests = NULL;
+pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Outbound queue metrics, reported by CMD STATS
+atomic_long stat_queued;       // messages waiting in all queues
+atomic_long stat_dropped;      // messages discarded by SLOW_DROP_OLDEST
+atomic_long stat_disconnected; // readers cut off by SLOW_DISCONNECT
+atomic_long stat_paused;       // times a producer was paused
+atomic_long stat_log_bytes;    // message log bytes written
+atomic_long stat_log_commits;  // message log batches synced
 
 void error(const char *msg)
 {
@@ -64,649 +519,4923 @@ void error(const char *msg)
     exit(1);
 }
 
-// Find user by socket file descriptor
-USR *find_user_by_sockfd(int sockfd)
+// Coarse monotonic clock, all timeouts are in whole seconds
+long now_sec()
 {
-    pthread_mutex_lock(&lock);
-    USR *cur = head;
-    while (cur != NULL)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+void wheel_init(TIMER_WHEEL *wheel)
+{
+    pthread_mutex_init(&wheel->lock, NULL);
+    for (int i = 0; i < WHEEL_SLOTS; i++)
     {
-        if (cur->clisockfd == sockfd)
-        {
-            pthread_mutex_unlock(&lock);
-            return cur;
-        }
-        cur = cur->next;
+        wheel->slots[i].prev = &wheel->slots[i];
+        wheel->slots[i].next = &wheel->slots[i];
     }
-    pthread_mutex_unlock(&lock);
-    return NULL;
+    wheel->now = now_sec();
+
+    wheel->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (wheel->tfd < 0)
+        error("ERROR creating timerfd");
+    struct itimerspec its = {{1, 0}, {1, 0}};
+    timerfd_settime(wheel->tfd, 0, &its, NULL);
 }
 
-// Find user by username in a specific room
-USR *find_user_by_name(const char *username, int room_number)
+void timer_init(TIMER *timer, TIMER_WHEEL *wheel, void (*fire)(TIMER *))
 {
-    pthread_mutex_lock(&lock);
-    USR *cur = head;
-    while (cur != NULL)
+    timer->prev = timer->next = NULL;
+    timer->wheel = wheel;
+    timer->armed = 0;
+    timer->fire = fire;
+}
+
+// Caller holds the wheel lock
+void timer_unlink(TIMER *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->armed = 0;
+}
+
+// Caller holds the wheel lock
+void timer_link(TIMER *head, TIMER *timer)
+{
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+    timer->armed = 1;
+}
+
+// (Re)arm a timer to fire at the monotonic second expires
+void timer_arm(TIMER *timer, long expires)
+{
+    TIMER_WHEEL *wheel = timer->wheel;
+    pthread_mutex_lock(&wheel->lock);
+    if (timer->armed)
+        timer_unlink(timer);
+    // Anything already due goes out on the next tick
+    if (expires <= wheel->now)
+        expires = wheel->now + 1;
+    timer->expires = expires;
+    timer_link(&wheel->slots[expires % WHEEL_SLOTS], timer);
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+// Returns 1 if the timer was armed and will now never fire
+int timer_cancel(TIMER *timer)
+{
+    TIMER_WHEEL *wheel = timer->wheel;
+    pthread_mutex_lock(&wheel->lock);
+    int armed = timer->armed;
+    if (armed)
+        timer_unlink(timer);
+    pthread_mutex_unlock(&wheel->lock);
+    return armed;
+}
+
+// Timerfd tick: fire everything due up to now. Due timers are moved to
+// a local list first and fired one at a time without the lock, a timer
+// cancelled meanwhile is simply unlinked from that list.
+void wheel_advance(TIMER_WHEEL *wheel)
+{
+    uint64_t ticks;
+    while (read(wheel->tfd, &ticks, sizeof(ticks)) > 0)
+        ;
+
+    TIMER due;
+    due.prev = due.next = &due;
+    long now = now_sec();
+
+    pthread_mutex_lock(&wheel->lock);
+    // After a long stall one turn visits every slot anyway
+    if (now - wheel->now > WHEEL_SLOTS)
+        wheel->now = now - WHEEL_SLOTS;
+    while (wheel->now < now)
     {
-        if (cur->room_number == room_number && strcmp(cur->username, username) == 0)
+        wheel->now++;
+        TIMER *head = &wheel->slots[wheel->now % WHEEL_SLOTS];
+        TIMER *timer = head->next;
+        while (timer != head)
         {
-            pthread_mutex_unlock(&lock);
-            return cur;
+            TIMER *next = timer->next;
+            if (timer->expires <= wheel->now)
+            {
+                timer_unlink(timer);
+                timer_link(&due, timer);
+            }
+            timer = next;
         }
-        cur = cur->next;
     }
-    pthread_mutex_unlock(&lock);
-    return NULL;
+    while (due.next != &due)
+    {
+        TIMER *timer = due.next;
+        timer_unlink(timer);
+        pthread_mutex_unlock(&wheel->lock);
+        timer->fire(timer);
+        pthread_mutex_lock(&wheel->lock);
+    }
+    pthread_mutex_unlock(&wheel->lock);
 }
 
-// Add a new file transfer to the list
-void add_file_transfer(int transfer_id, int sender_sockfd, int receiver_sockfd, 
-                      const char *sender_name, const char *receiver_name, 
-                      const char *filename, size_t filesize)
+// Format straight into a right-sized buffer holding one reference
+MSGBUF *msgbuf_printf(const char *fmt, ...)
 {
-    FileTransfer *new_transfer = (FileTransfer *)malloc(sizeof(FileTransfer));
-    new_transfer->transfer_id = transfer_id;
-    new_transfer->sender_sockfd = sender_sockfd;
-    new_transfer->receiver_sockfd = receiver_sockfd;
-    strcpy(new_transfer->sender_name, sender_name);
-    strcpy(new_transfer->receiver_name, receiver_name);
-    strcpy(new_transfer->filename, filename);
-    new_transfer->filesize = filesize;
-    new_transfer->active = 1;
-    new_transfer->start_time = time(NULL);
-    new_transfer->next = NULL;
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+
+    MSGBUF *buf = (MSGBUF *)malloc(sizeof(MSGBUF) + len + 1);
+    atomic_init(&buf->refcnt, 1);
+    buf->len = len;
+    va_start(ap, fmt);
+    vsnprintf(buf->data, len + 1, fmt, ap);
+    va_end(ap);
+    return buf;
+}
+
+// Shared copy of raw bytes, file data may contain anything
+MSGBUF *msgbuf_copy(const void *data, size_t len)
+{
+    MSGBUF *buf = (MSGBUF *)malloc(sizeof(MSGBUF) + len + 1);
+    atomic_init(&buf->refcnt, 1);
+    buf->len = len;
+    memcpy(buf->data, data, len);
+    buf->data[len] = '\0';
+    return buf;
+}
+
+void frame_encode(char *out, int type, int flags, uint64_t id, uint32_t len)
+{
+    uint32_t nlen = htonl(len);
+    uint64_t nid = htobe64(id);
+    memcpy(out, &nlen, 4);
+    out[4] = (char)type;
+    out[5] = (char)flags;
+    out[6] = out[7] = 0;
+    memcpy(out + 8, &nid, 8);
+}
+
+void frame_decode(const char *in, FRAME_HDR *hdr)
+{
+    memcpy(&hdr->len, in, 4);
+    hdr->len = ntohl(hdr->len);
+    hdr->type = (uint8_t)in[4];
+    hdr->flags = (uint8_t)in[5];
+    hdr->reserved = 0;
+    memcpy(&hdr->id, in + 8, 8);
+    hdr->id = be64toh(hdr->id);
+}
+
+// Header and payload in one shared buffer
+MSGBUF *msgbuf_frame(int type, uint64_t id, const void *payload, size_t len)
+{
+    MSGBUF *buf = (MSGBUF *)malloc(sizeof(MSGBUF) + FRAME_HDR_LEN + len + 1);
+    atomic_init(&buf->refcnt, 1);
+    buf->len = FRAME_HDR_LEN + len;
+    frame_encode(buf->data, type, 0, id, len);
+    memcpy(buf->data + FRAME_HDR_LEN, payload, len);
+    buf->data[buf->len] = '\0';
+    return buf;
+}
+
+MSGBUF *msgbuf_get(MSGBUF *buf)
+{
+    atomic_fetch_add(&buf->refcnt, 1);
+    return buf;
+}
+
+void msgbuf_put(MSGBUF *buf)
+{
+    if (atomic_fetch_sub(&buf->refcnt, 1) == 1)
+    {
+        free(buf);
+    }
+}
+
+// Chunk store key of a data frame body
+void chunk_key(int flags, const char *body, size_t len, unsigned char *key)
+{
+    SHA256_CTX ctx;
+    unsigned char f = (unsigned char)flags;
+    sha256_init(&ctx);
+    sha256_update(&ctx, &f, 1);
+    sha256_update(&ctx, body, len);
+    sha256_final(&ctx, key);
+}
+
+unsigned int chunk_bucket(const unsigned char *key)
+{
+    unsigned int h;
+    memcpy(&h, key, sizeof(h)); // already a hash
+    return h % CHUNK_BUCKETS;
+}
+
+// Caller holds store_lock
+CHUNK *chunk_lookup(const unsigned char *key)
+{
+    CHUNK *c = chunk_buckets[chunk_bucket(key)];
+    while (c != NULL && memcmp(c->key, key, SHA256_LEN) != 0)
+    {
+        c = c->next;
+    }
+    return c;
+}
 
-    pthread_mutex_lock(&transfer_lock);
-    if (transfer_head == NULL)
+// Move a chunk to the newest end of the LRU list, it may be unlinked from
+// it or new. Caller holds store_lock.
+void chunk_touch(CHUNK *c, int linked)
+{
+    if (linked)
     {
-        transfer_head = new_transfer;
+        if (c == chunk_newest)
+            return;
+        c->newer->older = c->older;
+        if (c->older != NULL)
+            c->older->newer = c->newer;
+        else
+            chunk_oldest = c->newer;
     }
+    c->newer = NULL;
+    c->older = chunk_newest;
+    if (chunk_newest != NULL)
+        chunk_newest->newer = c;
     else
+        chunk_oldest = c;
+    chunk_newest = c;
+}
+
+size_t manifest_bytes(MANIFEST *m)
+{
+    return sizeof(MANIFEST) + m->cap * sizeof(MANIFEST_ENTRY);
+}
+
+void manifest_free(MANIFEST *m)
+{
+    if (m != NULL)
     {
-        FileTransfer *cur = transfer_head;
-        while (cur->next != NULL)
-        {
-            cur = cur->next;
-        }
-        cur->next = new_transfer;
+        free(m->entries);
+        free(m);
     }
-    pthread_mutex_unlock(&transfer_lock);
 }
 
-// Find transfer by ID
-FileTransfer *find_transfer_by_id(int transfer_id)
+// Caller holds store_lock
+void store_drop_oldest_manifest()
 {
-    pthread_mutex_lock(&transfer_lock);
-    FileTransfer *cur = transfer_head;
-    while (cur != NULL)
+    MANIFEST **link = &manifests;
+    while ((*link)->next != NULL)
+    {
+        link = &(*link)->next;
+    }
+    store_bytes -= manifest_bytes(*link);
+    manifest_free(*link);
+    *link = NULL;
+    store_files--;
+}
+
+// Evict least recently used chunks, then the oldest manifests, until the
+// store fits. Queued frames keep their bodies alive. Caller holds store_lock.
+void store_trim()
+{
+    while (store_bytes > store_max && chunk_oldest != NULL)
     {
-        if (cur->transfer_id == transfer_id)
+        CHUNK *c = chunk_oldest;
+        chunk_oldest = c->newer;
+        if (chunk_oldest != NULL)
+            chunk_oldest->older = NULL;
+        else
+            chunk_newest = NULL;
+        CHUNK **link = &chunk_buckets[chunk_bucket(c->key)];
+        while (*link != c)
         {
-            pthread_mutex_unlock(&transfer_lock);
-            return cur;
+            link = &(*link)->next;
         }
-        cur = cur->next;
+        *link = c->next;
+        store_bytes -= sizeof(CHUNK) + c->body->len;
+        store_chunks--;
+        msgbuf_put(c->body);
+        free(c);
+    }
+    while (store_bytes > store_max && manifests != NULL)
+    {
+        store_drop_oldest_manifest();
     }
-    pthread_mutex_unlock(&transfer_lock);
-    return NULL;
 }
 
-// Remove transfer by ID
-void remove_transfer(int transfer_id)
+// Keep a frame body under its key. Returns a reference to the stored
+// body, an earlier copy when the store already had it.
+MSGBUF *store_chunk(const unsigned char *key, int flags, const char *body, size_t len)
 {
-    pthread_mutex_lock(&transfer_lock);
-    FileTransfer *prev = NULL;
-    FileTransfer *cur = transfer_head;
-    
-    while (cur != NULL)
+    pthread_mutex_lock(&store_lock);
+    CHUNK *c = chunk_lookup(key);
+    if (c != NULL)
+    {
+        chunk_touch(c, 1);
+    }
+    else
+    {
+        c = (CHUNK *)malloc(sizeof(CHUNK));
+        memcpy(c->key, key, SHA256_LEN);
+        c->flags = flags;
+        c->body = msgbuf_copy(body, len);
+        unsigned int b = chunk_bucket(key);
+        c->next = chunk_buckets[b];
+        chunk_buckets[b] = c;
+        chunk_touch(c, 0);
+        store_bytes += sizeof(CHUNK) + len;
+        store_chunks++;
+    }
+    MSGBUF *stored = msgbuf_get(c->body);
+    store_trim();
+    pthread_mutex_unlock(&store_lock);
+    return stored;
+}
+
+MANIFEST *manifest_new(size_t filesize, int nstreams)
+{
+    MANIFEST *m = (MANIFEST *)calloc(1, sizeof(MANIFEST));
+    m->filesize = filesize;
+    m->nstreams = nstreams;
+    return m;
+}
+
+void manifest_add(MANIFEST *m, uint64_t offset, const unsigned char *key)
+{
+    if (m->count == m->cap)
+    {
+        m->cap = m->cap ? m->cap * 2 : 64;
+        m->entries = (MANIFEST_ENTRY *)realloc(m->entries, m->cap * sizeof(MANIFEST_ENTRY));
+    }
+    m->entries[m->count].offset = offset;
+    memcpy(m->entries[m->count].key, key, SHA256_LEN);
+    m->count++;
+}
+
+int manifest_entry_cmp(const void *a, const void *b)
+{
+    uint64_t x = ((const MANIFEST_ENTRY *)a)->offset, y = ((const MANIFEST_ENTRY *)b)->offset;
+    return x < y ? -1 : x > y;
+}
+
+// Key of a manifest: SHA-256 of the file size, the range count and each
+// frame's offset and key in file order. Clients work it out the same way.
+void manifest_seal(MANIFEST *m)
+{
+    qsort(m->entries, m->count, sizeof(MANIFEST_ENTRY), manifest_entry_cmp);
+    SHA256_CTX ctx;
+    uint64_t size = htobe64(m->filesize);
+    uint32_t n = htonl(m->nstreams);
+    sha256_init(&ctx);
+    sha256_update(&ctx, &size, sizeof(size));
+    sha256_update(&ctx, &n, sizeof(n));
+    for (int i = 0; i < m->count; i++)
+    {
+        uint64_t offset = htobe64(m->entries[i].offset);
+        sha256_update(&ctx, &offset, sizeof(offset));
+        sha256_update(&ctx, m->entries[i].key, SHA256_LEN);
+    }
+    sha256_final(&ctx, m->key);
+}
+
+// A finished upload, sealed. Replaces an older manifest with the same key.
+void store_manifest(MANIFEST *m)
+{
+    pthread_mutex_lock(&store_lock);
+    for (MANIFEST **link = &manifests; *link != NULL; link = &(*link)->next)
     {
-        if (cur->transfer_id == transfer_id)
+        if (memcmp((*link)->key, m->key, SHA256_LEN) == 0)
         {
-            if (prev == NULL)
-            {
-                transfer_head = cur->next;
-            }
-            else
-            {
-                prev->next = cur->next;
-            }
-            free(cur);
+            MANIFEST *old = *link;
+            *link = old->next;
+            store_bytes -= manifest_bytes(old);
+            store_files--;
+            manifest_free(old);
             break;
         }
-        prev = cur;
-        cur = cur->next;
     }
-    pthread_mutex_unlock(&transfer_lock);
+    m->next = manifests;
+    manifests = m;
+    store_bytes += manifest_bytes(m);
+    store_files++;
+    if (store_files > MAX_MANIFESTS)
+        store_drop_oldest_manifest();
+    store_trim();
+    pthread_mutex_unlock(&store_lock);
 }
 
-// Clean up inactive transfers (timeout after 10 minutes)
-void cleanup_transfers()
+// References to every chunk of a stored file, NULL unless the store
+// still has all of them
+STORED_FRAME *store_collect(const unsigned char *key, size_t filesize, int nstreams, int *count)
 {
-    time_t now = time(NULL);
-    pthread_mutex_lock(&transfer_lock);
-    
-    FileTransfer *prev = NULL;
-    FileTransfer *cur = transfer_head;
-    
-    while (cur != NULL)
+    STORED_FRAME *frames = NULL;
+    pthread_mutex_lock(&store_lock);
+    MANIFEST *m = manifests;
+    while (m != NULL && memcmp(m->key, key, SHA256_LEN) != 0)
     {
-        // Check for transfers that have been active for more than 10 minutes
-        if (difftime(now, cur->start_time) > 600)
+        m = m->next;
+    }
+    if (m != NULL && m->count > 0 && m->filesize == filesize && m->nstreams == nstreams)
+    {
+        frames = (STORED_FRAME *)malloc(m->count * sizeof(STORED_FRAME));
+        int n = 0;
+        for (; n < m->count; n++)
         {
-            FileTransfer *to_remove = cur;
-            
-            if (prev == NULL)
-            {
-                transfer_head = cur->next;
-                cur = transfer_head;
-            }
-            else
-            {
-                prev->next = cur->next;
-                cur = cur->next;
-            }
-            
-            // If transfer is still active, send error to both sender and receiver
-            if (to_remove->active)
-            {
-                char buffer[BUFFER_SIZE];
-                sprintf(buffer, "%s %d %s", FILE_TRANSFER_ERROR, 
-                        to_remove->transfer_id, "Transfer timeout");
-                
-                // Only send if the socket is still valid
-                USR *sender = find_user_by_sockfd(to_remove->sender_sockfd);
-                USR *receiver = find_user_by_sockfd(to_remove->receiver_sockfd);
-                
-                if (sender != NULL)
-                {
-                    send(to_remove->sender_sockfd, buffer, strlen(buffer), 0);
-                }
-                
-                if (receiver != NULL)
-                {
-                    send(to_remove->receiver_sockfd, buffer, strlen(buffer), 0);
-                }
-            }
-            
-            free(to_remove);
+            CHUNK *c = chunk_lookup(m->entries[n].key);
+            if (c == NULL)
+                break;
+            chunk_touch(c, 1);
+            frames[n].offset = m->entries[n].offset;
+            frames[n].flags = c->flags;
+            frames[n].body = msgbuf_get(c->body);
         }
-        else
+        if (n < m->count)
         {
-            prev = cur;
-            cur = cur->next;
+            while (n > 0)
+            {
+                msgbuf_put(frames[--n].body);
+            }
+            free(frames);
+            frames = NULL;
         }
+        *count = m->count;
     }
-    
-    pthread_mutex_unlock(&transfer_lock);
+    pthread_mutex_unlock(&store_lock);
+    return frames;
+}
+
+void session_sweep(long now);
+
+// The slot of a room number in use, NULL otherwise. Caller holds lock.
+ROOM_SLOT *room_entry(int room_number)
+{
+    if (room_number < 1 || room_number > room_table_size)
+        return NULL;
+    ROOM_SLOT *slot = &room_table[room_number - 1];
+    if (slot->room == NULL && slot->log == NULL && slot->sessions == 0)
+        return NULL;
+    return slot;
 }
 
-void send_room_list(int clisockfd)
+// Make room numbers up to room_number fit. Caller holds lock for writing.
+void room_table_grow(int room_number)
 {
-    pthread_mutex_lock(&lock);
-    USR *cur = head;
-    int rooms[100] = {0}; // track people in each room
-    int max_room = 0;
+    if (room_number <= room_table_size)
+        return;
+    int size = room_table_size ? room_table_size : 64;
+    while (size < room_number)
+        size *= 2;
+    room_table = (ROOM_SLOT *)realloc(room_table, size * sizeof(ROOM_SLOT));
+    memset(room_table + room_table_size, 0, (size - room_table_size) * sizeof(ROOM_SLOT));
+    room_table_size = size;
+}
 
-    while (cur != NULL)
+// A number for a new room, one given up before if there is any. Caller
+// holds lock for writing.
+int room_number_new()
+{
+    // Expired sessions are only let go of now and then, make sure their
+    // rooms are back before the table grows
+    long now = (long)time(NULL);
+    if (nfree_rooms == 0 && now >= last_session_sweep + SESSION_SWEEP)
     {
-        int r = cur->room_number;
-        if (r < 1)
-        {
-            cur = cur->next;
-            continue;
-        } // skip invalid rooms
-        if (r >= 1 && r < MAX_ROOMS)
-        {
-            rooms[r - 1]++;
-            if (r > max_room)
-                max_room = r;
-        }
-        cur = cur->next;
+        last_session_sweep = now;
+        session_sweep(now);
     }
-    pthread_mutex_unlock(&lock);
+    if (nfree_rooms > 0)
+        return free_rooms[--nfree_rooms];
+
+    room_table_grow(next_room);
+    return next_room++;
+}
 
-    char msg[1024] = "Server says following options are available:\n";
-    for (int i = 0; i < max_room; i++)
+// The number goes back on the free list once nothing refers to it.
+// Caller holds lock for writing.
+void room_number_release(int room_number)
+{
+    ROOM_SLOT *slot = &room_table[room_number - 1];
+    if (slot->room != NULL || slot->log != NULL || slot->sessions > 0)
+        return;
+    if (nfree_rooms == free_rooms_cap)
     {
-        if (rooms[i] > 0)
-        {
-            char line[64];
-            sprintf(line, "Room %d: %d people\n", i + 1, rooms[i]);
-            strcat(msg, line);
-        }
+        free_rooms_cap = free_rooms_cap ? free_rooms_cap * 2 : 64;
+        free_rooms = (int *)realloc(free_rooms, free_rooms_cap * sizeof(int));
     }
-    
-    send(clisockfd, msg, strlen(msg), 0);
+    free_rooms[nfree_rooms++] = room_number;
+    memset(slot, 0, sizeof(*slot));
+}
+
+ROOM *room_get(ROOM *room)
+{
+    atomic_fetch_add(&room->refcnt, 1);
+    return room;
 }
 
-void add_tail(int newclisockfd, struct sockaddr_in addr, const char *uname, int room_number)
+void room_put(ROOM *room)
 {
-    USR *new_node = (USR *)malloc(sizeof(USR));
-    new_node->clisockfd = newclisockfd;
-    new_node->cliaddr = addr;
-    new_node->room_number = room_number;
-    strcpy(new_node->username, uname);
-    new_node->next = NULL;
+    if (room != NULL && atomic_fetch_sub(&room->refcnt, 1) == 1)
+    {
+        pthread_mutex_destroy(&room->lock);
+        free(room->members);
+        free(room);
+    }
+}
 
-    pthread_mutex_lock(&lock);
-    if (head == NULL)
+// Open the room behind a number in use. Its history goes on from its log,
+// if it has one, or from where the room was when it last closed, so the
+// sessions still naming it resume at the right message. Caller holds lock
+// for writing.
+ROOM *room_open(int room_number)
+{
+    ROOM_SLOT *slot = &room_table[room_number - 1];
+    ROOM *room;
+    if (posix_memalign((void **)&room, 64, sizeof(ROOM)) != 0)
+        error("ERROR allocating room");
+    memset(room, 0, sizeof(ROOM));
+    pthread_mutex_init(&room->lock, NULL);
+    atomic_init(&room->refcnt, 1);
+    room->number = room_number;
+    room->log = slot->log;
+    if (room->log != NULL)
     {
-        head = tail = new_node;
+        pthread_mutex_lock(&room->log->lock);
+        atomic_init(&room->history_seq, room->log->appended_seq);
+        room->log->idle = 0;
+        pthread_mutex_unlock(&room->log->lock);
     }
     else
     {
-        tail->next = new_node;
-        tail = new_node;
+        atomic_init(&room->history_seq, slot->last_seq);
     }
-    if (room_number >= 1 && room_number <= MAX_ROOMS)
+    slot->room = room;
+
+    if (nactive_rooms == active_rooms_cap)
     {
-        room_user_counts[room_number - 1]++;
+        active_rooms_cap = active_rooms_cap ? active_rooms_cap * 2 : 64;
+        active_rooms = (ROOM **)realloc(active_rooms, active_rooms_cap * sizeof(ROOM *));
     }
-    pthread_mutex_unlock(&lock);
+    room->active_slot = nactive_rooms;
+    active_rooms[nactive_rooms++] = room;
+    return room;
 }
 
-void remove_client(int sockfd)
+void log_wake(ROOM_LOG *log);
+
+// The last user left. Users still holding the room keep it until they
+// are gone themselves. Its log files are closed by the writer once what
+// is queued is written. Caller holds lock for writing.
+void room_close(ROOM *room)
 {
-    pthread_mutex_lock(&lock);
-    USR *prev = NULL, *cur = head;
-    while (cur != NULL)
+    ROOM *last = active_rooms[--nactive_rooms];
+    active_rooms[room->active_slot] = last;
+    last->active_slot = room->active_slot;
+    ROOM_SLOT *slot = &room_table[room->number - 1];
+    slot->room = NULL;
+    slot->last_seq = atomic_load(&room->history_seq);
+    if (room->log != NULL)
     {
-        if (cur->clisockfd == sockfd)
-        {
-            if (cur->room_number >= 1 && cur->room_number <= MAX_ROOMS)
-            {
-                room_user_counts[cur->room_number - 1]--;
-            }
-
-            if (prev == NULL)
-                head = cur->next;
-            else
-                prev->next = cur->next;
-            if (cur == tail)
-                tail = prev;
-            free(cur);
-            break;
-        }
-        prev = cur;
-        cur = cur->next;
+        pthread_mutex_lock(&room->log->lock);
+        room->log->idle = 1;
+        int wake = !room->log->queued;
+        room->log->queued = 1;
+        pthread_mutex_unlock(&room->log->lock);
+        if (wake)
+            log_wake(room->log);
     }
-    pthread_mutex_unlock(&lock);
-    
-    // Cancel any active transfers involving this client
-    pthread_mutex_lock(&transfer_lock);
-    FileTransfer *transfer = transfer_head;
-    while (transfer != NULL)
+    room_number_release(room->number);
+    room_put(room);
+}
+
+// Caller holds the room lock
+void room_add_member(ROOM *room, USR *usr)
+{
+    if (room->nmembers == room->capacity)
+    {
+        room->capacity = room->capacity ? room->capacity * 2 : 8;
+        room->members = (USR **)realloc(room->members, room->capacity * sizeof(USR *));
+    }
+    usr->room_slot = room->nmembers;
+    room->members[room->nmembers++] = usr;
+}
+
+// Caller holds the room lock
+void room_remove_member(ROOM *room, USR *usr)
+{
+    USR *last = room->members[--room->nmembers];
+    room->members[usr->room_slot] = last;
+    last->room_slot = usr->room_slot;
+    usr->room_slot = -1;
+}
+
+// Keep a message in the room's history, returns its number. Caller holds
+// the room lock, so there is one writer.
+unsigned long history_add(ROOM *room, const char *text, size_t len)
+{
+    unsigned long seq = atomic_load_explicit(&room->history_seq, memory_order_relaxed) + 1;
+    HISTORY_ENTRY *entry = &room->history[seq & (HISTORY_LEN - 1)];
+    if (len > sizeof(entry->text))
+        len = sizeof(entry->text);
+
+    atomic_store_explicit(&entry->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(entry->text, text, len);
+    entry->len = (int)len;
+    atomic_store_explicit(&entry->seq, seq, memory_order_release);
+    atomic_store_explicit(&room->history_seq, seq, memory_order_release);
+    return seq;
+}
+
+// Copy message seq out of the history, 0 if it has been overwritten
+int history_read(ROOM *room, unsigned long seq, char *text)
+{
+    HISTORY_ENTRY *entry = &room->history[seq & (HISTORY_LEN - 1)];
+    if (atomic_load_explicit(&entry->seq, memory_order_acquire) != seq)
+        return 0;
+    int len = entry->len;
+    if (len < 0 || len > (int)sizeof(entry->text))
+        return 0;
+    memcpy(text, entry->text, len);
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&entry->seq, memory_order_relaxed) != seq)
+        return 0;
+    return len;
+}
+
+size_t log_record_size(uint32_t len)
+{
+    return (sizeof(LOG_RECORD) + len + 7) & ~(size_t)7;
+}
+
+uint32_t log_check(const LOG_RECORD *rec, const char *text)
+{
+    // FNV-1a over seq and time_ms, then the text
+    uint32_t h = 2166136261u;
+    const unsigned char *p = (const unsigned char *)&rec->seq;
+    for (size_t i = 0; i < sizeof(rec->seq) + sizeof(rec->time_ms); i++)
+    {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    for (uint32_t i = 0; i < rec->len; i++)
+    {
+        h ^= (unsigned char)text[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void log_path(char *path, ROOM_LOG *log, unsigned long first_seq, const char *ext)
+{
+    snprintf(path, PATH_MAX, "%s/%d/%020lu.%s", log_dir, log->room, first_seq, ext);
+}
+
+// Queue a message for the log writer. broadcast() calls this under the
+// room lock, so it only copies, the disk is the writer's business.
+void log_append(ROOM *room, unsigned long seq, const char *text, size_t len)
+{
+    ROOM_LOG *log = room->log;
+    LOG_RECORD rec;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec.len = (uint32_t)len;
+    rec.seq = seq;
+    rec.time_ms = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    rec.check = log_check(&rec, text);
+    size_t size = log_record_size(rec.len);
+
+    pthread_mutex_lock(&log->lock);
+    if (log->pending_len + size > log->pending_cap)
+    {
+        size_t cap = log->pending_cap ? log->pending_cap * 2 : 4096;
+        while (cap < log->pending_len + size)
+            cap *= 2;
+        log->pending = (char *)realloc(log->pending, cap);
+        log->pending_cap = cap;
+    }
+    char *out = log->pending + log->pending_len;
+    memcpy(out, &rec, sizeof(rec));
+    memcpy(out + sizeof(rec), text, len);
+    memset(out + sizeof(rec) + len, 0, size - sizeof(rec) - len);
+    log->pending_len += size;
+    log->appended_seq = seq;
+    int wake = !log->queued;
+    log->queued = 1;
+    pthread_mutex_unlock(&log->lock);
+
+    if (wake)
+        log_wake(log);
+}
+
+// Put a log that was just marked queued on the writer's list
+void log_wake(ROOM_LOG *log)
+{
+    pthread_mutex_lock(&log_queue_lock);
+    if (log_nqueued == log_queue_cap)
+    {
+        log_queue_cap = log_queue_cap ? log_queue_cap * 2 : 16;
+        log_queue = (ROOM_LOG **)realloc(log_queue, log_queue_cap * sizeof(ROOM_LOG *));
+    }
+    log_queue[log_nqueued++] = log;
+    pthread_cond_signal(&log_queue_cond);
+    pthread_mutex_unlock(&log_queue_lock);
+}
+
+int write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Open the last segment again to append to it, after its room reopened
+int log_reopen_segment(ROOM_LOG *log)
+{
+    char path[PATH_MAX];
+    LOG_SEGMENT *seg = &log->segs[log->nsegs - 1];
+    log_path(path, log, seg->first_seq, "log");
+    log->fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    log_path(path, log, seg->first_seq, "idx");
+    log->idx_fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (log->fd < 0 || log->idx_fd < 0)
+    {
+        printf("Message log: cannot reopen %s: %s\n", path, strerror(errno));
+        if (log->fd >= 0)
+            close(log->fd);
+        if (log->idx_fd >= 0)
+            close(log->idx_fd);
+        log->fd = log->idx_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Start a new last segment at rec, after syncing the one before it
+int log_open_segment(ROOM_LOG *log, const LOG_RECORD *rec)
+{
+    char path[PATH_MAX];
+    if (log->fd >= 0)
+    {
+        fdatasync(log->fd);
+        fdatasync(log->idx_fd);
+        close(log->fd);
+        close(log->idx_fd);
+        log->fd = log->idx_fd = -1;
+    }
+    snprintf(path, sizeof(path), "%s/%d", log_dir, log->room);
+    mkdir(path, 0755);
+    log_path(path, log, rec->seq, "log");
+    log->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    log_path(path, log, rec->seq, "idx");
+    log->idx_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (log->fd < 0 || log->idx_fd < 0)
+    {
+        printf("Message log: cannot open %s: %s\n", path, strerror(errno));
+        if (log->fd >= 0)
+            close(log->fd);
+        if (log->idx_fd >= 0)
+            close(log->idx_fd);
+        log->fd = log->idx_fd = -1;
+        return -1;
+    }
+
+    pthread_mutex_lock(&log->lock);
+    if (log->nsegs == log->segs_cap)
+    {
+        log->segs_cap = log->segs_cap ? log->segs_cap * 2 : 8;
+        log->segs = (LOG_SEGMENT *)realloc(log->segs, log->segs_cap * sizeof(LOG_SEGMENT));
+    }
+    LOG_SEGMENT *seg = &log->segs[log->nsegs++];
+    seg->first_seq = rec->seq;
+    seg->first_ms = rec->time_ms;
+    seg->size = 0;
+    seg->nindex = 0;
+    pthread_mutex_unlock(&log->lock);
+    log->nrecords = 0;
+    return 0;
+}
+
+// Append whole records to the room's last segment, moving on to a new
+// one when it is full. Only the writer thread changes the segment list.
+void log_write(ROOM_LOG *log, const char *data, size_t len)
+{
+    LOG_INDEX *index = (LOG_INDEX *)malloc((len / sizeof(LOG_RECORD) / LOG_INDEX_EVERY + 2) * sizeof(LOG_INDEX));
+    size_t pos = 0;
+    while (pos < len)
+    {
+        LOG_SEGMENT *seg = log->nsegs > 0 ? &log->segs[log->nsegs - 1] : NULL;
+        if (log->fd < 0 && seg != NULL && seg->size < LOG_SEGMENT_SIZE)
+            log_reopen_segment(log);
+        if (log->fd < 0 || seg->size >= LOG_SEGMENT_SIZE)
+        {
+            if (log_open_segment(log, (const LOG_RECORD *)(data + pos)) < 0)
+                break;
+            seg = &log->segs[log->nsegs - 1];
+        }
+
+        // The records this segment still has room for, in one write
+        size_t end = pos, size = seg->size;
+        unsigned long last_seq = log->logged_seq;
+        int nindex = 0;
+        while (end < len && size < LOG_SEGMENT_SIZE)
+        {
+            const LOG_RECORD *rec = (const LOG_RECORD *)(data + end);
+            last_seq = rec->seq;
+            if (log->nrecords++ % LOG_INDEX_EVERY == 0)
+            {
+                index[nindex].seq = rec->seq;
+                index[nindex].time_ms = rec->time_ms;
+                index[nindex].offset = size;
+                nindex++;
+            }
+            size += log_record_size(rec->len);
+            end += log_record_size(rec->len);
+        }
+        if (write_all(log->fd, data + pos, end - pos) < 0 ||
+            write_all(log->idx_fd, (const char *)index, nindex * sizeof(LOG_INDEX)) < 0)
+        {
+            printf("Message log: write failed for room %d: %s\n", log->room, strerror(errno));
+            break;
+        }
+        atomic_fetch_add(&stat_log_bytes, (long)(end - pos));
+        atomic_store(&snapshot_dirty, 1);
+        log->logged_seq = last_seq;
+
+        pthread_mutex_lock(&log->lock);
+        seg->size = size;
+        seg->nindex += nindex;
+        pthread_mutex_unlock(&log->lock);
+        pos = end;
+    }
+    free(index);
+}
+
+ROOM_LOG *log_new(int room_number)
+{
+    ROOM_LOG *log = (ROOM_LOG *)calloc(1, sizeof(ROOM_LOG));
+    pthread_mutex_init(&log->lock, NULL);
+    log->room = room_number;
+    log->fd = log->idx_fd = -1;
+    log->idle = 1;
+    return log;
+}
+
+// The slot of a room number found on disk, taking the table that far.
+// Only while recovering, before anyone connects.
+ROOM_SLOT *room_reserve(int room_number)
+{
+    room_table_grow(room_number);
+    if (next_room <= room_number)
+        next_room = room_number + 1;
+    return &room_table[room_number - 1];
+}
+
+// What a session is kept and looked up under, so neither the table nor
+// the snapshot holds a token that could be used to take it over
+void session_key(char *key, const char *token)
+{
+    SHA256_CTX ctx;
+    unsigned char digest[SHA256_LEN];
+    sha256_init(&ctx);
+    sha256_update(&ctx, token, strlen(token));
+    sha256_final(&ctx, digest);
+    for (int i = 0; i < SHA256_LEN; i++)
+    {
+        sprintf(key + 2 * i, "%02x", digest[i]);
+    }
+}
+
+unsigned int session_hash(const char *key)
+{
+    unsigned int h = 2166136261u;
+    for (const char *c = key; *c; c++)
+    {
+        h ^= (unsigned char)*c;
+        h *= 16777619u;
+    }
+    return h % SESSION_BUCKETS;
+}
+
+// Caller holds session_lock
+SESSION *session_find(const char *key)
+{
+    SESSION *cur = sessions[session_hash(key)];
+    while (cur != NULL && strcmp(cur->key, key) != 0)
+        cur = cur->next;
+    return cur;
+}
+
+// Caller holds session_lock
+SESSION *session_add(const char *key, const char *username, int room_number, long expires)
+{
+    SESSION *session = (SESSION *)calloc(1, sizeof(SESSION));
+    snprintf(session->key, sizeof(session->key), "%s", key);
+    snprintf(session->username, sizeof(session->username), "%s", username);
+    session->room_number = room_number;
+    session->expires = expires;
+    unsigned int b = session_hash(key);
+    session->next = sessions[b];
+    sessions[b] = session;
+    nsessions++;
+    return session;
+}
+
+// Room metadata, where each room's log ends and the sessions, so a
+// restart neither walks whole logs nor loses anyone's place. Written to
+// a temporary file and renamed over the last one. Runs on the log writer
+// right after a commit, so every size in it is on disk. Only the server's
+// user may read it, sessions are in it by key.
+void snapshot_write()
+{
+    char path[PATH_MAX], tmp[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/snapshot", log_dir);
+    snprintf(tmp, sizeof(tmp), "%s/snapshot.tmp", log_dir);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    FILE *f = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (f == NULL)
+    {
+        printf("Snapshot: cannot write %s: %s\n", tmp, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+
+    // Every room with a log. Logs are never freed, so copies of the
+    // slots do once the table is let go of.
+    pthread_rwlock_rdlock(&lock);
+    int next = next_room;
+    ROOM_SLOT *slots = (ROOM_SLOT *)malloc((next + 1) * sizeof(ROOM_SLOT));
+    int nslots = 0;
+    for (int i = 0; i < next - 1; i++)
+    {
+        if (room_table[i].log != NULL)
+            slots[nslots++] = room_table[i];
+    }
+    pthread_rwlock_unlock(&lock);
+    fprintf(f, "%s\nnext_room %d\n", SNAPSHOT_MAGIC, next);
+
+    for (int i = 0; i < nslots; i++)
+    {
+        ROOM_LOG *log = slots[i].log;
+        pthread_mutex_lock(&log->lock);
+        fprintf(f, "room %d %ld %lu %lu %d %s\n", log->room, slots[i].created_at, log->logged_seq,
+                log->nrecords, log->nsegs, slots[i].creator);
+        for (int j = 0; j < log->nsegs; j++)
+        {
+            LOG_SEGMENT *seg = &log->segs[j];
+            fprintf(f, "seg %lu %lld %zu %zu\n", seg->first_seq,
+                    (long long)seg->first_ms, seg->size, seg->nindex);
+        }
+        pthread_mutex_unlock(&log->lock);
+    }
+    free(slots);
+
+    // A session still in use gets its full time from now
+    long now = (long)time(NULL);
+    pthread_mutex_lock(&session_lock);
+    for (int i = 0; i < SESSION_BUCKETS; i++)
+    {
+        for (SESSION *cur = sessions[i]; cur != NULL; cur = cur->next)
+        {
+            long expires = cur->expires ? cur->expires : now + SESSION_TTL;
+            if (expires > now)
+                fprintf(f, "session %s %d %ld %s\n", cur->key, cur->room_number,
+                        expires, cur->username);
+        }
+    }
+    pthread_mutex_unlock(&session_lock);
+
+    int ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+    fclose(f);
+    if (!ok || rename(tmp, path) < 0)
+    {
+        printf("Snapshot: cannot write %s: %s\n", path, strerror(errno));
+        return;
+    }
+    int dirfd = open(log_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd >= 0)
+    {
+        fsync(dirfd);
+        close(dirfd);
+    }
+}
+
+// Load the last snapshot into the rooms' logs and the session table.
+// Returns the number of rooms it had, -1 if there is none.
+int snapshot_read()
+{
+    char path[PATH_MAX], line[256];
+    snprintf(path, sizeof(path), "%s/snapshot", log_dir);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        return -1;
+    }
+    if (fgets(line, sizeof(line), f) == NULL)
+        line[0] = '\0';
+    // An older snapshot's tokens are keyed as they are read
+    int tokens = strncmp(line, SNAPSHOT_MAGIC_TOKENS, strlen(SNAPSHOT_MAGIC_TOKENS)) == 0;
+    if (!tokens && strncmp(line, SNAPSHOT_MAGIC, strlen(SNAPSHOT_MAGIC)) != 0)
+    {
+        printf("Snapshot: %s is not a snapshot, ignored\n", path);
+        fclose(f);
+        return -1;
+    }
+
+    int nrooms = 0, room_number, nsegs, n;
+    long now = (long)time(NULL), created;
+    ROOM_LOG *log = NULL;
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        unsigned long seq, nrecords;
+        long long first_ms;
+        long expires;
+        size_t size, nindex;
+        char key[SESSION_KEY_LEN + 1], token[SESSION_TOKEN_LEN + 1];
+        if (sscanf(line, "next_room %d", &n) == 1 && n > 1)
+        {
+            room_reserve(n - 1);
+        }
+        else if (sscanf(line, "room %d %ld %lu %lu %d %n", &room_number, &created, &seq, &nrecords, &nsegs, &n) == 5 &&
+                 room_number > 0)
+        {
+            ROOM_SLOT *slot = room_reserve(room_number);
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(slot->creator, sizeof(slot->creator), "%s", line + n);
+            slot->created_at = created;
+            if (slot->log == NULL)
+                slot->log = log_new(room_number);
+            log = slot->log;
+            log->logged_seq = seq;
+            log->nrecords = nrecords;
+            nrooms++;
+        }
+        else if (sscanf(line, "seg %lu %lld %zu %zu", &seq, &first_ms, &size, &nindex) == 4 && log != NULL)
+        {
+            if (log->nsegs == log->segs_cap)
+            {
+                log->segs_cap = log->segs_cap ? log->segs_cap * 2 : 8;
+                log->segs = (LOG_SEGMENT *)realloc(log->segs, log->segs_cap * sizeof(LOG_SEGMENT));
+            }
+            LOG_SEGMENT *seg = &log->segs[log->nsegs++];
+            seg->first_seq = seq;
+            seg->first_ms = first_ms;
+            seg->size = size;
+            seg->nindex = nindex;
+        }
+        else if (sscanf(line, "session %64s %d %ld %n", key, &room_number, &expires, &n) == 3 &&
+                 strlen(key) == (tokens ? SESSION_TOKEN_LEN : SESSION_KEY_LEN) && expires > now && room_number > 0)
+        {
+            line[strcspn(line, "\n")] = '\0';
+            if (tokens)
+            {
+                strcpy(token, key);
+                session_key(key, token);
+            }
+            session_add(key, line + n, room_number, expires);
+            room_reserve(room_number)->sessions++;
+        }
+    }
+    fclose(f);
+    return nrooms;
+}
+
+// Group commit: whatever the rooms queued while the last batch was
+// written and synced goes out together, one fdatasync per file. A
+// snapshot follows a commit every SNAPSHOT_INTERVAL if anything changed.
+void *log_writer(void *arg)
+{
+    ROOM_LOG **batch = NULL;
+    int batch_cap = 0;
+    long last_snapshot = now_sec();
+
+    while (1)
+    {
+        pthread_mutex_lock(&log_queue_lock);
+        while (log_nqueued == 0 && now_sec() < last_snapshot + SNAPSHOT_INTERVAL)
+        {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += last_snapshot + SNAPSHOT_INTERVAL - now_sec();
+            pthread_cond_timedwait(&log_queue_cond, &log_queue_lock, &until);
+        }
+        ROOM_LOG **taken = log_queue;
+        int taken_cap = log_queue_cap;
+        int n = log_nqueued;
+        log_queue = batch;
+        log_queue_cap = batch_cap;
+        log_nqueued = 0;
+        batch = taken;
+        batch_cap = taken_cap;
+        pthread_mutex_unlock(&log_queue_lock);
+
+        for (int i = 0; i < n; i++)
+        {
+            ROOM_LOG *log = batch[i];
+            pthread_mutex_lock(&log->lock);
+            char *data = log->pending;
+            size_t len = log->pending_len;
+            log->pending = NULL;
+            log->pending_len = log->pending_cap = 0;
+            log->queued = 0;
+            pthread_mutex_unlock(&log->lock);
+
+            log_write(log, data, len);
+            free(data);
+        }
+        for (int i = 0; i < n; i++)
+        {
+            if (batch[i]->fd >= 0)
+            {
+                fdatasync(batch[i]->fd);
+                fdatasync(batch[i]->idx_fd);
+            }
+        }
+        // A closed room does not keep its files open, the next write
+        // after it reopens opens them again
+        for (int i = 0; i < n; i++)
+        {
+            ROOM_LOG *log = batch[i];
+            pthread_mutex_lock(&log->lock);
+            if (log->idle && !log->queued && log->fd >= 0)
+            {
+                close(log->fd);
+                close(log->idx_fd);
+                log->fd = log->idx_fd = -1;
+            }
+            pthread_mutex_unlock(&log->lock);
+        }
+        if (n > 0)
+            atomic_fetch_add(&stat_log_commits, 1);
+
+        if (now_sec() >= last_snapshot + SNAPSHOT_INTERVAL)
+        {
+            if (atomic_exchange(&snapshot_dirty, 0))
+                snapshot_write();
+            last_snapshot = now_sec();
+        }
+    }
+    return NULL;
+}
+
+int log_seg_cmp(const void *a, const void *b)
+{
+    unsigned long x = ((const LOG_SEGMENT *)a)->first_seq;
+    unsigned long y = ((const LOG_SEGMENT *)b)->first_seq;
+    return x < y ? -1 : x > y;
+}
+
+// A segment before the last one may have grown after the snapshot vouched
+// for part of it. Its size and index are taken from the files, walking
+// only the records past the snapshot's size, or all of them if the file
+// is shorter than that.
+void log_segment_check(ROOM_LOG *log, LOG_SEGMENT *seg)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    log_path(path, log, seg->first_seq, "idx");
+    size_t have = stat(path, &st) == 0 ? (size_t)st.st_size / sizeof(LOG_INDEX) : 0;
+    log_path(path, log, seg->first_seq, "log");
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        seg->size = seg->nindex = 0;
+        return;
+    }
+    size_t fsize = (size_t)st.st_size;
+    if (fsize == seg->size)
+    {
+        close(fd);
+        if (seg->nindex > have)
+            seg->nindex = have;
+        return;
+    }
+
+    size_t pos = seg->size < fsize ? seg->size : 0;
+    size_t kept = 0, nindex = 0;
+    if (pos > 0)
+        kept = seg->nindex < have ? seg->nindex : have;
+    char *map = (char *)mmap(NULL, fsize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        seg->size = seg->nindex = 0;
+        return;
+    }
+    LOG_INDEX *index = (LOG_INDEX *)malloc(((fsize - pos) / sizeof(LOG_RECORD) / LOG_INDEX_EVERY + 1) * sizeof(LOG_INDEX));
+    unsigned long seq = seg->first_seq - 1;
+    int chained = pos == 0; // the number of the next record is known
+    while (pos + sizeof(LOG_RECORD) <= fsize)
+    {
+        const LOG_RECORD *rec = (const LOG_RECORD *)(map + pos);
+        if ((chained ? rec->seq != seq + 1 : rec->seq <= seg->first_seq) || rec->len > HISTORY_TEXT_LEN ||
+            pos + log_record_size(rec->len) > fsize ||
+            rec->check != log_check(rec, (const char *)(rec + 1)))
+            break;
+        if ((rec->seq - seg->first_seq) % LOG_INDEX_EVERY == 0)
+        {
+            index[nindex].seq = rec->seq;
+            index[nindex].time_ms = rec->time_ms;
+            index[nindex].offset = pos;
+            nindex++;
+        }
+        if (seg->first_ms == 0)
+            seg->first_ms = rec->time_ms;
+        seq = rec->seq;
+        chained = 1;
+        pos += log_record_size(rec->len);
+    }
+    munmap(map, fsize);
+    if (pos < fsize)
+        printf("Message log: room %d segment %lu ends in %zu bytes that do not check out\n",
+               log->room, seg->first_seq, fsize - pos);
+    seg->size = pos;
+
+    // Entries the snapshot vouched for stay, the walked ones follow them
+    log_path(path, log, seg->first_seq, "idx");
+    int idx_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (idx_fd < 0 || ftruncate(idx_fd, kept * sizeof(LOG_INDEX)) < 0 ||
+        write_all(idx_fd, (const char *)index, nindex * sizeof(LOG_INDEX)) < 0)
+        nindex = 0;
+    if (idx_fd >= 0)
+        close(idx_fd);
+    free(index);
+    seg->nindex = kept + nindex;
+}
+
+// Find a room's segments, cut its last one back to the last whole record
+// and carry on appending there. Message numbers go on from the log. The
+// snapshot saves walking what it knew: a segment it did not list is taken
+// from the files, one it did is only walked past the snapshot's size, and
+// so is the last segment.
+void log_recover(ROOM_LOG *log)
+{
+    int known = log->nsegs;
+    log->appended_seq = log->logged_seq;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%d", log_dir, log->room);
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+    {
+        log->nsegs = 0;
+        return;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL)
+    {
+        unsigned long first_seq;
+        int n = 0, seen = 0;
+        if (sscanf(ent->d_name, "%lu.log%n", &first_seq, &n) != 1 || ent->d_name[n] != '\0' || n == 0)
+            continue;
+        for (int i = 0; i < known; i++)
+        {
+            if (log->segs[i].first_seq == first_seq)
+                seen = 1;
+        }
+        if (seen)
+            continue;
+        if (log->nsegs == log->segs_cap)
+        {
+            log->segs_cap = log->segs_cap ? log->segs_cap * 2 : 8;
+            log->segs = (LOG_SEGMENT *)realloc(log->segs, log->segs_cap * sizeof(LOG_SEGMENT));
+        }
+        LOG_SEGMENT *seg = &log->segs[log->nsegs++];
+        struct stat st;
+        seg->first_seq = first_seq;
+        seg->first_ms = 0;
+        log_path(path, log, first_seq, "log");
+        seg->size = stat(path, &st) == 0 ? (size_t)st.st_size : 0;
+        log_path(path, log, first_seq, "idx");
+        seg->nindex = stat(path, &st) == 0 ? (size_t)st.st_size / sizeof(LOG_INDEX) : 0;
+
+        // Time lookups start from a segment's first record
+        LOG_RECORD rec;
+        log_path(path, log, first_seq, "log");
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0 && pread(fd, &rec, sizeof(rec), 0) == sizeof(rec))
+            seg->first_ms = rec.time_ms;
+        if (fd >= 0)
+            close(fd);
+    }
+    closedir(dir);
+    if (log->nsegs == 0)
+    {
+        return;
+    }
+    qsort(log->segs, log->nsegs, sizeof(LOG_SEGMENT), log_seg_cmp);
+    for (int i = 0; i < log->nsegs - 1; i++)
+    {
+        log_segment_check(log, &log->segs[i]);
+    }
+
+    // Walk the last segment up to the first record that does not check
+    // out, from the snapshot's end of it if it has one
+    LOG_SEGMENT *seg = &log->segs[log->nsegs - 1];
+    log_path(path, log, seg->first_seq, "log");
+    int fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    size_t pos = 0, nindex = 0, fsize = (size_t)st.st_size;
+    unsigned long seq = seg->first_seq - 1;
+    if (known > 0 && seg == &log->segs[known - 1] && seg->size <= fsize)
+    {
+        // The snapshot's last segment is still the last one, and its
+        // record count and last message number go with it
+        pos = seg->size;
+        nindex = seg->nindex;
+        seq = log->logged_seq;
+    }
+    else
+    {
+        log->nrecords = 0;
+    }
+    char *map = fsize > 0 ? (char *)mmap(NULL, fsize, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+    if (map == MAP_FAILED)
+        map = NULL;
+    size_t kept = nindex;
+    LOG_INDEX *index = (LOG_INDEX *)malloc(((fsize - pos) / sizeof(LOG_RECORD) / LOG_INDEX_EVERY + 1) * sizeof(LOG_INDEX));
+    while (map != NULL && pos + sizeof(LOG_RECORD) <= fsize)
+    {
+        const LOG_RECORD *rec = (const LOG_RECORD *)(map + pos);
+        if (rec->seq != seq + 1 || rec->len > HISTORY_TEXT_LEN ||
+            pos + log_record_size(rec->len) > fsize ||
+            rec->check != log_check(rec, (const char *)(rec + 1)))
+            break;
+        if (log->nrecords++ % LOG_INDEX_EVERY == 0)
+        {
+            index[nindex - kept].seq = rec->seq;
+            index[nindex - kept].time_ms = rec->time_ms;
+            index[nindex - kept].offset = pos;
+            nindex++;
+        }
+        if (seg->first_ms == 0)
+            seg->first_ms = rec->time_ms;
+        seq = rec->seq;
+        pos += log_record_size(rec->len);
+    }
+    if (map != NULL)
+        munmap(map, fsize);
+    if (pos < fsize)
+    {
+        printf("Message log: room %d lost %zu bytes of a torn write\n", log->room, fsize - pos);
+        if (ftruncate(fd, pos) < 0)
+            perror("ftruncate");
+    }
+    seg->size = pos;
+
+    // The index keeps what the snapshot vouched for, the rest is rebuilt
+    log_path(path, log, seg->first_seq, "idx");
+    int idx_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (idx_fd < 0 || ftruncate(idx_fd, kept * sizeof(LOG_INDEX)) < 0 ||
+        write_all(idx_fd, (const char *)index, (nindex - kept) * sizeof(LOG_INDEX)) < 0)
+    {
+        if (idx_fd >= 0)
+            close(idx_fd);
+        close(fd);
+        free(index);
+        return;
+    }
+    free(index);
+    seg->nindex = nindex;
+    close(fd);
+    close(idx_fd);
+    log->logged_seq = seq;
+    log->appended_seq = seq;
+}
+
+// Give every room a log, pick up from the snapshot and what the logs
+// have beyond it, then start the writer
+void log_init()
+{
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (mkdir(log_dir, 0755) < 0 && errno != EEXIST)
+        error("ERROR creating message log directory");
+    last_session_sweep = (long)time(NULL);
+    int nrooms = snapshot_read();
+
+    // Rooms the snapshot does not know yet
+    DIR *dir = opendir(log_dir);
+    struct dirent *ent;
+    while (dir != NULL && (ent = readdir(dir)) != NULL)
+    {
+        int room_number, n = 0;
+        if (sscanf(ent->d_name, "%d%n", &room_number, &n) != 1 || ent->d_name[n] != '\0' || room_number < 1)
+            continue;
+        ROOM_SLOT *slot = room_reserve(room_number);
+        if (slot->log == NULL)
+            slot->log = log_new(room_number);
+    }
+    if (dir != NULL)
+        closedir(dir);
+
+    // Numbers in between are free, lowest handed out first
+    for (int i = next_room - 1; i >= 1; i--)
+    {
+        if (room_table[i - 1].log != NULL)
+            log_recover(room_table[i - 1].log);
+        else
+            room_number_release(i);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (nrooms >= 0)
+        printf("Recovered %d rooms and %d sessions from the snapshot in %.1f ms\n", nrooms, nsessions,
+               (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, log_writer, NULL) != 0)
+        error("ERROR creating message log thread");
+    pthread_detach(tid);
+}
+
+RELAY_PIPE *relay_pipe_new()
+{
+    RELAY_PIPE *pipe = (RELAY_PIPE *)malloc(sizeof(RELAY_PIPE));
+    if (pipe2(pipe->fds, O_NONBLOCK | O_CLOEXEC) < 0)
+    {
+        free(pipe);
+        return NULL;
+    }
+    // A bigger pipe means fewer round trips per chunk, keep the default if refused
+    fcntl(pipe->fds[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+    pipe->size = fcntl(pipe->fds[1], F_GETPIPE_SZ);
+    atomic_init(&pipe->refcnt, 1);
+    return pipe;
+}
+
+RELAY_PIPE *relay_pipe_get(RELAY_PIPE *pipe)
+{
+    atomic_fetch_add(&pipe->refcnt, 1);
+    return pipe;
+}
+
+void relay_pipe_put(RELAY_PIPE *pipe)
+{
+    if (pipe != NULL && atomic_fetch_sub(&pipe->refcnt, 1) == 1)
+    {
+        close(pipe->fds[0]);
+        close(pipe->fds[1]);
+        free(pipe);
+    }
+}
+
+// Bytes sitting in the pipe
+int relay_pipe_used(RELAY_PIPE *pipe)
+{
+    int used = 0;
+    ioctl(pipe->fds[0], FIONREAD, &used);
+    return used;
+}
+
+size_t outq_item_len(OUTQ_ITEM *item)
+{
+    return item->pipe ? item->len : item->buf->len;
+}
+
+void outq_item_release(OUTQ_ITEM *item)
+{
+    if (item->pipe)
+        relay_pipe_put(item->pipe);
+    else
+        msgbuf_put(item->buf);
+}
+
+USR *user_get(USR *usr)
+{
+    atomic_fetch_add(&usr->refcnt, 1);
+    return usr;
+}
+
+// Drop a reference, the socket is only closed with the last one so a
+// holder never writes into an fd that was reused by a new connection
+void user_put(USR *usr)
+{
+    if (usr != NULL && atomic_fetch_sub(&usr->refcnt, 1) == 1)
+    {
+        OUTQ *q = &usr->outq;
+        for (int i = 0; i < q->count; i++)
+        {
+            outq_item_release(&q->items[(q->head + i) % q->capacity]);
+        }
+        atomic_fetch_sub(&stat_queued, q->count);
+        free(q->items);
+        free(q->waiters);
+        free(usr->inbuf);
+        free(usr->xfers);
+        relay_pipe_put(usr->relay);
+        if (usr->relay_to != NULL)
+            user_put(usr->relay_to);
+        if (usr->owner != NULL)
+            user_put(usr->owner);
+        room_put(usr->room);
+        pthread_mutex_destroy(&q->lock);
+        close(usr->clisockfd);
+        free(usr);
+    }
+}
+
+// Caller holds q->lock
+OUTQ_ITEM *outq_append(OUTQ *q)
+{
+    if (q->count == q->capacity)
+    {
+        int capacity = q->capacity ? q->capacity * 2 : 16;
+        OUTQ_ITEM *items = (OUTQ_ITEM *)malloc(capacity * sizeof(OUTQ_ITEM));
+        for (int i = 0; i < q->count; i++)
+        {
+            items[i] = q->items[(q->head + i) % q->capacity];
+        }
+        free(q->items);
+        q->items = items;
+        q->capacity = capacity;
+        q->head = 0;
+    }
+    OUTQ_ITEM *item = &q->items[(q->head + q->count) % q->capacity];
+    q->count++;
+    if (q->count > q->high_water)
+        q->high_water = q->count;
+    atomic_fetch_add(&stat_queued, 1);
+    return item;
+}
+
+// Caller holds q->lock
+void outq_push(OUTQ *q, MSGBUF *buf, int reliable)
+{
+    OUTQ_ITEM *item = outq_append(q);
+    item->buf = msgbuf_get(buf);
+    item->pipe = NULL;
+    item->reliable = reliable;
+}
+
+// Caller holds q->lock
+void outq_pop(OUTQ *q)
+{
+    outq_item_release(&q->items[q->head]);
+    q->head = (q->head + 1) % q->capacity;
+    q->count--;
+    q->offset = 0;
+    atomic_fetch_sub(&stat_queued, 1);
+}
+
+// Drop the oldest chat message that has not started going out yet,
+// returns 0 if everything queued is file data. Caller holds q->lock.
+int outq_drop_oldest(OUTQ *q)
+{
+    for (int i = (q->offset > 0); i < q->count; i++)
+    {
+        int idx = (q->head + i) % q->capacity;
+        if (q->items[idx].reliable)
+            continue;
+
+        msgbuf_put(q->items[idx].buf);
+        // Close the gap by shifting the older entries up one slot
+        for (int j = i; j > 0; j--)
+        {
+            q->items[(q->head + j) % q->capacity] = q->items[(q->head + j - 1) % q->capacity];
+        }
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        q->dropped++;
+        atomic_fetch_sub(&stat_queued, 1);
+        atomic_fetch_add(&stat_dropped, 1);
+        return 1;
+    }
+    return 0;
+}
+
+// EPOLL_CTL_MOD re-arms the edge so data already buffered is reported
+void rearm_input(USR *usr)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = usr;
+    epoll_ctl(usr->loop->epfd, EPOLL_CTL_MOD, usr->clisockfd, &ev);
+}
+
+// Let a paused producer read again once it waits on nothing else
+void resume_producer(USR *usr)
+{
+    if (atomic_fetch_sub(&usr->paused, 1) == 1)
+    {
+        rearm_input(usr);
+    }
+}
+
+// Caller holds q->lock
+void outq_release_waiters(OUTQ *q)
+{
+    for (int i = 0; i < q->nwaiters; i++)
+    {
+        resume_producer(q->waiters[i]);
+        user_put(q->waiters[i]);
+    }
+    q->nwaiters = 0;
+}
+
+// Whether the queue's connection is going away
+int outq_dead(OUTQ *q)
+{
+    pthread_mutex_lock(&q->lock);
+    int dead = q->dead;
+    pthread_mutex_unlock(&q->lock);
+    return dead;
+}
+
+// Write as much of the queue as the socket takes. Caller holds usr->outq.lock.
+void outq_flush(USR *usr)
+{
+    OUTQ *q = &usr->outq;
+
+    while (q->count > 0 && !q->dead)
+    {
+        OUTQ_ITEM *head = &q->items[q->head];
+        if (head->pipe)
+        {
+            // Relayed file data goes straight from the pipe to the socket
+            ssize_t moved = splice(head->pipe->fds[0], NULL, usr->clisockfd, NULL,
+                                   head->len - q->offset, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    q->dead = 1;
+                break;
+            }
+            q->offset += moved;
+            if (q->offset == head->len)
+                outq_pop(q);
+            continue;
+        }
+
+        // Buffers up to the next pipe item go out in one writev
+        struct iovec iov[MAX_IOV];
+        int n = 0;
+        for (int i = 0; i < q->count && n < MAX_IOV; i++, n++)
+        {
+            OUTQ_ITEM *item = &q->items[(q->head + i) % q->capacity];
+            if (item->pipe)
+                break;
+            size_t skip = (i == 0) ? q->offset : 0;
+            iov[n].iov_base = item->buf->data + skip;
+            iov[n].iov_len = item->buf->len - skip;
+        }
+
+        ssize_t written = writev(usr->clisockfd, iov, n);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            // EAGAIN waits for EPOLLOUT, real errors surface as EPOLLERR
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                q->dead = 1;
+            break;
+        }
+
+        while (written > 0)
+        {
+            size_t left = outq_item_len(&q->items[q->head]) - q->offset;
+            if ((size_t)written < left)
+            {
+                q->offset += written;
+                break;
+            }
+            written -= left;
+            outq_pop(q);
+        }
+    }
+
+    // Producers held back by this reader may continue at half depth
+    if (q->nwaiters > 0 && q->count <= max_queue / 2)
+    {
+        outq_release_waiters(q);
+    }
+}
+
+unsigned int name_hash(const char *username, int room_number)
+{
+    // FNV-1a over the room number and the name
+    unsigned int h = 2166136261u ^ (unsigned int)room_number;
+    h *= 16777619u;
+    for (const char *c = username; *c; c++)
+    {
+        h ^= (unsigned char)*c;
+        h *= 16777619u;
+    }
+    return h % USER_BUCKETS;
+}
+
+// Find user by socket file descriptor
+USR *find_user_by_sockfd(int sockfd)
+{
+    USR *usr = NULL;
+    pthread_rwlock_rdlock(&lock);
+    if (sockfd >= 0 && sockfd < users_by_fd_size && users_by_fd[sockfd] != NULL)
+    {
+        usr = user_get(users_by_fd[sockfd]);
+    }
+    pthread_rwlock_unlock(&lock);
+    return usr;
+}
+
+// Caller holds lock
+USR *lookup_name(const char *username, int room_number)
+{
+    USR *cur = users_by_name[name_hash(username, room_number)];
+    while (cur != NULL)
+    {
+        if (cur->room_number == room_number && strcmp(cur->username, username) == 0)
+        {
+            return cur;
+        }
+        cur = cur->name_next;
+    }
+    return NULL;
+}
+
+// Find user by username in a specific room
+USR *find_user_by_name(const char *username, int room_number)
+{
+    pthread_rwlock_rdlock(&lock);
+    USR *usr = lookup_name(username, room_number);
+    if (usr != NULL)
+    {
+        user_get(usr);
+    }
+    pthread_rwlock_unlock(&lock);
+    return usr;
+}
+
+// Pause a producer until q drains. Caller holds q->lock.
+void outq_add_waiter(OUTQ *q, USR *from)
+{
+    if (q->nwaiters == q->waiters_cap)
+    {
+        q->waiters_cap = q->waiters_cap ? q->waiters_cap * 2 : 4;
+        q->waiters = (USR **)realloc(q->waiters, q->waiters_cap * sizeof(USR *));
+    }
+    q->waiters[q->nwaiters++] = user_get(from);
+    atomic_fetch_add(&from->paused, 1);
+    atomic_fetch_add(&stat_paused, 1);
+}
+
+// Apply the slow reader policy before queueing to usr, returns 0 if the
+// message must not be queued. Caller holds q->lock.
+int outq_make_room(USR *usr, USR *from, SLOW_POLICY policy, int reliable)
+{
+    OUTQ *q = &usr->outq;
+
+    if (q->dead)
+    {
+        return 0;
+    }
+
+    if (q->count >= max_queue)
+    {
+        if (policy == SLOW_DROP_OLDEST && !reliable && outq_drop_oldest(q))
+        {
+            // made room
+        }
+        else if (policy == SLOW_DISCONNECT && !reliable)
+        {
+            q->dead = 1;
+            atomic_fetch_add(&stat_disconnected, 1);
+            printf("Disconnecting slow reader %s\n", usr->username);
+            // The event loop sees the hangup and closes the connection
+            shutdown(usr->clisockfd, SHUT_RDWR);
+            return 0;
+        }
+        else if (from != NULL && from != usr)
+        {
+            // Over the limit, hold the producer back until this queue drains
+            int waiting = 0;
+            for (int i = 0; i < q->nwaiters; i++)
+            {
+                if (q->waiters[i] == from)
+                    waiting = 1;
+            }
+            if (!waiting)
+            {
+                outq_add_waiter(q, from);
+            }
+        }
+    }
+    return 1;
+}
+
+// Queue a shared message for one recipient and try to write it right away.
+// from is the connection that produced it, paused under SLOW_BACKPRESSURE.
+void queue_message(USR *usr, MSGBUF *buf, USR *from, SLOW_POLICY policy, int reliable)
+{
+    OUTQ *q = &usr->outq;
+
+    pthread_mutex_lock(&q->lock);
+    if (outq_make_room(usr, from, policy, reliable))
+    {
+        outq_push(q, buf, reliable);
+        if (q->count == 1)
+        {
+            outq_flush(usr);
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+// A data frame whose body is shared with the chunk store: its header and
+// body go out back to back, nothing can come between them
+void queue_frame(USR *usr, MSGBUF *head, MSGBUF *body, USR *from)
+{
+    OUTQ *q = &usr->outq;
+
+    pthread_mutex_lock(&q->lock);
+    if (outq_make_room(usr, from, SLOW_BACKPRESSURE, 1))
+    {
+        outq_push(q, head, 1);
+        outq_push(q, body, 1);
+        if (q->count == 2)
+        {
+            outq_flush(usr);
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Frame for one receiver of a multicast, head then body if there is one.
+// Never holds the sender back. Returns the queue length after, -1 if the
+// receiver is gone.
+int queue_member_frame(USR *usr, MSGBUF *head, MSGBUF *body)
+{
+    OUTQ *q = &usr->outq;
+    int count = -1;
+
+    pthread_mutex_lock(&q->lock);
+    if (!q->dead)
+    {
+        outq_push(q, head, 1);
+        if (body != NULL)
+            outq_push(q, body, 1);
+        if (q->count == (body != NULL ? 2 : 1))
+        {
+            outq_flush(usr);
+        }
+        count = q->count;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return count;
+}
+
+// len bytes just spliced into pipe, they go out after what is queued
+void queue_pipe(USR *usr, RELAY_PIPE *pipe, size_t len)
+{
+    OUTQ *q = &usr->outq;
+
+    pthread_mutex_lock(&q->lock);
+    if (!q->dead)
+    {
+        OUTQ_ITEM *item = outq_append(q);
+        item->buf = NULL;
+        item->pipe = relay_pipe_get(pipe);
+        item->len = len;
+        item->reliable = 1;
+        if (q->count == 1)
+        {
+            outq_flush(usr);
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Hand a shared chat message to one recipient
+void deliver(USR *usr, MSGBUF *buf, USR *from)
+{
+    queue_message(usr, buf, from, slow_policy, 0);
+}
+
+// Encode server generated bytes the way this connection expects them
+MSGBUF *msgbuf_for(USR *usr, int type, const char *data, size_t len)
+{
+    if (usr->framed)
+        return msgbuf_frame(type, 0, data, len);
+    return msgbuf_copy(data, len);
+}
+
+// Copy a server generated text message to one connection
+void send_text(USR *usr, const char *text)
+{
+    MSGBUF *buf = msgbuf_for(usr, MSG_TEXT, text, strlen(text));
+    deliver(usr, buf, NULL);
+    msgbuf_put(buf);
+}
+
+// Transfer control message, framed clients get it as MSG_CTRL
+void send_ctrl(USR *usr, const char *text)
+{
+    MSGBUF *buf = msgbuf_for(usr, MSG_CTRL, text, strlen(text));
+    deliver(usr, buf, NULL);
+    msgbuf_put(buf);
+}
+
+// Where file data for usr goes out: its data connection once one is
+// attached. Returns a reference, caller holds transfer_lock.
+USR *data_channel(USR *usr)
+{
+    return user_get(usr->data != NULL ? usr->data : usr);
+}
+
+// Transfer control that has to stay in order with the file data around it
+void send_data_ctrl(USR *usr, const char *text)
+{
+    pthread_rwlock_rdlock(&transfer_lock);
+    USR *out = data_channel(usr);
+    pthread_rwlock_unlock(&transfer_lock);
+    send_ctrl(out, text);
+    user_put(out);
+}
+
+// Transfer control for whoever is registered on sockfd, 0 if nobody is
+int send_to_sockfd(int sockfd, const char *data, size_t len)
+{
+    USR *usr = find_user_by_sockfd(sockfd);
+    if (usr == NULL)
+    {
+        return 0;
+    }
+    MSGBUF *buf = msgbuf_for(usr, MSG_CTRL, data, len);
+    deliver(usr, buf, NULL);
+    msgbuf_put(buf);
+    user_put(usr);
+    return 1;
+}
+
+// First byte of range i when a file is split into nstreams ranges, the
+// clients split it the same way
+size_t stream_start(size_t filesize, int nstreams, int i)
+{
+    return i >= nstreams ? filesize : filesize / nstreams * i;
+}
+
+// Per range offsets travel as one comma separated word
+void format_offsets(char *out, const size_t *offsets, int n)
+{
+    out += sprintf(out, "%zu", offsets[0]);
+    for (int i = 1; i < n; i++)
+    {
+        out += sprintf(out, ",%zu", offsets[i]);
+    }
+}
+
+// Returns the number of offsets read, -1 if they are not valid for the
+// transfer's ranges. Caller holds transfer_lock.
+int parse_offsets(const char *word, size_t *offsets, FileTransfer *transfer)
+{
+    int n = 0;
+    while (n < FILE_MAX_STREAMS)
+    {
+        char *end;
+        offsets[n] = strtoull(word, &end, 10);
+        if (end == word || offsets[n] < stream_start(transfer->filesize, transfer->nstreams, n) ||
+            offsets[n] > stream_start(transfer->filesize, transfer->nstreams, n + 1))
+        {
+            return -1;
+        }
+        n++;
+        if (*end != ',')
+        {
+            break;
+        }
+        word = end + 1;
+    }
+    return n == transfer->nstreams ? n : -1;
+}
+
+// Drop a reference, the last one frees the entry
+void transfer_put(FileTransfer *transfer)
+{
+    if (transfer != NULL && atomic_fetch_sub(&transfer->refcnt, 1) == 1)
+    {
+        relay_pipe_put(transfer->pipe);
+        manifest_free(transfer->upload);
+        free(transfer->members);
+        transfer_put(transfer->group);
+        user_put(transfer->sender);
+        user_put(transfer->receiver);
+        free(transfer);
+    }
+}
+
+// Per-connection index of the transfers a user takes part in.
+// Caller holds transfer_lock for writing.
+void xfer_index_add(USR *usr, FileTransfer *transfer, int *slot)
+{
+    if (usr->nxfers == usr->xfers_cap)
+    {
+        usr->xfers_cap = usr->xfers_cap ? usr->xfers_cap * 2 : 4;
+        usr->xfers = (FileTransfer **)realloc(usr->xfers, usr->xfers_cap * sizeof(FileTransfer *));
+    }
+    *slot = usr->nxfers;
+    usr->xfers[usr->nxfers++] = transfer;
+}
+
+// Caller holds transfer_lock for writing
+void xfer_index_remove(USR *usr, int slot)
+{
+    FileTransfer *last = usr->xfers[--usr->nxfers];
+    usr->xfers[slot] = last;
+    if (last->sender == usr)
+        last->sender_slot = slot;
+    else
+        last->receiver_slot = slot;
+}
+
+// Caller holds transfer_lock, NULL for IDs never handed out or gone stale
+FileTransfer *transfer_lookup(uint64_t transfer_id)
+{
+    int slot = transfer_id & (MAX_TRANSFERS - 1);
+    if (transfer_id == 0 || transfer_id > INT_MAX || slot >= transfer_nslots)
+    {
+        return NULL;
+    }
+    FileTransfer *transfer = transfer_slots[slot].transfer;
+    if (transfer == NULL || transfer->transfer_id != (int)transfer_id)
+    {
+        return NULL;
+    }
+    return transfer;
+}
+
+void transfer_timeout(TIMER *timer);
+void multicast_ready(FileTransfer *group, int force);
+void multicast_check(FileTransfer *group);
+
+// Add a new file transfer to the table under a fresh ID, NULL if the
+// table is full. The table holds one reference, the caller gets another.
+// A multicast has no receiver of its own, receiver is NULL.
+FileTransfer *add_file_transfer(USR *sender, USR *receiver, 
+                                const char *filename, size_t filesize)
+{
+    FileTransfer *new_transfer = (FileTransfer *)malloc(sizeof(FileTransfer));
+    new_transfer->sender_sockfd = sender->clisockfd;
+    new_transfer->receiver_sockfd = receiver ? receiver->clisockfd : -1;
+    new_transfer->sender = user_get(sender);
+    new_transfer->receiver = receiver ? user_get(receiver) : NULL;
+    strcpy(new_transfer->sender_name, sender->username);
+    strcpy(new_transfer->receiver_name, receiver ? receiver->username : "*");
+    strcpy(new_transfer->filename, filename);
+    new_transfer->filesize = filesize;
+    new_transfer->active = 1;
+    new_transfer->accepted = 0;
+    new_transfer->started = 0;
+    new_transfer->ending = 0;
+    new_transfer->nstreams = 1;
+    new_transfer->acked[0] = 0;
+    new_transfer->epoch = 0;
+    new_transfer->output_name[0] = '\0';
+    new_transfer->codecs[0] = '\0';
+    new_transfer->suspended = 0;
+    new_transfer->susp_next = NULL;
+    new_transfer->pipe = NULL;
+    new_transfer->upload = NULL;
+    new_transfer->members = NULL;
+    new_transfer->nmembers = 0;
+    new_transfer->group = NULL;
+    atomic_init(&new_transfer->last_active, now_sec());
+    timer_init(&new_transfer->timer, &sender->loop->wheel, transfer_timeout);
+    atomic_init(&new_transfer->refcnt, 2);
+
+    pthread_rwlock_wrlock(&transfer_lock);
+    if (transfer_free < 0)
+    {
+        // Out of free slots, double the table
+        int n = transfer_nslots ? transfer_nslots * 2 : 64;
+        if (n > MAX_TRANSFERS)
+        {
+            pthread_rwlock_unlock(&transfer_lock);
+            atomic_init(&new_transfer->refcnt, 1);
+            transfer_put(new_transfer);
+            return NULL;
+        }
+        transfer_slots = (TRANSFER_SLOT *)realloc(transfer_slots, n * sizeof(TRANSFER_SLOT));
+        for (int i = n - 1; i >= transfer_nslots; i--)
+        {
+            transfer_slots[i].transfer = NULL;
+            transfer_slots[i].gen = 0;
+            transfer_slots[i].next_free = transfer_free;
+            transfer_free = i;
+        }
+        transfer_nslots = n;
+    }
+    int slot = transfer_free;
+    TRANSFER_SLOT *entry = &transfer_slots[slot];
+    transfer_free = entry->next_free;
+
+    // Generations run 1..32767 so IDs stay positive and never 0
+    entry->gen = entry->gen % 32767 + 1;
+    entry->transfer = new_transfer;
+    new_transfer->transfer_id = ((int)entry->gen << TRANSFER_SLOT_BITS) | slot;
+    xfer_index_add(sender, new_transfer, &new_transfer->sender_slot);
+    if (receiver != NULL)
+    {
+        xfer_index_add(receiver, new_transfer, &new_transfer->receiver_slot);
+    }
+
+    // The armed timer holds a reference of its own
+    atomic_fetch_add(&new_transfer->refcnt, 1);
+    timer_arm(&new_transfer->timer, now_sec() + TRANSFER_TIMEOUT);
+    pthread_rwlock_unlock(&transfer_lock);
+    return new_transfer;
+}
+
+// Find transfer by ID, returns a reference to release with transfer_put()
+FileTransfer *transfer_get(uint64_t transfer_id)
+{
+    pthread_rwlock_rdlock(&transfer_lock);
+    FileTransfer *cur = transfer_lookup(transfer_id);
+    if (cur != NULL)
+    {
+        atomic_fetch_add(&cur->refcnt, 1);
+    }
+    pthread_rwlock_unlock(&transfer_lock);
+    return cur;
+}
+
+// Take a transfer out of the table and both users' indexes.
+// Returns 1 if this call unlinked it. Caller holds transfer_lock for writing.
+int transfer_unlink(FileTransfer *transfer)
+{
+    if (!transfer->active)
+    {
+        return 0;
+    }
+    int slot = transfer->transfer_id & (MAX_TRANSFERS - 1);
+    transfer_slots[slot].transfer = NULL;
+    transfer_slots[slot].next_free = transfer_free;
+    transfer_free = slot;
+    if (transfer->sender != NULL)
+    {
+        xfer_index_remove(transfer->sender, transfer->sender_slot);
+    }
+    if (transfer->receiver != NULL)
+    {
+        xfer_index_remove(transfer->receiver, transfer->receiver_slot);
+    }
+    if (transfer->suspended)
+    {
+        FileTransfer **link = &suspended_transfers;
+        while (*link != transfer)
+        {
+            link = &(*link)->susp_next;
+        }
+        *link = transfer->susp_next;
+        transfer->suspended = 0;
+    }
+    transfer->active = 0;
+    // The caller still holds the table's reference, this put never frees
+    if (timer_cancel(&transfer->timer))
+    {
+        transfer_put(transfer);
+    }
+    return 1;
+}
+
+// The transfer is over, drop it from the table
+void remove_transfer(FileTransfer *transfer)
+{
+    pthread_rwlock_wrlock(&transfer_lock);
+    int unlinked = transfer_unlink(transfer);
+    pthread_rwlock_unlock(&transfer_lock);
+    if (unlinked)
+    {
+        transfer_put(transfer);
+    }
+}
+
+// Relay pipe of an accepted transfer sent by sockfd. Returns references
+// to the pipe and to the connection the receiver takes file data on, or
+// NULL if the data must not be spliced: nobody takes it yet, or the
+// chunk store is recording the upload and needs whole frames.
+RELAY_PIPE *transfer_relay_pipe(uint64_t transfer_id, int sockfd, USR **receiver)
+{
+    RELAY_PIPE *pipe = NULL;
+    pthread_rwlock_rdlock(&transfer_lock);
+    FileTransfer *transfer = transfer_lookup(transfer_id);
+    if (transfer != NULL && transfer->pipe != NULL && transfer->receiver != NULL &&
+        transfer->upload == NULL && transfer->sender_sockfd == sockfd)
+    {
+        pipe = relay_pipe_get(transfer->pipe);
+        *receiver = data_channel(transfer->receiver);
+        atomic_store(&transfer->last_active, now_sec());
+    }
+    pthread_rwlock_unlock(&transfer_lock);
+    return pipe;
+}
+
+// References to whichever ends are connected right now, NULL for the
+// others. Release them with user_put().
+void transfer_ends(FileTransfer *transfer, USR **sender, USR **receiver)
+{
+    pthread_rwlock_rdlock(&transfer_lock);
+    *sender = transfer->sender ? user_get(transfer->sender) : NULL;
+    *receiver = transfer->receiver ? user_get(transfer->receiver) : NULL;
+    pthread_rwlock_unlock(&transfer_lock);
+}
+
+// One end of a started transfer dropped. Keep the transfer for it to come
+// back, with a fresh epoch so ACKs still in flight are ignored. Returns the
+// reference the transfer held on usr. Caller holds transfer_lock for writing.
+USR *transfer_detach(FileTransfer *transfer, USR *usr)
+{
+    if (transfer->sender == usr)
+    {
+        xfer_index_remove(usr, transfer->sender_slot);
+        transfer->sender = NULL;
+        transfer->sender_sockfd = -1;
+    }
+    else
+    {
+        xfer_index_remove(usr, transfer->receiver_slot);
+        transfer->receiver = NULL;
+        transfer->receiver_sockfd = -1;
+        // Spliced bytes left for the old receiver must not reach a new one
+        relay_pipe_put(transfer->pipe);
+        transfer->pipe = NULL;
+    }
+    // A resumed upload is not offered again, stop recording it
+    manifest_free(transfer->upload);
+    transfer->upload = NULL;
+    transfer->epoch++;
+    transfer->suspended = 1;
+    transfer->susp_next = suspended_transfers;
+    suspended_transfers = transfer;
+    // Sender silence from here on counts towards TRANSFER_TIMEOUT
+    atomic_store(&transfer->last_active, now_sec());
+    return usr;
+}
+
+// Caller holds transfer_lock for writing
+void transfer_unsuspend(FileTransfer *transfer)
+{
+    FileTransfer **link = &suspended_transfers;
+    while (*link != transfer)
+    {
+        link = &(*link)->susp_next;
+    }
+    *link = transfer->susp_next;
+    transfer->suspended = 0;
+}
+
+// The sender dropped halfway through a spliced frame and the rest was
+// padded with zeros. The receiver will write them, so the frame's range
+// must not count as committed.
+void transfer_torn(uint64_t transfer_id, uint64_t offset)
+{
+    pthread_rwlock_wrlock(&transfer_lock);
+    FileTransfer *transfer = transfer_lookup(transfer_id);
+    if (transfer != NULL)
+    {
+        transfer->epoch++;
+        for (int i = 0; i < transfer->nstreams; i++)
+        {
+            if (offset >= stream_start(transfer->filesize, transfer->nstreams, i) &&
+                offset < stream_start(transfer->filesize, transfer->nstreams, i + 1) &&
+                transfer->acked[i] > offset)
+            {
+                transfer->acked[i] = offset;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&transfer_lock);
+}
+
+// A receiver joined: hand it back every suspended transfer addressed to
+// it whose sender is still in the room. It answers FILE_TRANSFER_RESUME
+// with the offset it can continue from.
+void transfer_reattach_receiver(USR *usr)
+{
+    char **offers = NULL;
+    int noffers = 0;
+
+    pthread_rwlock_wrlock(&transfer_lock);
+    FileTransfer *transfer = suspended_transfers;
+    while (transfer != NULL)
+    {
+        FileTransfer *next = transfer->susp_next;
+        if (transfer->receiver == NULL && transfer->sender != NULL &&
+            transfer->sender->room_number == usr->room_number &&
+            strcmp(transfer->receiver_name, usr->username) == 0)
+        {
+            transfer_unsuspend(transfer);
+            transfer->receiver = user_get(usr);
+            transfer->receiver_sockfd = usr->clisockfd;
+            xfer_index_add(usr, transfer, &transfer->receiver_slot);
+            transfer->pipe = relay_pipe_new();
+            offers = (char **)realloc(offers, (noffers + 1) * sizeof(char *));
+            // Two file names, more than a BUFFER_SIZE line holds
+            offers[noffers] = (char *)malloc(2 * BUFFER_SIZE);
+            char offsets[FILE_MAX_STREAMS * 21];
+            format_offsets(offsets, transfer->acked, transfer->nstreams);
+            snprintf(offers[noffers++], 2 * BUFFER_SIZE, "%s %d %s %d %s %s %zu %s",
+                     FILE_TRANSFER_RESUME, transfer->transfer_id, offsets,
+                     transfer->epoch, transfer->sender_name, transfer->filename,
+                     transfer->filesize, transfer->output_name);
+        }
+        transfer = next;
+    }
+    pthread_rwlock_unlock(&transfer_lock);
+
+    for (int i = 0; i < noffers; i++)
+    {
+        send_ctrl(usr, offers[i]);
+        free(offers[i]);
+    }
+    free(offers);
+}
+
+// A sender asked to send a file it was already sending when it dropped:
+// pick the transfer up again instead of starting over. Returns a reference
+// to the resumed transfer and its acked offsets, NULL if there was none.
+FileTransfer *transfer_reattach_sender(USR *sender, USR *receiver, const char *filename,
+                                       char *offsets)
+{
+    pthread_rwlock_wrlock(&transfer_lock);
+    FileTransfer *transfer = suspended_transfers;
+    while (transfer != NULL &&
+           !(transfer->sender == NULL && transfer->receiver == receiver &&
+             strcmp(transfer->sender_name, sender->username) == 0 &&
+             strcmp(transfer->filename, filename) == 0))
+    {
+        transfer = transfer->susp_next;
+    }
+    if (transfer != NULL)
+    {
+        transfer_unsuspend(transfer);
+        transfer->sender = user_get(sender);
+        transfer->sender_sockfd = sender->clisockfd;
+        xfer_index_add(sender, transfer, &transfer->sender_slot);
+        format_offsets(offsets, transfer->acked, transfer->nstreams);
+        atomic_fetch_add(&transfer->refcnt, 1);
+    }
+    pthread_rwlock_unlock(&transfer_lock);
+    return transfer;
+}
+
+// Tell both ends a transfer was dropped
+void notify_transfer_error(FileTransfer *transfer, const char *reason)
+{
+    USR *sender, *receiver;
+    transfer_ends(transfer, &sender, &receiver);
+    char buffer[BUFFER_SIZE];
+    sprintf(buffer, "%s %d %s", FILE_TRANSFER_ERROR, transfer->transfer_id, reason);
+    // The sender of a multicast never saw the receivers' IDs
+    if (sender != NULL && transfer->group == NULL)
+    {
+        send_data_ctrl(sender, buffer);
+    }
+    if (receiver != NULL)
+    {
+        send_data_ctrl(receiver, buffer);
+    }
+    user_put(sender);
+    user_put(receiver);
+}
+
+// Transfer timer: drop the transfer once the sender has been silent for
+// TRANSFER_TIMEOUT, otherwise check again when that could next be true.
+// A multicast checks its receivers every MULTICAST_STALL as well.
+void transfer_timeout(TIMER *timer)
+{
+    FileTransfer *transfer = (FileTransfer *)((char *)timer - offsetof(FileTransfer, timer));
+    long expires = atomic_load(&transfer->last_active) + TRANSFER_TIMEOUT;
+    if (transfer->members != NULL)
+    {
+        // Whoever answered by MULTICAST_WAIT gets the file
+        multicast_ready(transfer, 1);
+        multicast_check(transfer);
+        if (expires > now_sec() + MULTICAST_STALL)
+        {
+            expires = now_sec() + MULTICAST_STALL;
+        }
+    }
+
+    // Holding the lock keeps transfer_unlink() from racing the re-arm
+    pthread_rwlock_rdlock(&transfer_lock);
+    int rearm = transfer->active && expires > now_sec();
+    if (rearm)
+    {
+        timer_arm(timer, expires);
+    }
+    pthread_rwlock_unlock(&transfer_lock);
+    if (rearm)
+    {
+        return;
+    }
+    
+    pthread_rwlock_wrlock(&transfer_lock);
+    int unlinked = transfer_unlink(transfer);
+    pthread_rwlock_unlock(&transfer_lock);
+    if (unlinked)
+    {
+        printf("File transfer timed out: %s sending %s to %s (ID: %d)\n",
+               transfer->sender_name, transfer->filename,
+               transfer->receiver_name, transfer->transfer_id);
+        notify_transfer_error(transfer, "Transfer timeout");
+        transfer_put(transfer);
+    }
+    // The reference the timer held
+    transfer_put(transfer);
+}
+
+// Register a joined user in its room, opening the room if nobody is in
+// it, or a new one for room number -1. Returns 0 if the name is already
+// taken in the room, -1 if there is no such room.
+int add_tail(USR *new_node)
+{
+    int fd = new_node->clisockfd;
+
+    pthread_rwlock_wrlock(&lock);
+    ROOM_SLOT *slot;
+    if (new_node->room_number < 0)
+    {
+        new_node->room_number = room_number_new();
+        slot = &room_table[new_node->room_number - 1];
+        snprintf(slot->creator, sizeof(slot->creator), "%s", new_node->username);
+        slot->created_at = (long)time(NULL);
+        if (log_dir != NULL)
+            slot->log = log_new(new_node->room_number);
+        atomic_store(&snapshot_dirty, 1);
+    }
+    else if ((slot = room_entry(new_node->room_number)) == NULL)
+    {
+        pthread_rwlock_unlock(&lock);
+        return -1;
+    }
+    else if (lookup_name(new_node->username, new_node->room_number) != NULL)
+    {
+        pthread_rwlock_unlock(&lock);
+        return 0;
+    }
+    if (slot->room == NULL)
+        room_open(new_node->room_number);
+    slot->room->nusers++;
+    new_node->room = room_get(slot->room);
+
+    if (fd >= users_by_fd_size)
+    {
+        int size = users_by_fd_size ? users_by_fd_size : 1024;
+        while (size <= fd)
+            size *= 2;
+        users_by_fd = (USR **)realloc(users_by_fd, size * sizeof(USR *));
+        memset(users_by_fd + users_by_fd_size, 0, (size - users_by_fd_size) * sizeof(USR *));
+        users_by_fd_size = size;
+    }
+    users_by_fd[fd] = user_get(new_node);
+
+    unsigned int b = name_hash(new_node->username, new_node->room_number);
+    new_node->name_next = users_by_name[b];
+    users_by_name[b] = new_node;
+    pthread_rwlock_unlock(&lock);
+    return 1;
+}
+
+// One message out of the history, framed ones carry their number
+void history_deliver(USR *usr, unsigned long seq, const char *text, int len)
+{
+    MSGBUF *buf = usr->framed ? msgbuf_frame(MSG_TEXT, seq, text, len) : msgbuf_copy(text, len);
+    deliver(usr, buf, NULL);
+    msgbuf_put(buf);
+}
+
+// Map the first size bytes of a segment's file, NULL if there are none
+void *log_map(ROOM_LOG *log, unsigned long first_seq, const char *ext, size_t size)
+{
+    char path[PATH_MAX];
+    if (size == 0)
+        return NULL;
+    log_path(path, log, first_seq, ext);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+// Offset of the first record in a mapped segment whose number (by_time:
+// time) is at least key. The index gets close, a short walk does the rest.
+size_t log_seek(const char *map, size_t size, const LOG_INDEX *index, size_t nindex,
+                int64_t key, int by_time)
+{
+    size_t pos = 0, lo = 0, hi = nindex;
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        int64_t v = by_time ? index[mid].time_ms : (int64_t)index[mid].seq;
+        if (v < key && index[mid].offset < size)
+        {
+            pos = index[mid].offset;
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    while (pos + sizeof(LOG_RECORD) <= size)
+    {
+        const LOG_RECORD *rec = (const LOG_RECORD *)(map + pos);
+        if ((by_time ? rec->time_ms : (int64_t)rec->seq) >= key)
+            break;
+        pos += log_record_size(rec->len);
+    }
+    return pos < size ? pos : size;
+}
+
+// Copies of the segments from the one that holds seq on, under the lock
+LOG_SEGMENT *log_segments(ROOM_LOG *log, unsigned long seq, int64_t time_ms, int *count)
+{
+    pthread_mutex_lock(&log->lock);
+    int first = 0;
+    for (int i = 1; i < log->nsegs; i++)
+    {
+        if (time_ms >= 0 ? log->segs[i].first_ms <= time_ms : log->segs[i].first_seq <= seq)
+            first = i;
+    }
+    *count = log->nsegs - first;
+    LOG_SEGMENT *segs = (LOG_SEGMENT *)malloc((*count + 1) * sizeof(LOG_SEGMENT));
+    memcpy(segs, log->segs + first, *count * sizeof(LOG_SEGMENT));
+    pthread_mutex_unlock(&log->lock);
+    return segs;
+}
+
+// Send the logged messages after seq up to last, straight from the
+// mapped segments. Returns the last one sent.
+unsigned long log_send(ROOM *room, USR *usr, unsigned long seq, unsigned long last)
+{
+    int n;
+    LOG_SEGMENT *segs = log_segments(room->log, seq + 1, -1, &n);
+    for (int i = 0; i < n && seq < last; i++)
+    {
+        LOG_SEGMENT *seg = &segs[i];
+        char *map = (char *)log_map(room->log, seg->first_seq, "log", seg->size);
+        if (map == NULL)
+            continue;
+        LOG_INDEX *index = (LOG_INDEX *)log_map(room->log, seg->first_seq, "idx", seg->nindex * sizeof(LOG_INDEX));
+        size_t pos = log_seek(map, seg->size, index, index ? seg->nindex : 0, seq + 1, 0);
+        while (pos + sizeof(LOG_RECORD) <= seg->size)
+        {
+            const LOG_RECORD *rec = (const LOG_RECORD *)(map + pos);
+            if (rec->seq > last)
+                break;
+            history_deliver(usr, rec->seq, (const char *)(rec + 1), rec->len);
+            seq = rec->seq;
+            pos += log_record_size(rec->len);
+        }
+        munmap(map, seg->size);
+        if (index != NULL)
+            munmap(index, seg->nindex * sizeof(LOG_INDEX));
+    }
+    free(segs);
+    return seq;
+}
+
+// Number of the last logged message before time_ms
+unsigned long log_seq_before(ROOM *room, int64_t time_ms)
+{
+    int n;
+    unsigned long seq = atomic_load(&room->history_seq);
+    LOG_SEGMENT *segs = log_segments(room->log, 0, time_ms, &n);
+    for (int i = 0; i < n; i++)
+    {
+        LOG_SEGMENT *seg = &segs[i];
+        if (seg->first_ms >= time_ms)
+        {
+            seq = seg->first_seq - 1;
+            break;
+        }
+        char *map = (char *)log_map(room->log, seg->first_seq, "log", seg->size);
+        if (map == NULL)
+            continue;
+        LOG_INDEX *index = (LOG_INDEX *)log_map(room->log, seg->first_seq, "idx", seg->nindex * sizeof(LOG_INDEX));
+        size_t pos = log_seek(map, seg->size, index, index ? seg->nindex : 0, time_ms, 1);
+        int found = pos < seg->size;
+        if (found)
+            seq = ((const LOG_RECORD *)(map + pos))->seq - 1;
+        munmap(map, seg->size);
+        if (index != NULL)
+            munmap(index, seg->nindex * sizeof(LOG_INDEX));
+        if (found)
+            break;
+    }
+    free(segs);
+    return seq;
+}
+
+// Queue messages after seq up to last from the room's history to usr.
+// Says so if some of them are no longer kept. Returns the last one sent.
+unsigned long history_send(ROOM *room, USR *usr, unsigned long seq, unsigned long last)
+{
+    char text[HISTORY_TEXT_LEN];
+    if (room->log != NULL && seq < last && history_read(room, seq + 1, text) == 0)
+    {
+        // Older than the ring, or from before a restart
+        seq = log_send(room, usr, seq, last);
+    }
+    else if (last - seq > HISTORY_LEN)
+    {
+        char note[128];
+        sprintf(note, "(%lu older messages are no longer kept)\n", last - seq - HISTORY_LEN);
+        send_text(usr, note);
+        seq = last - HISTORY_LEN;
+    }
+    for (seq++; seq <= last; seq++)
+    {
+        int len = history_read(room, seq, text);
+        if (len == 0)
+            continue; // overwritten while we were at it
+        history_deliver(usr, seq, text, len);
+    }
+    return last;
+}
+
+// Put a user who just registered in its room, after the messages since
+// the given one, or the last history_replay for JOIN_RECENT. Those are
+// read without the room lock; only what arrives in the meantime is sent
+// under it, ahead of anything new.
+void join_room(USR *usr, unsigned long since)
+{
+    ROOM *room = usr->room;
+    unsigned long last = atomic_load_explicit(&room->history_seq, memory_order_acquire);
+    unsigned long seq;
+    if (since == JOIN_RECENT)
+    {
+        seq = last > (unsigned long)history_replay ? last - history_replay : 0;
+    }
+    else
+    {
+        seq = since < last ? since : last;
+        if (room->log != NULL && last - seq > HISTORY_LEN)
+        {
+            // The ring's worth, the rest is there for the asking
+            char note[128];
+            sprintf(note, "(%lu messages missed, more with CMD HISTORY SINCE %lu)\n", last - seq - HISTORY_LEN, seq);
+            send_text(usr, note);
+            seq = last - HISTORY_LEN;
+        }
+    }
+    seq = history_send(room, usr, seq, last);
+
+    pthread_mutex_lock(&room->lock);
+    history_send(room, usr, seq, atomic_load_explicit(&room->history_seq, memory_order_relaxed));
+    room_add_member(room, usr);
+    pthread_mutex_unlock(&room->lock);
+}
+
+// CMD HISTORY n sends the last n messages, CMD HISTORY SINCE seq those
+// after seq, for a client that has seen the frame carrying seq. With the
+// message log CMD HISTORY TIME t starts at unix time t, and answers go
+// back past the ring HISTORY_LEN messages at a time.
+void send_history(int clisockfd, const char *buffer)
+{
+    USR *usr = find_user_by_sockfd(clisockfd);
+    if (usr == NULL)
+    {
+        return;
+    }
+    ROOM *room = usr->room;
+    unsigned long last = atomic_load_explicit(&room->history_seq, memory_order_acquire);
+    unsigned long seq = 0;
+    long n = history_replay;
+    long when;
+    const char *args = strstr(buffer, "HISTORY") + strlen("HISTORY");
+
+    if (sscanf(args, " SINCE %lu", &seq) == 1)
+    {
+        if (seq > last)
+            seq = last;
+    }
+    else if (sscanf(args, " TIME %ld", &when) == 1)
+    {
+        if (room->log == NULL)
+        {
+            send_text(usr, "Error: History by time needs the message log\n");
+            user_put(usr);
+            return;
+        }
+        seq = log_seq_before(room, (int64_t)when * 1000);
+    }
+    else
+    {
+        sscanf(args, "%ld", &n);
+        if (n < 0)
+            n = 0;
+        seq = last > (unsigned long)n ? last - n : 0;
+        if (last - seq > HISTORY_LEN)
+            seq = last - HISTORY_LEN; // asked for more than there is
+    }
+
+    unsigned long upto = last;
+    if (room->log != NULL && last - seq > HISTORY_LEN)
+    {
+        upto = seq + HISTORY_LEN;
+    }
+    history_send(room, usr, seq, upto);
+    if (upto < last)
+    {
+        char note[128];
+        sprintf(note, "(more with CMD HISTORY SINCE %lu)\n", upto);
+        send_text(usr, note);
+    }
+    user_put(usr);
+}
+
+// A user left: cancel or suspend the transfers involving it
+void drop_transfers(USR *cur)
+{
+    // The index has exactly those. A started framed transfer waits for
+    // this end to come back; the others are cancelled and their table
+    // references move to this list. Either way the other end gets a
+    // reference here.
+    pthread_rwlock_wrlock(&transfer_lock);
+    int n = cur->nxfers;
+    FileTransfer **dropped = (FileTransfer **)malloc((n + 1) * sizeof(FileTransfer *));
+    USR **others = (USR **)malloc((n + 1) * sizeof(USR *));
+    int *resumable = (int *)malloc((n + 1) * sizeof(int));
+    char (*notes)[BUFFER_SIZE] = malloc((n + 1) * BUFFER_SIZE);
+    char offsets[FILE_MAX_STREAMS * 21];
+    for (int i = 0; i < n; i++)
+    {
+        FileTransfer *transfer = cur->xfers[0];
+        USR *other = transfer->sender == cur ? transfer->receiver : transfer->sender;
+        // Multicasts do not resume, and their sender does not hear about
+        // each receiver that leaves
+        int multicast = transfer->members != NULL || transfer->group != NULL;
+        if (transfer->group != NULL && transfer->receiver == cur)
+        {
+            other = NULL;
+        }
+        // All data went through already, nobody is left waiting for it
+        if (transfer->ending)
+        {
+            other = NULL;
+        }
+        dropped[i] = transfer;
+        others[i] = other ? user_get(other) : NULL;
+        resumable[i] = transfer->started && cur->framed && other != NULL && !multicast;
+        if (resumable[i])
+        {
+            atomic_fetch_add(&transfer->refcnt, 1);
+            user_put(transfer_detach(transfer, cur));
+            format_offsets(offsets, transfer->acked, transfer->nstreams);
+            sprintf(notes[i], "%s %d %s %d", FILE_TRANSFER_SUSPEND,
+                    transfer->transfer_id, offsets, transfer->epoch);
+        }
+        else
+        {
+            transfer_unlink(transfer);
+            sprintf(notes[i], "%s %d %s", FILE_TRANSFER_ERROR,
+                    transfer->transfer_id, "Other party disconnected\n");
+        }
+    }
+    pthread_rwlock_unlock(&transfer_lock);
+    
+    for (int i = 0; i < n; i++)
+    {
+        FileTransfer *transfer = dropped[i];
+        
+        // Tell the other party the transfer is paused or cancelled
+        if (others[i] != NULL)
+        {
+            send_data_ctrl(others[i], notes[i]);
+            user_put(others[i]);
+        }
+        if (resumable[i])
+        {
+            printf("File transfer suspended: %s dropped out of %s from %s to %s (ID: %d)\n",
+                   cur->username, transfer->filename, transfer->sender_name,
+                   transfer->receiver_name, transfer->transfer_id);
+        }
+        else if (transfer->group != NULL && transfer->receiver == cur)
+        {
+            // The rest of the room may have been waiting for this answer
+            multicast_ready(transfer->group, 0);
+        }
+        transfer_put(transfer);
+    }
+    free(dropped);
+    free(others);
+    free(resumable);
+    free(notes);
+}
+
+void remove_client(int sockfd)
+{
+    USR *cur = NULL;
+
+    pthread_rwlock_wrlock(&lock);
+    if (sockfd >= 0 && sockfd < users_by_fd_size)
+    {
+        cur = users_by_fd[sockfd];
+        users_by_fd[sockfd] = NULL;
+    }
+    if (cur != NULL)
+    {
+        ROOM *room = cur->room;
+        pthread_mutex_lock(&room->lock);
+        if (cur->room_slot >= 0)
+            room_remove_member(room, cur);
+        pthread_mutex_unlock(&room->lock);
+        if (--room->nusers == 0)
+            room_close(room);
+
+        USR **link = &users_by_name[name_hash(cur->username, cur->room_number)];
+        while (*link != cur)
+            link = &(*link)->name_next;
+        *link = cur->name_next;
+    }
+    pthread_rwlock_unlock(&lock);
+    if (cur == NULL)
+    {
+        return;
+    }
+    
+    // Frames still coming in on the data connection have to reach the
+    // receivers before they hear of the drop, so with one still up the
+    // transfers are dropped when it closes
+    pthread_rwlock_wrlock(&transfer_lock);
+    cur->closed = 1;
+    USR *data = cur->data != NULL ? user_get(cur->data) : NULL;
+    pthread_rwlock_unlock(&transfer_lock);
+    if (data != NULL)
+    {
+        shutdown(data->clisockfd, SHUT_RDWR);
+        user_put(data);
+    }
+    else
+    {
+        drop_transfers(cur);
+    }
+    user_put(cur);
+}
+
+void broadcast(int fromfd, char *message)
+{
+    USR *sender = find_user_by_sockfd(fromfd);
+    if (sender == NULL)
+    {
+        return;
+    }
+
+    // Same bytes for everybody, so format once and share the buffer.
+    // Framed members share one framed copy, built on first use, whose
+    // id is the message's number in the room's history.
+    MSGBUF *buf = msgbuf_printf("[%s] %s\n", sender->username, message);
+    MSGBUF *framed = NULL;
+
+    // Members stay registered while the room lock is held
+    ROOM *room = sender->room;
+    pthread_mutex_lock(&room->lock);
+    unsigned long seq = history_add(room, buf->data, buf->len);
+    if (room->log != NULL)
+        log_append(room, seq, buf->data, buf->len);
+    for (int i = 0; i < room->nmembers; i++)
+    {
+        USR *cur = room->members[i];
+        if (cur == sender)
+        {
+            continue;
+        }
+        if (cur->framed)
+        {
+            if (framed == NULL)
+                framed = msgbuf_frame(MSG_TEXT, seq, buf->data, buf->len);
+            deliver(cur, framed, sender);
+        }
+        else
+        {
+            deliver(cur, buf, sender);
+        }
+    }
+    pthread_mutex_unlock(&room->lock);
+    msgbuf_put(buf);
+    if (framed != NULL)
+        msgbuf_put(framed);
+    user_put(sender);
+}
+
+// Send message to a specific user
+int send_to_user(const char *username, int room_number, const char *message)
+{
+    USR *receiver = find_user_by_name(username, room_number);
+    if (receiver != NULL){
+        send_text(receiver, message);
+        user_put(receiver);
+        return 1;
+    }
+    return 0;
+}
+
+// Every receiver of a multicast answered, or MULTICAST_WAIT is up and force
+// is set: start with those who accepted, in the compression they all read.
+// Receivers still deciding are dropped, a multicast nobody took is rejected.
+void multicast_ready(FileTransfer *group, int force)
+{
+    int accepted = 0, total = 0, npending = 0;
+    FileTransfer **pending = NULL;
+    char codecs[32] = "";
+
+    pthread_rwlock_wrlock(&transfer_lock);
+    if (!group->active || group->accepted)
+    {
+        pthread_rwlock_unlock(&transfer_lock);
+        return;
+    }
+    pending = (FileTransfer **)malloc(group->nmembers * sizeof(FileTransfer *));
+    for (int i = 0; i < group->nmembers; i++)
+    {
+        FileTransfer *member = transfer_lookup(group->members[i]);
+        if (member == NULL)
+            continue;
+        total++;
+        if (member->accepted)
+        {
+            if (accepted++ == 0)
+                strcpy(codecs, member->codecs);
+            else
+                codecs_common(codecs, member->codecs);
+        }
+        else
+        {
+            pending[npending++] = member;
+        }
+    }
+    if (npending > 0 && !force)
+    {
+        pthread_rwlock_unlock(&transfer_lock);
+        free(pending);
+        return;
+    }
+    group->accepted = 1;
+    strcpy(group->codecs, codecs);
+    for (int i = 0; i < npending; i++)
+    {
+        // The table's reference is ours now
+        transfer_unlink(pending[i]);
+    }
+    USR *sender = group->sender ? user_get(group->sender) : NULL;
+    pthread_rwlock_unlock(&transfer_lock);
+
+    for (int i = 0; i < npending; i++)
+    {
+        notify_transfer_error(pending[i], "The transfer started without you");
+        transfer_put(pending[i]);
+    }
+    free(pending);
+
+    char msg[BUFFER_SIZE];
+    if (sender != NULL)
+    {
+        sprintf(msg, "%d of %d room members will receive %s\n", accepted, total, group->filename);
+        send_text(sender, msg);
+        if (accepted > 0)
+            sprintf(msg, "%s %d %s", FILE_TRANSFER_ACCEPT, group->transfer_id, codecs);
+        else
+            sprintf(msg, "%s %d", FILE_TRANSFER_REJECT, group->transfer_id);
+        send_ctrl(sender, msg);
+        user_put(sender);
+    }
+    printf("Multicast %s from %s starts with %d of %d receivers (ID: %d)\n",
+           group->filename, group->sender_name, accepted, total, group->transfer_id);
+    if (accepted == 0)
+    {
+        remove_transfer(group);
+    }
+}
+
+// A receiver of a multicast answered. Those who accept after the start
+// are told they missed it.
+void multicast_answer(FileTransfer *member, int accept, const char *codecs)
+{
+    FileTransfer *group = member->group;
+    pthread_rwlock_wrlock(&transfer_lock);
+    int late = group->accepted;
+    int unlinked = 0;
+    if (accept && !late)
+    {
+        member->accepted = 1;
+        strcpy(member->codecs, codecs);
+    }
+    else
+    {
+        unlinked = transfer_unlink(member);
+    }
+    pthread_rwlock_unlock(&transfer_lock);
+
+    if (unlinked)
+    {
+        if (accept)
+            notify_transfer_error(member, "The transfer started without you");
+        transfer_put(member);
+    }
+    multicast_ready(group, 0);
+}
+
+// Take a receiver that fell behind the others out of a multicast, once
+// even if the sender and the timer both find it behind
+void multicast_drop(FileTransfer *group, FileTransfer *member)
+{
+    pthread_rwlock_wrlock(&transfer_lock);
+    int unlinked = transfer_unlink(member);
+    pthread_rwlock_unlock(&transfer_lock);
+    if (!unlinked)
+        return;
+
+    printf("Multicast %s: %s stopped keeping up and was dropped (ID: %d)\n",
+           group->filename, member->receiver_name, member->transfer_id);
+    notify_transfer_error(member, "Stopped keeping up with the other receivers");
+    transfer_put(member);
+}
+
+// A message from the sender of a multicast, passed on to every receiver
+// that accepted under that receiver's own transfer ID. The sender goes at
+// the pace of the fastest receiver. One that falls too far behind it is
+// dropped here, multicast_check() drops one that stays behind.
+void multicast_forward(FileTransfer *group, USR *from, const char *protocol_type,
+                       const char *buffer, const char *wire, size_t wire_len)
+{
+    int is_data = strcmp(protocol_type, FILE_TRANSFER_CHUNK) == 0;
+    int is_start = strcmp(protocol_type, FILE_TRANSFER_START) == 0;
+
+    // A START also makes each receiver's transfer a started one
+    if (is_start)
+        pthread_rwlock_wrlock(&transfer_lock);
+    else
+        pthread_rwlock_rdlock(&transfer_lock);
+    int n = 0;
+    FileTransfer **members = (FileTransfer **)malloc((group->nmembers + 1) * sizeof(FileTransfer *));
+    USR **outs = (USR **)malloc((group->nmembers + 1) * sizeof(USR *));
+    for (int i = 0; i < group->nmembers; i++)
+    {
+        FileTransfer *member = transfer_lookup(group->members[i]);
+        if (member == NULL || !member->accepted || member->receiver == NULL)
+            continue;
+        if (is_start)
+        {
+            member->filesize = group->filesize;
+            member->nstreams = group->nstreams;
+            memcpy(member->acked, group->acked, sizeof(member->acked));
+            member->started = 1;
+            atomic_store(&member->last_active, now_sec());
+        }
+        atomic_fetch_add(&member->refcnt, 1);
+        members[n] = member;
+        outs[n] = data_channel(member->receiver);
+        n++;
+    }
+    pthread_rwlock_unlock(&transfer_lock);
+
+    // Data frames share one copy of the payload, only the header differs
+    FRAME_HDR hdr;
+    MSGBUF *body = NULL;
+    if (is_data)
+    {
+        frame_decode(wire, &hdr);
+        body = msgbuf_copy(wire + FRAME_HDR_LEN, wire_len - FRAME_HDR_LEN);
+    }
+    const char *rest = buffer + strlen(protocol_type);
+    rest += strspn(rest, " ");
+    rest += strspn(rest, "-0123456789");
+
+    int *counts = (int *)malloc((n + 1) * sizeof(int));
+    int emptiest = -1;
+    for (int i = 0; i < n; i++)
     {
-        if (transfer->active && (transfer->sender_sockfd == sockfd || transfer->receiver_sockfd == sockfd)){
-            
-            // Notify the other party that the transfer has been cancelled
-            int other_sockfd;
-            if (transfer->sender_sockfd == sockfd){
-                other_sockfd = transfer->receiver_sockfd;
-            } else{
-                other_sockfd = transfer->sender_sockfd;
+        MSGBUF *head;
+        if (is_data)
+        {
+            char h[FRAME_HDR_LEN];
+            frame_encode(h, MSG_DATA, hdr.flags, members[i]->transfer_id, hdr.len);
+            head = msgbuf_copy(h, sizeof(h));
+        }
+        else
+        {
+            char text[BUFFER_SIZE];
+            snprintf(text, sizeof(text), "%s %d%s", protocol_type, members[i]->transfer_id, rest);
+            head = msgbuf_for(outs[i], MSG_CTRL, text, strlen(text));
+        }
+        counts[i] = queue_member_frame(outs[i], head, body);
+        msgbuf_put(head);
+
+        if (counts[i] >= 0 && (emptiest < 0 || counts[i] < counts[emptiest]))
+        {
+            emptiest = i;
+        }
+    }
+    if (body != NULL)
+        msgbuf_put(body);
+
+    // A file cannot skip frames, so the sender only waits for the fastest
+    // receiver. The others keep up while they are within a queue of it,
+    // and are dropped once MULTICAST_LAG queues behind.
+    for (int i = 0; i < n && emptiest >= 0; i++)
+    {
+        if (counts[i] >= 0 && counts[i] < counts[emptiest] + max_queue)
+            atomic_store(&members[i]->last_active, now_sec());
+        else if (is_data && counts[i] >= counts[emptiest] + MULTICAST_LAG * max_queue)
+            multicast_drop(group, members[i]);
+    }
+    if (is_data && emptiest >= 0 && counts[emptiest] >= max_queue)
+    {
+        OUTQ *q = &outs[emptiest]->outq;
+        pthread_mutex_lock(&q->lock);
+        outq_make_room(outs[emptiest], from, SLOW_BACKPRESSURE, 1);
+        pthread_mutex_unlock(&q->lock);
+    }
+    free(counts);
+
+    // The END or an ERROR finishes every receiver's transfer as well
+    for (int i = 0; i < n; i++)
+    {
+        if (!is_data && !is_start)
+        {
+            remove_transfer(members[i]);
+        }
+        transfer_put(members[i]);
+        user_put(outs[i]);
+    }
+    free(members);
+    free(outs);
+}
+
+// Drop the receivers of a started multicast that have not kept up for
+// MULTICAST_STALL seconds and still have a full queue, so the others can
+// go on without them. Whoever the sender waits on is let go.
+void multicast_check(FileTransfer *group)
+{
+    long now = now_sec();
+    int n = 0;
+
+    pthread_rwlock_rdlock(&transfer_lock);
+    FileTransfer **stalled = (FileTransfer **)malloc((group->nmembers + 1) * sizeof(FileTransfer *));
+    USR **outs = (USR **)malloc((group->nmembers + 1) * sizeof(USR *));
+    for (int i = 0; i < group->nmembers; i++)
+    {
+        FileTransfer *member = transfer_lookup(group->members[i]);
+        if (member == NULL || !member->started || member->receiver == NULL ||
+            now - atomic_load(&member->last_active) < MULTICAST_STALL)
+            continue;
+        atomic_fetch_add(&member->refcnt, 1);
+        outs[n] = data_channel(member->receiver);
+        stalled[n++] = member;
+    }
+    pthread_rwlock_unlock(&transfer_lock);
+
+    for (int i = 0; i < n; i++)
+    {
+        FileTransfer *member = stalled[i];
+        USR *out = outs[i];
+        OUTQ *q = &out->outq;
+        pthread_mutex_lock(&q->lock);
+        int behind = q->count >= max_queue;
+        if (behind && q->nwaiters > 0)
+        {
+            outq_release_waiters(q);
+        }
+        pthread_mutex_unlock(&q->lock);
+        if (behind)
+        {
+            multicast_drop(group, member);
+        }
+        user_put(out);
+        transfer_put(member);
+    }
+    free(stalled);
+    free(outs);
+}
+
+// SEND * file: the sender uploads once and the server passes the file on
+// to every framed member of the room who accepts. Each receiver gets a
+// transfer of its own, the sender only sees the multicast's ID.
+void start_multicast(USR *sender, int tag, const char *filename)
+{
+    char msg[BUFFER_SIZE];
+    if (!sender->framed)
+    {
+        sprintf(msg, "%s %d %s", FILE_TRANSFER_ERROR, tag, "Sending to a room needs the framed protocol");
+        send_ctrl(sender, msg);
+        return;
+    }
+
+    // References to everyone else in the room who could take the file
+    ROOM *room = sender->room;
+    pthread_mutex_lock(&room->lock);
+    USR **receivers = (USR **)malloc((room->nmembers + 1) * sizeof(USR *));
+    int n = 0;
+    for (int i = 0; i < room->nmembers; i++)
+    {
+        USR *cur = room->members[i];
+        if (cur != sender && cur->framed)
+            receivers[n++] = user_get(cur);
+    }
+    pthread_mutex_unlock(&room->lock);
+
+    FileTransfer *group = n > 0 ? add_file_transfer(sender, NULL, filename, 0) : NULL;
+    if (group == NULL)
+    {
+        sprintf(msg, "%s %d %s", FILE_TRANSFER_ERROR, tag,
+                n > 0 ? "Too many transfers in progress" : "Nobody in the room can receive files");
+        send_ctrl(sender, msg);
+        for (int i = 0; i < n; i++)
+        {
+            user_put(receivers[i]);
+        }
+        free(receivers);
+        return;
+    }
+
+    // receivers[] keeps those who got a transfer, in members[] order
+    int *members = (int *)malloc(n * sizeof(int));
+    int nmembers = 0;
+    for (int i = 0; i < n; i++)
+    {
+        FileTransfer *member = add_file_transfer(sender, receivers[i], filename, 0);
+        if (member == NULL)
+        {
+            user_put(receivers[i]);
+            continue;
+        }
+        pthread_rwlock_wrlock(&transfer_lock);
+        member->group = group;
+        atomic_fetch_add(&group->refcnt, 1);
+        pthread_rwlock_unlock(&transfer_lock);
+        members[nmembers] = member->transfer_id;
+        receivers[nmembers++] = receivers[i];
+        transfer_put(member);
+    }
+    pthread_rwlock_wrlock(&transfer_lock);
+    group->members = members;
+    group->nmembers = nmembers;
+    // Answers are waited for MULTICAST_WAIT, the armed timer keeps its
+    // reference. An unlinked group's timer stays cancelled.
+    if (group->active)
+    {
+        timer_arm(&group->timer, now_sec() + MULTICAST_WAIT);
+    }
+    pthread_rwlock_unlock(&transfer_lock);
+
+    sprintf(msg, "%s %d %d", FILE_TRANSFER_ID, tag, group->transfer_id);
+    send_ctrl(sender, msg);
+    for (int i = 0; i < nmembers; i++)
+    {
+        sprintf(msg, "%s %d %s %s %d", FILE_TRANSFER_REQUEST, members[i], sender->username, filename, 0);
+        send_ctrl(receivers[i], msg);
+    }
+    printf("Multicast request: %s wants to send %s to %d members of room %d (ID: %d)\n",
+           sender->username, filename, nmembers, sender->room_number, group->transfer_id);
+
+    for (int i = 0; i < nmembers; i++)
+    {
+        user_put(receivers[i]);
+    }
+    free(receivers);
+    transfer_put(group);
+}
+
+// Handle file transfer command from client
+void handle_file_transfer_command(int sockfd, char *buffer)
+{
+    // The format is: SEND tag receiver_name filename
+    // The tag is the client's own name for the request, errors before the
+    // transfer has an ID carry it back
+    
+    char cmd[32], subcmd[32], receiver_name[50], filename[256];
+    int tag;
+    
+    // Parse the command
+    int result = sscanf(buffer, "%31s %31s %d %49s %255s", cmd, subcmd, &tag, receiver_name, filename);
+    
+    if (result != 5){
+        return;
+    }
+    
+    if (strcmp(cmd, "CMD") != 0 || strcmp(subcmd, FILE_TRANSFER_CMD) != 0){
+        return;
+    }
+    
+    // Find the sender
+    USR *sender = find_user_by_sockfd(sockfd);
+    if (sender == NULL){
+        return;
+    }
+    
+    if (strcmp(receiver_name, "*") == 0){
+        start_multicast(sender, tag, filename);
+        user_put(sender);
+        return;
+    }
+    
+    // Find the receiver in the same room
+    USR *receiver = find_user_by_name(receiver_name, sender->room_number);
+    if (receiver == NULL){
+        // Receiver not found or not in the same room
+        char error_msg[BUFFER_SIZE];
+        sprintf(error_msg, "%s %d %s", FILE_TRANSFER_ERROR, tag, "User not found or not in the same room");
+        send_ctrl(sender, error_msg);
+        user_put(sender);
+        return;
+    }
+    
+    if (receiver == sender){
+        char error_msg[BUFFER_SIZE];
+        sprintf(error_msg, "%s %d %s", FILE_TRANSFER_ERROR, tag, "Cannot send a file to yourself");
+        send_ctrl(sender, error_msg);
+        user_put(receiver);
+        user_put(sender);
+        return;
+    }
+    
+    // File data is relayed as is, so both ends must speak the same protocol
+    if (receiver->framed != sender->framed){
+        char error_msg[BUFFER_SIZE];
+        sprintf(error_msg, "%s %d %s", FILE_TRANSFER_ERROR, tag, "Receiver's client uses a different protocol version");
+        send_ctrl(sender, error_msg);
+        user_put(receiver);
+        user_put(sender);
+        return;
+    }
+    
+    // Sending what we were sending when we dropped picks up where it stopped
+    char offsets[FILE_MAX_STREAMS * 21];
+    FileTransfer *transfer = transfer_reattach_sender(sender, receiver, filename, offsets);
+    if (transfer != NULL){
+        char resume_msg[BUFFER_SIZE];
+        sprintf(resume_msg, "%s %d %d %s %zu %s", FILE_TRANSFER_RESUME, tag,
+                transfer->transfer_id, offsets, transfer->filesize, transfer->codecs);
+        send_ctrl(sender, resume_msg);
+        sprintf(resume_msg, "%s %d %s %d", FILE_TRANSFER_RESUME,
+                transfer->transfer_id, offsets, transfer->epoch);
+        send_ctrl(receiver, resume_msg);
+        printf("File transfer resumed: %s sending %s to %s from %s (ID: %d)\n",
+               sender->username, filename, receiver_name, offsets, transfer->transfer_id);
+        transfer_put(transfer);
+        user_put(receiver);
+        user_put(sender);
+        return;
+    }
+    
+    // Add to active transfers
+    transfer = add_file_transfer(sender, receiver, filename, 0);
+    if (transfer == NULL){
+        char error_msg[BUFFER_SIZE];
+        sprintf(error_msg, "%s %d %s", FILE_TRANSFER_ERROR, tag, "Too many transfers in progress");
+        send_ctrl(sender, error_msg);
+        user_put(receiver);
+        user_put(sender);
+        return;
+    }
+    int transfer_id = transfer->transfer_id;
+    transfer_put(transfer);
+    
+    // Hand the sender its transfer ID before the receiver can answer
+    char assigned[BUFFER_SIZE];
+    sprintf(assigned, "%s %d %d", FILE_TRANSFER_ID, tag, transfer_id);
+    send_ctrl(sender, assigned);
+    
+    // Send request to receiver, size will be sent later
+    char request[BUFFER_SIZE];
+    sprintf(request, "%s %d %s %s %d", FILE_TRANSFER_REQUEST, transfer_id, sender->username, filename, 0);
+    
+    send_ctrl(receiver, request);
+    
+    printf("File transfer request: %s wants to send %s to %s (ID: %d)\n", sender->username, filename, receiver_name, transfer_id);
+    user_put(receiver);
+    user_put(sender);
+}
+
+// Handle file transfer accept/reject
+void handle_file_transfer_response(int sockfd, char *buffer)
+{
+    // The format: CMD [ACCEPT/REJECT] transfer_id [codecs]
+    
+    char cmd[32], subcmd[32], codecs[32] = "";
+    int transfer_id;
+    
+    // Parse the command
+    int result = sscanf(buffer, "%31s %31s %d %31s", cmd, subcmd, &transfer_id, codecs);
+    
+    if (result < 3){
+        return;
+    }
+    
+    if (strcmp(cmd, "CMD") != 0){
+        return;
+    }
+    
+    // Find the transfer
+    FileTransfer *transfer = transfer_get(transfer_id);
+    if (transfer == NULL){
+        return;
+    }
+    
+    // Make sure this is the receiver responding
+    if (transfer->receiver_sockfd != sockfd){
+        transfer_put(transfer);
+        return;
+    }
+    
+    // One receiver of a multicast, the sender hears once all have answered
+    if (transfer->group != NULL){
+        if (strcmp(subcmd, FILE_TRANSFER_ACCEPT) == 0 || strcmp(subcmd, FILE_TRANSFER_REJECT) == 0){
+            multicast_answer(transfer, strcmp(subcmd, FILE_TRANSFER_ACCEPT) == 0, codecs);
+        }
+        transfer_put(transfer);
+        return;
+    }
+    
+    USR *sender, *receiver;
+    transfer_ends(transfer, &sender, &receiver);
+    if (sender == NULL || receiver == NULL){
+        user_put(sender);
+        user_put(receiver);
+        transfer_put(transfer);
+        return;
+    }
+    
+    if (strcmp(subcmd, FILE_TRANSFER_ACCEPT) == 0){
+        // Framed data is spliced through a pipe of its own, readers of
+        // transfer->pipe hold transfer_lock
+        RELAY_PIPE *pipe = receiver->framed ? relay_pipe_new() : NULL;
+        pthread_rwlock_wrlock(&transfer_lock);
+        transfer->accepted = 1;
+        strcpy(transfer->codecs, codecs);
+        if (transfer->pipe == NULL)
+        {
+            transfer->pipe = pipe;
+            pipe = NULL;
+        }
+        pthread_rwlock_unlock(&transfer_lock);
+        relay_pipe_put(pipe);
+
+        // Transfer accepted, notify sender to start. Data is relayed as
+        // is, the sender compresses only with what the receiver reads.
+        char accept_msg[BUFFER_SIZE];
+        sprintf(accept_msg, "%s %d %s", FILE_TRANSFER_ACCEPT, transfer_id, codecs);
+        send_ctrl(sender, accept_msg);
+        
+        printf("File transfer accepted: %s will receive %s from %s (ID: %d)\n", transfer->receiver_name, transfer->filename, transfer->sender_name, transfer_id);
+    }
+    else if (strcmp(subcmd, FILE_TRANSFER_REJECT) == 0){
+        // Transfer rejected, notify sender
+        char reject_msg[BUFFER_SIZE];
+        sprintf(reject_msg, "%s %d", FILE_TRANSFER_REJECT, transfer_id);
+        send_ctrl(sender, reject_msg);
+        
+        // Remove the transfer
+        remove_transfer(transfer);
+        
+        printf("File transfer rejected: %s declined %s from %s (ID: %d)\n", transfer->receiver_name, transfer->filename, transfer->sender_name, transfer_id);
+    }
+    user_put(sender);
+    user_put(receiver);
+    transfer_put(transfer);
+}
+
+// Receiver progress: CMD FILE_TRANSFER_ACK transfer_id offsets epoch output_file.
+// Each range is written up to its offset, a resumed transfer restarts there.
+void handle_transfer_ack(int sockfd, char *buffer)
+{
+    int transfer_id, epoch;
+    char word[FILE_MAX_STREAMS * 21], output[256];
+    if (sscanf(buffer, "%*s %*s %d %167s %d %255s", &transfer_id, word, &epoch, output) != 4)
+    {
+        return;
+    }
+
+    size_t offsets[FILE_MAX_STREAMS];
+    pthread_rwlock_wrlock(&transfer_lock);
+    FileTransfer *transfer = transfer_lookup(transfer_id);
+    if (transfer != NULL && transfer->receiver_sockfd == sockfd &&
+        transfer->epoch == epoch && parse_offsets(word, offsets, transfer) > 0)
+    {
+        for (int i = 0; i < transfer->nstreams; i++)
+        {
+            if (offsets[i] > transfer->acked[i])
+            {
+                transfer->acked[i] = offsets[i];
+            }
+        }
+        strcpy(transfer->output_name, output);
+    }
+    pthread_rwlock_unlock(&transfer_lock);
+}
+
+// A returning receiver took a resume offer:
+// CMD FILE_TRANSFER_RESUME transfer_id offsets. It may have less on disk
+// than it acknowledged, the sender restarts from the smaller of the two.
+void handle_transfer_resume(int sockfd, char *buffer)
+{
+    int transfer_id;
+    char word[FILE_MAX_STREAMS * 21];
+    if (sscanf(buffer, "%*s %*s %d %167s", &transfer_id, word) != 2)
+    {
+        return;
+    }
+
+    USR *sender = NULL;
+    size_t offsets[FILE_MAX_STREAMS];
+    char receiver_name[50];
+    pthread_rwlock_wrlock(&transfer_lock);
+    FileTransfer *transfer = transfer_lookup(transfer_id);
+    if (transfer != NULL && transfer->receiver_sockfd == sockfd && transfer->sender != NULL &&
+        parse_offsets(word, offsets, transfer) > 0)
+    {
+        for (int i = 0; i < transfer->nstreams; i++)
+        {
+            if (transfer->acked[i] > offsets[i])
+            {
+                transfer->acked[i] = offsets[i];
+            }
+        }
+        format_offsets(word, transfer->acked, transfer->nstreams);
+        sender = user_get(transfer->sender);
+        strcpy(receiver_name, transfer->receiver_name);
+    }
+    pthread_rwlock_unlock(&transfer_lock);
+
+    if (sender != NULL)
+    {
+        char msg[BUFFER_SIZE];
+        sprintf(msg, "%s %d %s", FILE_TRANSFER_RESUME, transfer_id, word);
+        send_ctrl(sender, msg);
+        printf("File transfer resumed: %s receiving again from %s (ID: %d)\n",
+               receiver_name, word, transfer_id);
+        user_put(sender);
+    }
+}
+
+// START offered a file by its manifest key. If the chunk store has every
+// chunk of it the receiver gets it from there and the sender is told
+// FILE_TRANSFER_STORED, otherwise FILE_TRANSFER_UPLOAD and the frames the
+// sender now sends are recorded. Receivers without a data connection
+// always get an upload so their chat does not wait behind a whole file.
+void store_offer(FileTransfer *transfer, USR *sender, const char *hex)
+{
+    unsigned char key[SHA256_LEN];
+    int valid = strlen(hex) == 2 * SHA256_LEN;
+    for (int i = 0; valid && i < SHA256_LEN; i++)
+    {
+        valid = sscanf(hex + 2 * i, "%2hhx", &key[i]) == 1;
+    }
+
+    STORED_FRAME *frames = NULL;
+    int count = 0;
+    USR *out = NULL;
+    pthread_rwlock_wrlock(&transfer_lock);
+    USR *receiver = transfer->receiver;
+    if (valid && store_max > 0 && receiver != NULL && receiver->data != NULL)
+    {
+        frames = store_collect(key, transfer->filesize, transfer->nstreams, &count);
+    }
+    if (frames != NULL)
+    {
+        out = data_channel(receiver);
+    }
+    else if (valid && store_max > 0 && receiver != NULL)
+    {
+        manifest_free(transfer->upload);
+        transfer->upload = manifest_new(transfer->filesize, transfer->nstreams);
+        memcpy(transfer->offer, key, SHA256_LEN);
+    }
+    pthread_rwlock_unlock(&transfer_lock);
+
+    char msg[BUFFER_SIZE];
+    if (frames != NULL)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            char wire[FRAME_HDR_LEN + sizeof(uint64_t)];
+            uint64_t offset = htobe64(frames[i].offset);
+            frame_encode(wire, MSG_DATA, frames[i].flags, transfer->transfer_id,
+                         sizeof(offset) + frames[i].body->len);
+            memcpy(wire + FRAME_HDR_LEN, &offset, sizeof(offset));
+            MSGBUF *head = msgbuf_copy(wire, sizeof(wire));
+            queue_frame(out, head, frames[i].body, NULL);
+            msgbuf_put(head);
+            msgbuf_put(frames[i].body);
+        }
+        free(frames);
+        user_put(out);
+        sprintf(msg, "%s %d", FILE_TRANSFER_STORED, transfer->transfer_id);
+        printf("File transfer served from the chunk store: %s to %s (ID: %d)\n",
+               transfer->filename, transfer->receiver_name, transfer->transfer_id);
+    }
+    else
+    {
+        sprintf(msg, "%s %d", FILE_TRANSFER_UPLOAD, transfer->transfer_id);
+    }
+    send_ctrl(sender, msg);
+}
+
+// A data frame of an upload on its way to out: keep its body in the chunk
+// store and send the stored copy on. Returns 0 if nothing is recorded.
+int store_record(FileTransfer *transfer, USR *out, USR *from, const char *wire, size_t wire_len)
+{
+    size_t head_len = FRAME_HDR_LEN + sizeof(uint64_t);
+    if (wire_len <= head_len)
+        return 0;
+    pthread_rwlock_rdlock(&transfer_lock);
+    int recording = transfer->upload != NULL;
+    pthread_rwlock_unlock(&transfer_lock);
+    if (!recording)
+        return 0;
+
+    // The server names the chunk itself, a sender cannot poison the store
+    unsigned char key[SHA256_LEN];
+    FRAME_HDR hdr;
+    frame_decode(wire, &hdr);
+    int flags = hdr.flags;
+    uint64_t offset;
+    memcpy(&offset, wire + FRAME_HDR_LEN, sizeof(offset));
+    chunk_key(flags, wire + head_len, wire_len - head_len, key);
+    MSGBUF *body = store_chunk(key, flags, wire + head_len, wire_len - head_len);
+
+    pthread_rwlock_wrlock(&transfer_lock);
+    if (transfer->upload != NULL)
+        manifest_add(transfer->upload, be64toh(offset), key);
+    pthread_rwlock_unlock(&transfer_lock);
+
+    MSGBUF *head = msgbuf_copy(wire, head_len);
+    queue_frame(out, head, body, from);
+    msgbuf_put(head);
+    msgbuf_put(body);
+    return 1;
+}
+
+// END of an upload: keep its manifest if the frames that came through are
+// the ones the sender offered
+void store_finish(FileTransfer *transfer)
+{
+    pthread_rwlock_wrlock(&transfer_lock);
+    MANIFEST *m = transfer->upload;
+    transfer->upload = NULL;
+    pthread_rwlock_unlock(&transfer_lock);
+    if (m == NULL)
+        return;
+
+    manifest_seal(m);
+    if (memcmp(m->key, transfer->offer, SHA256_LEN) == 0)
+    {
+        store_manifest(m);
+    }
+    else
+    {
+        manifest_free(m);
+    }
+}
+
+// Forward file transfer data between clients. buffer is the message as
+// the classic protocol spells it, wire the exact bytes to relay. sockfd
+// names the user, from is the connection it arrived on.
+void forward_transfer_data(int sockfd, USR *from, char *buffer, const char *wire, size_t wire_len)
+{
+    // Check if it's a file transfer protocol message
+    if (strncmp(buffer, FILE_TRANSFER_START, strlen(FILE_TRANSFER_START)) == 0 ||
+        strncmp(buffer, FILE_TRANSFER_CHUNK, strlen(FILE_TRANSFER_CHUNK)) == 0 ||
+        strncmp(buffer, FILE_TRANSFER_END, strlen(FILE_TRANSFER_END)) == 0 ||
+        strncmp(buffer, FILE_TRANSFER_ERROR, strlen(FILE_TRANSFER_ERROR)) == 0)
+    {
+        // Extract transfer ID
+        char protocol_type[30];
+        unsigned long long transfer_id = 0;
+        
+        sscanf(buffer, "%29s %llu", protocol_type, &transfer_id);
+        
+        // Find the transfer
+        FileTransfer *transfer = transfer_get(transfer_id);
+        if (transfer == NULL)
+        {
+            return;
+        }
+        
+        USR *sender, *receiver;
+        transfer_ends(transfer, &sender, &receiver);
+        
+        // Make sure this is the sender sending the data
+        if (transfer->sender_sockfd == sockfd)
+        {
+            // A START makes the transfer resumable and tells us its size
+            // and how many ranges it is sent in, and may offer the file to
+            // the chunk store
+            size_t filesize;
+            int nstreams = 1;
+            char offer[2 * SHA256_LEN + 2] = "";
+            if (strcmp(protocol_type, FILE_TRANSFER_START) == 0 &&
+                sscanf(buffer, "%*s %*d %*s %zu %d %65s", &filesize, &nstreams, offer) >= 1)
+            {
+                if (nstreams < 1 || nstreams > FILE_MAX_STREAMS)
+                {
+                    nstreams = 1;
+                }
+                pthread_rwlock_wrlock(&transfer_lock);
+                transfer->filesize = filesize;
+                transfer->nstreams = nstreams;
+                for (int i = 0; i < nstreams; i++)
+                {
+                    transfer->acked[i] = stream_start(filesize, nstreams, i);
+                }
+                transfer->started = 1;
+                pthread_rwlock_unlock(&transfer_lock);
             }
             
-            char buffer[BUFFER_SIZE];
-            sprintf(buffer, "%s %d %s", FILE_TRANSFER_ERROR, 
-                    transfer->transfer_id, "Other party disconnected\n");
-            
-            // Only send if we can find the user (they might have disconnected too)
-            USR *other_user = find_user_by_sockfd(other_sockfd);
-            if (other_user != NULL){
-                send(other_sockfd, buffer, strlen(buffer), 0);
+            // A framed receiver checks the file against END's digest and
+            // answers, so the sender hears if it does not match
+            int verdict = strcmp(protocol_type, FILE_TRANSFER_END) == 0 && receiver != NULL &&
+                          receiver->framed && transfer->members == NULL && transfer->group == NULL;
+            if (verdict)
+            {
+                pthread_rwlock_wrlock(&transfer_lock);
+                transfer->ending = 1;
+                pthread_rwlock_unlock(&transfer_lock);
+            }
+
+            // Forward to receiver, file data is never dropped and a slow
+            // receiver holds the sender back. With the receiver away the
+            // data is dropped, the resume sends it again.
+            atomic_store(&transfer->last_active, now_sec());
+            if (receiver != NULL)
+            {
+                pthread_rwlock_rdlock(&transfer_lock);
+                USR *out = data_channel(receiver);
+                pthread_rwlock_unlock(&transfer_lock);
+                if (strcmp(protocol_type, FILE_TRANSFER_CHUNK) != 0 ||
+                    !store_record(transfer, out, from, wire, wire_len))
+                {
+                    MSGBUF *buf = msgbuf_copy(wire, wire_len);
+                    queue_message(out, buf, from, SLOW_BACKPRESSURE, 1);
+                    msgbuf_put(buf);
+                }
+                user_put(out);
+            }
+            if (transfer->members != NULL)
+            {
+                multicast_forward(transfer, from, protocol_type, buffer, wire, wire_len);
+            }
+            if (offer[0] != '\0' && sender != NULL)
+            {
+                store_offer(transfer, sender, offer);
             }
             
-            transfer->active = 0;
+            // If this is the end message, the transfer is over unless the
+            // receiver has yet to check it
+            if (strcmp(protocol_type, FILE_TRANSFER_END) == 0)
+            {
+                store_finish(transfer);
+                if (!verdict)
+                {
+                    remove_transfer(transfer);
+                    printf("File transfer completed: %s sent %s to %s (ID: %d)\n", 
+                           transfer->sender_name, transfer->filename, 
+                           transfer->receiver_name, transfer->transfer_id);
+                }
+            }
+            else if (strcmp(protocol_type, FILE_TRANSFER_ERROR) == 0)
+            {
+                remove_transfer(transfer);
+            }
+        }
+        // Or the receiver's file matching the digest
+        else if (transfer->receiver_sockfd == sockfd &&
+                 strcmp(protocol_type, FILE_TRANSFER_END) == 0)
+        {
+            pthread_rwlock_rdlock(&transfer_lock);
+            int ending = transfer->ending;
+            pthread_rwlock_unlock(&transfer_lock);
+            if (ending)
+            {
+                remove_transfer(transfer);
+                printf("File transfer completed: %s sent %s to %s (ID: %d)\n", 
+                       transfer->sender_name, transfer->filename, 
+                       transfer->receiver_name, transfer->transfer_id);
+            }
+        }
+        // Or the receiver sending an error
+        else if (transfer->receiver_sockfd == sockfd && 
+                 strcmp(protocol_type, FILE_TRANSFER_ERROR) == 0)
+        {
+            // Forward error to sender, a multicast goes on without this one
+            if (sender != NULL && transfer->group == NULL)
+            {
+                send_ctrl(sender, buffer);
+            }
+            remove_transfer(transfer);
+        }
+        user_put(sender);
+        user_put(receiver);
+        transfer_put(transfer);
+        return;
+    }
+}
+
+// CMD ROOM: what is known about the room the user is in
+void send_room_info(USR *usr)
+{
+    ROOM *room = usr->room;
+    pthread_rwlock_rdlock(&lock);
+    ROOM_SLOT slot = room_table[room->number - 1];
+    int nrooms = nactive_rooms;
+    pthread_rwlock_unlock(&lock);
+
+    pthread_mutex_lock(&room->lock);
+    int members = room->nmembers;
+    pthread_mutex_unlock(&room->lock);
+
+    char created[64];
+    time_t when = (time_t)slot.created_at;
+    struct tm tm;
+    strftime(created, sizeof(created), "%Y-%m-%d %H:%M:%S", localtime_r(&when, &tm));
+    char msg[256];
+    snprintf(msg, sizeof(msg), "Room %d: created by %s at %s, %d people, %lu messages (%d rooms open)\n",
+             room->number, slot.creator[0] ? slot.creator : "?", created, members,
+             atomic_load(&room->history_seq), nrooms);
+    send_text(usr, msg);
+}
+
+// Outbound queue metrics for the asking client and the whole server
+void send_stats(int clisockfd)
+{
+    USR *usr = find_user_by_sockfd(clisockfd);
+    if (usr == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&usr->outq.lock);
+    int depth = usr->outq.count;
+    int high_water = usr->outq.high_water;
+    unsigned long dropped = usr->outq.dropped;
+    pthread_mutex_unlock(&usr->outq.lock);
+
+    char msg[BUFFER_SIZE];
+    snprintf(msg, sizeof(msg),
+             "Server stats: queued=%ld dropped=%ld slow_disconnects=%ld producer_pauses=%ld\n"
+             "Your queue: depth=%d high_water=%d limit=%d dropped=%lu\n",
+             atomic_load(&stat_queued), atomic_load(&stat_dropped),
+             atomic_load(&stat_disconnected), atomic_load(&stat_paused),
+             depth, high_water, max_queue, dropped);
+    if (store_max > 0)
+    {
+        pthread_mutex_lock(&store_lock);
+        snprintf(msg + strlen(msg), sizeof(msg) - strlen(msg),
+                 "Chunk store: files=%d chunks=%d bytes=%zu limit=%zu\n",
+                 store_files, store_chunks, store_bytes, store_max);
+        pthread_mutex_unlock(&store_lock);
+    }
+    if (log_dir != NULL)
+    {
+        snprintf(msg + strlen(msg), sizeof(msg) - strlen(msg),
+                 "Message log: bytes=%ld commits=%ld\n",
+                 atomic_load(&stat_log_bytes), atomic_load(&stat_log_commits));
+    }
+    send_text(usr, msg);
+    user_put(usr);
+}
+
+// Commands and file transfer control, returns 0 if buffer is neither.
+// wire is what gets relayed for file transfer messages.
+int handle_control(USR *usr, char *buffer, const char *wire, size_t wire_len)
+{
+    int clisockfd = usr->clisockfd;
+
+    // Check if it's a command or file transfer data
+    if (strncmp(buffer, "CMD", 3) == 0)
+    {
+        // Receiver progress and resume answers carry file names that
+        // could contain any of the words below
+        if (strncmp(buffer + 4, FILE_TRANSFER_ACK, strlen(FILE_TRANSFER_ACK)) == 0)
+        {
+            handle_transfer_ack(clisockfd, buffer);
+        }
+        else if (strncmp(buffer + 4, FILE_TRANSFER_RESUME, strlen(FILE_TRANSFER_RESUME)) == 0)
+        {
+            handle_transfer_resume(clisockfd, buffer);
+        }
+        // Check if it's a file transfer command
+        else if (strstr(buffer, FILE_TRANSFER_CMD) != NULL)
+        {
+            handle_file_transfer_command(clisockfd, buffer);
+        }
+        // Check if it's a file transfer response
+        else if (strstr(buffer, FILE_TRANSFER_ACCEPT) != NULL ||
+                 strstr(buffer, FILE_TRANSFER_REJECT) != NULL)
+        {
+            handle_file_transfer_response(clisockfd, buffer);
+        }
+        else if (strstr(buffer, "STATS") != NULL)
+        {
+            send_stats(clisockfd);
+        }
+        else if (strstr(buffer, "HISTORY") != NULL)
+        {
+            send_history(clisockfd, buffer);
+        }
+        else if (strstr(buffer, "ROOM") != NULL)
+        {
+            send_room_info(usr);
+        }
+        return 1;
+    }
+    // Check if it's file transfer data
+    else if (strncmp(buffer, FILE_TRANSFER_START, strlen(FILE_TRANSFER_START)) == 0 ||
+             strncmp(buffer, FILE_TRANSFER_CHUNK, strlen(FILE_TRANSFER_CHUNK)) == 0 ||
+             strncmp(buffer, FILE_TRANSFER_END, strlen(FILE_TRANSFER_END)) == 0 ||
+             strncmp(buffer, FILE_TRANSFER_ERROR, strlen(FILE_TRANSFER_ERROR)) == 0)
+    {
+        forward_transfer_data(clisockfd, usr, buffer, wire, wire_len);
+        return 1;
+    }
+    return 0;
+}
+
+// Dispatch one classic chat-state read, same classification the blocking loop used
+void handle_client_message(USR *usr, char *buffer, int nrcv)
+{
+    buffer[nrcv] = '\0';
+
+    // Regular chat message
+    if (!handle_control(usr, buffer, buffer, nrcv))
+    {
+        buffer[strcspn(buffer, "\n")] = '\0';
+        broadcast(usr->clisockfd, buffer);
+    }
+}
+
+int room_count_cmp(const void *a, const void *b)
+{
+    return ((const int *)a)[0] - ((const int *)b)[0];
+}
+
+// Answer the room list request (room number -2). Only open rooms are
+// looked at, a room is open while somebody is in it.
+void send_room_counts(USR *usr)
+{
+    pthread_rwlock_rdlock(&lock);
+    int n = nactive_rooms;
+    int (*counts)[2] = malloc((n + 1) * sizeof(*counts));
+    for (int i = 0; i < n; i++)
+    {
+        ROOM *room = active_rooms[i];
+        pthread_mutex_lock(&room->lock);
+        counts[i][0] = room->number;
+        counts[i][1] = room->nmembers;
+        pthread_mutex_unlock(&room->lock);
+    }
+    pthread_rwlock_unlock(&lock);
+    qsort(counts, n, sizeof(*counts), room_count_cmp);
+
+    size_t cap = 64 + (size_t)n * 40, len = 0;
+    char *list_msg = (char *)malloc(cap);
+    len += sprintf(list_msg, "Available chat rooms:\n");
+    int any = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (counts[i][1] > 0)
+        {
+            len += sprintf(list_msg + len, "Room %d: %d people\n", counts[i][0], counts[i][1]);
+            any = 1;
+        }
+    }
+    if (!any)
+    {
+        strcpy(list_msg, "No rooms available. Type 'new' to create one.\n");
+    }
+    send_text(usr, list_msg);
+    free(list_msg);
+    free(counts);
+}
+
+// The room number arrived, returns 0 if the connection should be closed.
+// A new room (-1) gets its number when the user is registered.
+int handle_room_number(USR *usr)
+{
+    if (usr->room_number == -2)
+    {
+        send_room_counts(usr);
+        return 0;
+    }
+
+    if (usr->room_number >= 0)
+    {
+        pthread_rwlock_rdlock(&lock);
+        int exists = room_entry(usr->room_number) != NULL;
+        pthread_rwlock_unlock(&lock);
+        if (!exists)
+        {
+            char err[] = "Error: Room does not exist\n";
+            send_text(usr, err);
+            return 0;
+        }
+    }
+
+    usr->state = CONN_NAME;
+    return 1;
+}
+
+// Hand a framed user the token its data connection attaches with
+void issue_data_token(USR *usr)
+{
+    unsigned char rnd[16];
+    if (getrandom(rnd, sizeof(rnd), 0) != sizeof(rnd))
+    {
+        return; // file data keeps sharing the chat connection
+    }
+    char token[DATA_TOKEN_LEN + 1];
+    int n = sprintf(token, "%08x", usr->clisockfd);
+    for (int i = 0; i < (int)sizeof(rnd); i++)
+    {
+        n += sprintf(token + n, "%02x", rnd[i]);
+    }
+
+    pthread_rwlock_wrlock(&transfer_lock);
+    strcpy(usr->token, token);
+    pthread_rwlock_unlock(&transfer_lock);
+
+    char msg[BUFFER_SIZE];
+    sprintf(msg, "%s %s", DATA_TOKEN, token);
+    send_ctrl(usr, msg);
+}
+
+// Give a framed user who joined a session to come back with
+void issue_session(USR *usr)
+{
+    unsigned char rnd[SESSION_TOKEN_LEN / 2];
+    if (getrandom(rnd, sizeof(rnd), 0) != sizeof(rnd))
+    {
+        return; // a lost connection means joining again
+    }
+    char token[SESSION_TOKEN_LEN + 1], key[SESSION_KEY_LEN + 1];
+    for (int i = 0; i < (int)sizeof(rnd); i++)
+    {
+        sprintf(token + 2 * i, "%02x", rnd[i]);
+    }
+    session_key(key, token);
+
+    // The session keeps its room number from going to another room
+    pthread_rwlock_wrlock(&lock);
+    room_table[usr->room_number - 1].sessions++;
+    pthread_mutex_lock(&session_lock);
+    SESSION *session = session_add(key, usr->username, usr->room_number, 0);
+    session->sockfd = usr->clisockfd;
+    pthread_mutex_unlock(&session_lock);
+    pthread_rwlock_unlock(&lock);
+    strcpy(usr->session, key);
+    atomic_store(&snapshot_dirty, 1);
+
+    char msg[BUFFER_SIZE];
+    sprintf(msg, "%s %s", SESSION_TOKEN, token);
+    send_ctrl(usr, msg);
+}
+
+// Unlink expired sessions in one bucket and let go of their rooms.
+// Caller holds lock for writing and session_lock.
+void session_expire(SESSION **link, long now)
+{
+    while (*link != NULL)
+    {
+        SESSION *cur = *link;
+        if (cur->expires != 0 && cur->expires <= now)
+        {
+            *link = cur->next;
+            room_table[cur->room_number - 1].sessions--;
+            room_number_release(cur->room_number);
+            free(cur);
+            nsessions--;
+            continue;
+        }
+        link = &cur->next;
+    }
+}
+
+// Caller holds lock for writing
+void session_sweep(long now)
+{
+    pthread_mutex_lock(&session_lock);
+    for (int i = 0; i < SESSION_BUCKETS; i++)
+    {
+        session_expire(&sessions[i], now);
+    }
+    pthread_mutex_unlock(&session_lock);
+}
+
+// The connection holding a session is gone, the session waits SESSION_TTL
+// for it to come back. Expired sessions are dropped on the way.
+void session_release(USR *usr)
+{
+    long now = (long)time(NULL);
+    pthread_rwlock_wrlock(&lock);
+    pthread_mutex_lock(&session_lock);
+    SESSION *session = session_find(usr->session);
+    if (session != NULL && session->expires == 0 && session->sockfd == usr->clisockfd)
+        session->expires = now + SESSION_TTL;
+    session_expire(&sessions[session_hash(usr->session)], now);
+    pthread_mutex_unlock(&session_lock);
+    pthread_rwlock_unlock(&lock);
+    atomic_store(&snapshot_dirty, 1);
+}
+
+// Compare secrets in time that does not depend on where they differ
+int token_equal(const char *a, const char *b, size_t len)
+{
+    unsigned char diff = 0;
+    for (size_t i = 0; i < len; i++)
+        diff |= (unsigned char)a[i] ^ (unsigned char)b[i];
+    return diff == 0;
+}
+
+// MSG_ATTACH: the connection carries file data for the user whose token
+// it presents. Returns 0 if the token is no good.
+int attach_data(USR *usr, const char *payload, uint32_t len)
+{
+    char token[DATA_TOKEN_LEN + 1];
+    unsigned int fd;
+    if (len != DATA_TOKEN_LEN)
+    {
+        return 0;
+    }
+    memcpy(token, payload, len);
+    token[len] = '\0';
+    if (sscanf(token, "%8x", &fd) != 1)
+    {
+        return 0;
+    }
+
+    USR *owner = find_user_by_sockfd((int)fd);
+    if (owner == NULL)
+    {
+        return 0;
+    }
+
+    // A token lets one connection in
+    pthread_rwlock_wrlock(&transfer_lock);
+    int ok = owner->token[0] != '\0' && token_equal(owner->token, token, DATA_TOKEN_LEN) &&
+             owner->data == NULL && !owner->closed;
+    if (ok)
+    {
+        owner->token[0] = '\0';
+        owner->data = user_get(usr);
+        usr->owner = owner;
+    }
+    pthread_rwlock_unlock(&transfer_lock);
+    if (!ok)
+    {
+        user_put(owner);
+        return 0;
+    }
+
+    usr->state = CONN_DATA;
+    strcpy(usr->username, owner->username);
+    usr->room_number = owner->room_number;
+    // The user's idle timer covers this connection too
+    timer_cancel(&usr->idle_timer);
+
+    MSGBUF *ack = msgbuf_frame(MSG_ATTACH, 0, "", 0);
+    deliver(usr, ack, NULL);
+    msgbuf_put(ack);
+    printf("%s attached a data connection\n", usr->username);
+    return 1;
+}
+
+// The username arrived, returns 0 if the connection should be closed.
+// The replay starts after message since, or is the usual JOIN_RECENT.
+int handle_username(USR *usr, char *uname, int n, unsigned long since)
+{
+    uname[n] = '\0';
+    strcpy(usr->username, uname);
+
+    // Check if username already exists in the room
+    int added = add_tail(usr);
+    if (added <= 0)
+    {
+        send_text(usr, added < 0 ? "Error: Room does not exist\n" : "Error: Username already exists in this room\n");
+        return 0;
+    }
+    usr->state = CONN_CHAT;
+
+    // Joined, the handshake deadline gives way to the idle timeout
+    if (idle_timeout > 0)
+        timer_arm(&usr->idle_timer, usr->last_active + idle_timeout);
+    else
+        timer_cancel(&usr->idle_timer);
+
+    char msg[128];
+    sprintf(msg, "Connected to %s with room number %d\n", usr->addr, usr->room_number);
+    send_text(usr, msg);
+
+    // File data gets a connection of its own, so chat never waits behind it
+    if (usr->framed)
+        issue_data_token(usr);
+    // and files may be offered to the chunk store before they are sent
+    if (usr->framed && store_max > 0)
+        send_ctrl(usr, CHUNK_STORE);
+    // and a lost connection can come back to where it was
+    if (usr->framed && usr->session[0] == '\0')
+        issue_session(usr);
+
+    // What was said before, then whatever comes next
+    join_room(usr, since);
+
+    char join_msg[256];
+    sprintf(join_msg, "%s (%s) joined the chat room!\n", uname, usr->addr);
+    broadcast(-1, join_msg);
+    printf("%s", join_msg);
+
+    // Transfers to this name that were cut off carry on
+    if (usr->framed)
+        transfer_reattach_receiver(usr);
+    return 1;
+}
+
+// Payload of a text frame as a C string, cut to the classic message size
+void frame_text(char *text, const char *payload, uint32_t len)
+{
+    if (len > BUFFER_SIZE - 1)
+        len = BUFFER_SIZE - 1;
+    memcpy(text, payload, len);
+    text[len] = '\0';
+}
+
+// MSG_RESUME: back into the session's room under its name, with the
+// messages after the last one the client saw. Returns 0 to close.
+int resume_session(USR *usr, const char *payload, uint32_t len)
+{
+    char text[BUFFER_SIZE], token[SESSION_TOKEN_LEN + 1], key[SESSION_KEY_LEN + 1];
+    unsigned long since = JOIN_RECENT;
+    frame_text(text, payload, len);
+    if (sscanf(text, "%32s %lu", token, &since) < 1)
+    {
+        return 0;
+    }
+
+    session_key(key, token);
+    pthread_mutex_lock(&session_lock);
+    SESSION *session = session_find(key);
+    int holder = -1;
+    if (session != NULL && session->expires != 0 && session->expires <= (long)time(NULL))
+    {
+        session = NULL;
+    }
+    else if (session != NULL && session->expires == 0)
+    {
+        holder = session->sockfd;
+    }
+    else if (session != NULL)
+    {
+        session->expires = 0;
+        session->sockfd = usr->clisockfd;
+        usr->room_number = session->room_number;
+        strcpy(text, session->username);
+    }
+    pthread_mutex_unlock(&session_lock);
+
+    if (session == NULL)
+    {
+        send_text(usr, "Error: Session expired\n");
+        return 0;
+    }
+    if (holder >= 0)
+    {
+        // Most likely the old connection is dead and nobody noticed yet.
+        // End it; the client tries again once it is gone.
+        USR *old = find_user_by_sockfd(holder);
+        if (old != NULL)
+        {
+            if (strcmp(old->session, key) == 0)
+                shutdown(holder, SHUT_RDWR);
+            user_put(old);
+        }
+        send_text(usr, "Error: Session is still connected\n");
+        return 0;
+    }
+
+    strcpy(usr->session, key);
+    usr->state = CONN_NAME;
+    return handle_username(usr, text, strlen(text), since);
+}
+
+// One complete frame from a framed client, returns 0 to close the connection
+int handle_frame(USR *usr, FRAME_HDR *hdr, const char *payload, const char *wire)
+{
+    char text[BUFFER_SIZE];
+
+    if (usr->state == CONN_JOIN)
+    {
+        if (hdr->type == MSG_LIST)
+        {
+            send_room_counts(usr);
+            return 1;
+        }
+        if (hdr->type == MSG_ATTACH)
+            return attach_data(usr, payload, hdr->len);
+        if (hdr->type == MSG_RESUME)
+            return resume_session(usr, payload, hdr->len);
+        if (hdr->type != MSG_JOIN || hdr->len < sizeof(int32_t) + 1)
+            return 0;
+
+        int32_t room_number;
+        memcpy(&room_number, payload, sizeof(room_number));
+        usr->room_number = (int32_t)ntohl(room_number);
+
+        int n = hdr->len - sizeof(int32_t);
+        if (n > (int)sizeof(usr->username) - 1)
+            n = sizeof(usr->username) - 1;
+        memcpy(text, payload + sizeof(int32_t), n);
+
+        // The list is its own request in the framed protocol
+        if (usr->room_number == -2 || !handle_room_number(usr))
+            return 0;
+        return handle_username(usr, text, n, JOIN_RECENT);
+    }
+
+    // A data connection only carries what goes on to receivers, in the
+    // name of its user
+    if (usr->state == CONN_DATA)
+    {
+        if (hdr->type == MSG_CTRL)
+            frame_text(text, payload, hdr->len);
+        else if (hdr->type == MSG_DATA)
+            snprintf(text, sizeof(text), "%s %llu", FILE_TRANSFER_CHUNK, (unsigned long long)hdr->id);
+        else
+            return 1;
+        forward_transfer_data(usr->owner->clisockfd, usr, text, wire, FRAME_HDR_LEN + hdr->len);
+        return 1;
+    }
+
+    switch (hdr->type)
+    {
+    case MSG_TEXT:
+        frame_text(text, payload, hdr->len);
+        text[strcspn(text, "\n")] = '\0';
+        broadcast(usr->clisockfd, text);
+        break;
+    case MSG_CTRL:
+        frame_text(text, payload, hdr->len);
+        handle_control(usr, text, wire, FRAME_HDR_LEN + hdr->len);
+        break;
+    case MSG_DATA:
+        // Relayed untouched, the text form is only used to find the transfer
+        snprintf(text, sizeof(text), "%s %llu", FILE_TRANSFER_CHUNK, (unsigned long long)hdr->id);
+        forward_transfer_data(usr->clisockfd, usr, text, wire, FRAME_HDR_LEN + hdr->len);
+        break;
+    default:
+        break;
+    }
+
+    return 1;
+}
+
+// Make room for at least need bytes of buffered input
+void inbuf_reserve(USR *usr, size_t need)
+{
+    if (usr->incap >= need)
+        return;
+    size_t cap = usr->incap ? usr->incap : 4096;
+    while (cap < need)
+        cap *= 2;
+    usr->inbuf = (char *)realloc(usr->inbuf, cap);
+    usr->incap = cap;
+}
+
+// A file frame whose payload is still in the socket: pass on the header
+// and what was already read, the rest is spliced. Returns bytes consumed.
+size_t start_relay(USR *usr, FRAME_HDR *hdr, const char *wire, size_t have)
+{
+    // The file offset has to be known in case the frame gets torn
+    if (have < FRAME_HDR_LEN + sizeof(uint64_t))
+        return 0;
+
+    USR *receiver;
+    int sockfd = usr->owner != NULL ? usr->owner->clisockfd : usr->clisockfd;
+    RELAY_PIPE *pipe = transfer_relay_pipe(hdr->id, sockfd, &receiver);
+    if (pipe == NULL)
+        return 0;
+
+    MSGBUF *buf = msgbuf_copy(wire, have);
+    queue_message(receiver, buf, usr, SLOW_BACKPRESSURE, 1);
+    msgbuf_put(buf);
+
+    uint64_t offset;
+    memcpy(&offset, wire + FRAME_HDR_LEN, sizeof(offset));
+    usr->relay_id = hdr->id;
+    usr->relay_offset = be64toh(offset);
+    usr->relay = pipe;
+    usr->relay_to = receiver;
+    usr->relay_left = FRAME_HDR_LEN + hdr->len - have;
+    usr->relay_hint = 1;
+    return have;
+}
+
+// Splice would block: either the socket is drained or the pipe is full.
+// A full pipe pauses the sender until the receiver's queue drains.
+void relay_wait(USR *usr)
+{
+    int pending = 0;
+    ioctl(usr->clisockfd, FIONREAD, &pending);
+    if (pending == 0)
+        return; // the next EPOLLIN edge brings us back
+
+    OUTQ *q = &usr->relay_to->outq;
+    pthread_mutex_lock(&q->lock);
+    // Nothing queued means the pipe was emptied meanwhile, retry then
+    if (q->count > 0 && !q->dead)
+        outq_add_waiter(q, usr);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Move the rest of a relayed payload socket -> pipe -> receiver.
+// Returns 1 when the frame is done, 0 on EOF or error, -1 to wait.
+int relay_input(USR *usr)
+{
+    USR *receiver = usr->relay_to;
+
+    while (usr->relay_left > 0)
+    {
+        ssize_t n;
+        int dead = outq_dead(&receiver->outq);
+        if (dead)
+        {
+            // Receiver is gone, read the frame off the socket and drop it
+            char scratch[4096];
+            size_t want = usr->relay_left < sizeof(scratch) ? usr->relay_left : sizeof(scratch);
+            n = recv(usr->clisockfd, scratch, want, 0);
+        }
+        else
+        {
+            n = splice(usr->clisockfd, NULL, usr->relay->fds[1], NULL, usr->relay_left,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        }
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            if (!dead)
+                relay_wait(usr);
+            if (atomic_load(&usr->paused) > 0)
+                return -1;
+            int pending = 0;
+            ioctl(usr->clisockfd, FIONREAD, &pending);
+            if (pending == 0)
+                return -1;
+            continue;
         }
-        transfer = transfer->next;
+        if (n <= 0)
+            return 0;
+
+        usr->relay_left -= n;
+        if (!dead)
+            queue_pipe(receiver, usr->relay, n);
     }
-    pthread_mutex_unlock(&transfer_lock);
+
+    relay_pipe_put(usr->relay);
+    user_put(usr->relay_to);
+    usr->relay = NULL;
+    usr->relay_to = NULL;
+    return 1;
 }
 
-void broadcast(int fromfd, char *message)
+// Streaming decoder: run every complete frame in inbuf, keep the partial
+// tail for the next read. Returns 0 to close the connection.
+int decode_frames(USR *usr)
 {
-    USR *sender = NULL;
-    USR *cur;
+    size_t pos = 0;
+    int alive = 1;
 
-    pthread_mutex_lock(&lock);
-    cur = head;
-    while (cur != NULL)
+    while (usr->inlen - pos >= FRAME_HDR_LEN && atomic_load(&usr->paused) == 0)
     {
-        if (cur->clisockfd == fromfd)
+        FRAME_HDR hdr;
+        frame_decode(usr->inbuf + pos, &hdr);
+        if (hdr.len > FRAME_MAX_PAYLOAD)
         {
-            sender = cur;
+            alive = 0;
             break;
         }
-        cur = cur->next;
+        if (usr->inlen - pos < FRAME_HDR_LEN + hdr.len)
+        {
+            if (hdr.type == MSG_DATA && (usr->state == CONN_CHAT || usr->state == CONN_DATA))
+                pos += start_relay(usr, &hdr, usr->inbuf + pos, usr->inlen - pos);
+            break;
+        }
+
+        alive = handle_frame(usr, &hdr, usr->inbuf + pos + FRAME_HDR_LEN, usr->inbuf + pos);
+        pos += FRAME_HDR_LEN + hdr.len;
+        usr->relay_hint = (hdr.type == MSG_DATA);
+        if (!alive)
+            break;
     }
 
-    if (sender != NULL)
+    if (pos > 0)
+    {
+        memmove(usr->inbuf, usr->inbuf + pos, usr->inlen - pos);
+        usr->inlen -= pos;
+    }
+
+    // Grow for a frame larger than what is buffered so far
+    if (alive && usr->inlen >= FRAME_HDR_LEN)
     {
-        cur = head;
-        while (cur != NULL)
+        FRAME_HDR hdr;
+        frame_decode(usr->inbuf, &hdr);
+        inbuf_reserve(usr, FRAME_HDR_LEN + hdr.len);
+    }
+    return alive;
+}
+
+// Framed connections read into inbuf and decode whatever is complete
+int handle_framed_input(USR *usr)
+{
+    size_t budget = READ_BUDGET;
+
+    while (1)
+    {
+        // Backpressure: frames wait in inbuf, more data waits in the socket
+        if (atomic_load(&usr->paused) > 0)
+            return 1;
+
+        // A sender faster than we relay must not starve the rest of the
+        // loop, hangups of its receivers included. Come back to it later.
+        if (budget == 0)
         {
-            if (cur->clisockfd != fromfd && cur->room_number == sender->room_number)
-            {
-                char buffer[BUFFER_SIZE];
-                sprintf(buffer, "[%s] %s\n", sender->username, message);
-                send(cur->clisockfd, buffer, strlen(buffer), 0);
-            }
-            cur = cur->next;
+            rearm_input(usr);
+            return 1;
+        }
+
+        if (usr->relay_left > 0)
+        {
+            int done = relay_input(usr);
+            if (done <= 0)
+                return done < 0;
         }
+
+        if (!decode_frames(usr))
+            return 0;
+        if (usr->relay_left > 0)
+            continue;
+
+        // While file frames stream in, read each header alone so the
+        // payload behind it can be spliced instead of copied
+        inbuf_reserve(usr, usr->inlen + BUFFER_SIZE);
+        size_t want = usr->incap - usr->inlen;
+        if (usr->relay_hint && usr->inlen < FRAME_HDR_LEN + sizeof(uint64_t))
+            want = FRAME_HDR_LEN + sizeof(uint64_t) - usr->inlen;
+        int n = recv(usr->clisockfd, usr->inbuf + usr->inlen, want, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 1;
+        if (n <= 0)
+            return 0;
+        usr->inlen += n;
+        budget = (size_t)n < budget ? budget - n : 0;
     }
-    pthread_mutex_unlock(&lock);
 }
 
-// Send message to a specific user
-int send_to_user(const char *username, int room_number, const char *message)
+// First four bytes carried the protocol magic instead of a room number.
+// Returns 0 if the client offered no version we speak.
+int start_framed(USR *usr)
 {
-    USR *receiver = find_user_by_name(username, room_number);
-    if (receiver != NULL){
-        send(receiver->clisockfd, message, strlen(message), 0);
-        return 1;
-    }
-    return 0;
+    int8_t version = ((int8_t *)&usr->room_number)[3];
+    if (version <= 0)
+        return 0;
+    usr->framed = 1;
+    usr->version = version < PROTO_VERSION ? version : PROTO_VERSION;
+    usr->state = CONN_JOIN;
+
+    uint8_t v = usr->version;
+    MSGBUF *hello = msgbuf_frame(MSG_HELLO, 0, &v, 1);
+    deliver(usr, hello, NULL);
+    msgbuf_put(hello);
+    return 1;
 }
 
-// Handle file transfer command from client
-void handle_file_transfer_command(int sockfd, char *buffer)
+// A data connection closed. Its user goes with it, so the transfers are
+// suspended and resumed the usual way; if the user is gone already it
+// left dropping them to this connection.
+void data_detach(USR *usr)
 {
-    // The format is: SEND transfer_id receiver_name filename
-    
-    char cmd[20], subcmd[20], receiver_name[50], filename[256];
-    int transfer_id;
-    
-    // Parse the command
-    int result = sscanf(buffer, "%s %s %d %s %s", cmd, subcmd, &transfer_id, receiver_name, filename);
-    
-    if (result != 5){
-        return;
-    }
-    
-    if (strcmp(cmd, "CMD") != 0 || strcmp(subcmd, FILE_TRANSFER_CMD) != 0){
-        return;
-    }
-    
-    // Find the sender
-    USR *sender = find_user_by_sockfd(sockfd);
-    if (sender == NULL){
-        return;
+    USR *owner = usr->owner;
+    pthread_rwlock_wrlock(&transfer_lock);
+    int attached = owner->data == usr;
+    if (attached)
+    {
+        owner->data = NULL;
     }
-    
-    // Find the receiver in the same room
-    USR *receiver = find_user_by_name(receiver_name, sender->room_number);
-    if (receiver == NULL){
-        // Receiver not found or not in the same room
-        char error_msg[BUFFER_SIZE];
-        sprintf(error_msg, "%s %d %s", FILE_TRANSFER_ERROR, transfer_id, "User not found or not in the same room");
-        send(sockfd, error_msg, strlen(error_msg), 0);
+    int orphaned = attached && owner->closed;
+    pthread_rwlock_unlock(&transfer_lock);
+    if (!attached)
+    {
         return;
     }
-    
-    // Send request to receiver, size will be sent later
-    char request[BUFFER_SIZE];
-    sprintf(request, "%s %d %s %s %d", FILE_TRANSFER_REQUEST, transfer_id, sender->username, filename, 0);
-    
-    send(receiver->clisockfd, request, strlen(request), 0);
-    
-    // Add to active transfers
-    add_file_transfer(transfer_id, sockfd, receiver->clisockfd, sender->username, receiver_name, filename, 0);
-    
-    printf("File transfer request: %s wants to send %s to %s (ID: %d)\n", sender->username, filename, receiver_name, transfer_id);
+
+    user_put(usr);
+    if (orphaned)
+        drop_transfers(owner);
+    else
+        shutdown(owner->clisockfd, SHUT_RDWR);
 }
 
-// Handle file transfer accept/reject
-void handle_file_transfer_response(int sockfd, char *buffer)
+// Tear down a connection and drop the event loop's reference.
+// The fd itself is closed once the last reference is gone.
+void close_client(USR *usr)
 {
-    // The format: CMD [ACCEPT/REJECT] transfer_id
-    
-    char cmd[20], subcmd[20];
-    int transfer_id;
-    
-    // Parse the command
-    int result = sscanf(buffer, "%s %s %d", cmd, subcmd, &transfer_id);
-    
-    if (result != 3){
-        return;
-    }
-    
-    if (strcmp(cmd, "CMD") != 0){
-        return;
-    }
-    
-    // Find the transfer
-    FileTransfer *transfer = find_transfer_by_id(transfer_id);
-    if (transfer == NULL || !transfer->active){
-        return;
-    }
-    
-    // Make sure this is the receiver responding
-    if (transfer->receiver_sockfd != sockfd){
-        return;
+    int clisockfd = usr->clisockfd;
+    epoll_ctl(usr->loop->epfd, EPOLL_CTL_DEL, clisockfd, NULL);
+    shutdown(clisockfd, SHUT_RDWR);
+    timer_cancel(&usr->idle_timer);
+    if (usr->session[0] != '\0')
+        session_release(usr);
+
+    // Nothing more goes out, and nobody stays paused on this reader
+    pthread_mutex_lock(&usr->outq.lock);
+    usr->outq.dead = 1;
+    outq_release_waiters(&usr->outq);
+    pthread_mutex_unlock(&usr->outq.lock);
+
+    // A half relayed frame would break the receiver's framing, pad it out
+    if (usr->relay_left > 0)
+    {
+        transfer_torn(usr->relay_id, usr->relay_offset);
+        MSGBUF *pad = (MSGBUF *)calloc(1, sizeof(MSGBUF) + usr->relay_left + 1);
+        atomic_init(&pad->refcnt, 1);
+        pad->len = usr->relay_left;
+        queue_message(usr->relay_to, pad, NULL, SLOW_BACKPRESSURE, 1);
+        msgbuf_put(pad);
+        usr->relay_left = 0;
     }
-    
-    if (strcmp(subcmd, FILE_TRANSFER_ACCEPT) == 0){
-        // Transfer accepted, notify sender to start
-        char accept_msg[BUFFER_SIZE];
-        sprintf(accept_msg, "%s %d", FILE_TRANSFER_ACCEPT, transfer_id);
-        send(transfer->sender_sockfd, accept_msg, strlen(accept_msg), 0);
-        
-        printf("File transfer accepted: %s will receive %s from %s (ID: %d)\n", transfer->receiver_name, transfer->filename, transfer->sender_name, transfer_id);
+
+    if (usr->state == CONN_CHAT)
+    {
+        char leave_msg[256];
+        sprintf(leave_msg, "%s (%s) left the room!\n", usr->username, usr->addr);
+        broadcast(-1, leave_msg);
+        printf("%s", leave_msg);
+
+        remove_client(clisockfd);
     }
-    else if (strcmp(subcmd, FILE_TRANSFER_REJECT) == 0){
-        // Transfer rejected, notify sender
-        char reject_msg[BUFFER_SIZE];
-        sprintf(reject_msg, "%s %d", FILE_TRANSFER_REJECT, transfer_id);
-        send(transfer->sender_sockfd, reject_msg, strlen(reject_msg), 0);
-        
-        // Remove the transfer
-        transfer->active = 0;
-        
-        printf("File transfer rejected: %s declined %s from %s (ID: %d)\n", transfer->receiver_name, transfer->filename, transfer->sender_name, transfer_id);
+    else if (usr->state == CONN_DATA)
+    {
+        data_detach(usr);
     }
+    user_put(usr);
 }
 
-// Forward file transfer data between clients
-void forward_transfer_data(int sockfd, char *buffer, int buffer_len)
+// Edge triggered, so drain the socket until it would block.
+// Returns 0 once the connection is finished.
+int handle_readable(USR *usr)
 {
-    // Check if it's a file transfer protocol message
-    if (strncmp(buffer, FILE_TRANSFER_START, strlen(FILE_TRANSFER_START)) == 0 ||
-        strncmp(buffer, FILE_TRANSFER_CHUNK, strlen(FILE_TRANSFER_CHUNK)) == 0 ||
-        strncmp(buffer, FILE_TRANSFER_END, strlen(FILE_TRANSFER_END)) == 0)
+    char buffer[BUFFER_SIZE];
+    usr->last_active = now_sec();
+
+    while (1)
     {
-        // Extract transfer ID
-        char protocol_type[30];
-        int transfer_id;
-        
-        sscanf(buffer, "%s %d", protocol_type, &transfer_id);
-        
-        // Find the transfer
-        FileTransfer *transfer = find_transfer_by_id(transfer_id);
-        if (transfer != NULL && transfer->active)
-        {
-            // Make sure this is the sender sending the data
-            if (transfer->sender_sockfd == sockfd)
-            {
-                // Forward to receiver
-                send(transfer->receiver_sockfd, buffer, buffer_len, 0);
-                
-                // If this is the end message, mark transfer as inactive
-                if (strcmp(protocol_type, FILE_TRANSFER_END) == 0)
-                {
-                    transfer->active = 0;
-                    printf("File transfer completed: %s sent %s to %s (ID: %d)\n", 
-                           transfer->sender_name, transfer->filename, 
-                           transfer->receiver_name, transfer_id);
-                }
-            }
-            // Or the receiver sending an error
-            else if (transfer->receiver_sockfd == sockfd && 
-                     strcmp(protocol_type, FILE_TRANSFER_ERROR) == 0)
-            {
-                // Forward error to sender
-                send(transfer->sender_sockfd, buffer, buffer_len, 0);
-                transfer->active = 0;
-            }
-        }
-        return;
-    }
-}
+        if (usr->framed)
+            return handle_framed_input(usr);
 
-typedef struct _ThreadArgs
-{
-    int clisockfd;
-    struct sockaddr_in cliaddr;
-} ThreadArgs;
+        // Backpressure: leave the data in the socket until resume_producer()
+        if (atomic_load(&usr->paused) > 0)
+            return 1;
 
-void *thread_main(void *args)
-{
-    pthread_detach(pthread_self());
-    ThreadArgs *targs = (ThreadArgs *)args;
-    int clisockfd = targs->clisockfd;
-    struct sockaddr_in cliaddr = targs->cliaddr;
-    // free(targs);
+        int n;
+        if (usr->state == CONN_ROOM)
+            n = recv(usr->clisockfd, (char *)&usr->room_number + usr->room_len,
+                     sizeof(int) - usr->room_len, 0);
+        else if (usr->state == CONN_NAME)
+            n = recv(usr->clisockfd, buffer, sizeof(usr->username) - 1, 0);
+        else
+            n = recv(usr->clisockfd, buffer, BUFFER_SIZE - 1, 0);
 
-    int room_number;
-    recv(clisockfd, &room_number, sizeof(int), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 1;
+        if (n <= 0)
+            return 0;
 
-    if (room_number == -2)
-    {
-        char list_msg[1024] = "Available chat rooms:\n";
-        int any = 0;
-        pthread_mutex_lock(&lock);
-        for (int i = 0; i < MAX_ROOMS; ++i)
+        if (usr->state == CONN_ROOM)
         {
-            if (room_user_counts[i] > 0)
+            usr->room_len += n;
+            if (usr->room_len < (int)sizeof(int))
+                continue;
+            if (memcmp(&usr->room_number, PROTO_MAGIC, strlen(PROTO_MAGIC)) == 0)
             {
-                char line[100];
-                snprintf(line, sizeof(line), "Room %d: %d people\n", i + 1, room_user_counts[i]);
-                strcat(list_msg, line);
-                any = 1;
+                if (!start_framed(usr))
+                    return 0;
             }
+            else if (!handle_room_number(usr))
+                return 0;
         }
-        pthread_mutex_unlock(&lock);
-        if (!any)
+        else if (usr->state == CONN_NAME)
         {
-            strcpy(list_msg, "No rooms available. Type 'new' to create one.\n");
+            if (!handle_username(usr, buffer, n, JOIN_RECENT))
+                return 0;
+        }
+        else
+        {
+            handle_client_message(usr, buffer, n);
         }
-        send(clisockfd, list_msg, strlen(list_msg), 0);
-        close(clisockfd);
-        return NULL;
     }
+}
 
-    char uname[50];
-    int n = recv(clisockfd, uname, sizeof(uname), 0);
+// The socket has room again, push out what is queued
+void handle_writable(USR *usr)
+{
+    pthread_mutex_lock(&usr->outq.lock);
+    outq_flush(usr);
+    pthread_mutex_unlock(&usr->outq.lock);
+}
 
-    if (room_number < 0)
-    {
-        static int next_room = 1; // start room IDs from 1
-        pthread_mutex_lock(&lock);
-        room_number = next_room++;
-        active_rooms[room_number - 1] = 1;
-        pthread_mutex_unlock(&lock);
-    }
-    else
+// Connection timer, runs on the connection's own loop: cut off clients
+// that never finish joining, and joined ones silent for idle_timeout.
+// Users with transfers or paused input are busy, not idle.
+void connection_timeout(TIMER *timer)
+{
+    USR *usr = (USR *)((char *)timer - offsetof(USR, idle_timer));
+    long now = now_sec();
+
+    if (usr->state == CONN_CHAT)
     {
-        if (room_number <= 0 || room_number > MAX_ROOMS)
+        if (idle_timeout <= 0)
+            return;
+        pthread_rwlock_rdlock(&transfer_lock);
+        int busy = usr->nxfers > 0 || atomic_load(&usr->paused) > 0;
+        pthread_rwlock_unlock(&transfer_lock);
+        if (busy)
+            usr->last_active = now;
+        if (usr->last_active + idle_timeout > now)
         {
-            char err[] = "Error: Room does not exist\n";
-            send(clisockfd, err, strlen(err), 0);
-            close(clisockfd);
-            return NULL;
+            timer_arm(timer, usr->last_active + idle_timeout);
+            return;
         }
+        send_text(usr, "Disconnected: idle for too long\n");
     }
+    printf("Timed out: %s\n", usr->addr);
+    close_client(usr);
+}
+
+// Register a freshly accepted socket with an event loop
+void add_client(EVLOOP *loop, int newsockfd, struct sockaddr_in cli_addr)
+{
+    USR *usr = (USR *)calloc(1, sizeof(USR));
+    usr->clisockfd = newsockfd;
+    usr->cliaddr = cli_addr;
+    inet_ntop(AF_INET, &cli_addr.sin_addr, usr->addr, sizeof(usr->addr));
+    printf("Connected: %s\n", usr->addr);
+    usr->state = CONN_ROOM;
+    usr->loop = loop;
+    usr->room_slot = -1;
+    atomic_init(&usr->refcnt, 1); // owned by the event loop
+    pthread_mutex_init(&usr->outq.lock, NULL);
+    usr->last_active = now_sec();
 
-    if (n <= 0)
+    // Armed before the loop can see the socket, it fires on that loop
+    timer_init(&usr->idle_timer, &loop->wheel, connection_timeout);
+    timer_arm(&usr->idle_timer, usr->last_active + HANDSHAKE_TIMEOUT);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = usr;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, newsockfd, &ev) < 0)
     {
-        close(clisockfd);
-        return NULL;
+        timer_cancel(&usr->idle_timer);
+        user_put(usr);
     }
-    uname[n] = '\0';
+}
 
-    // Check if username already exists in the room
-    if (find_user_by_name(uname, room_number) != NULL)
+// Out of descriptors, a pending connection would sit in the backlog and
+// keep the listener readable. Give up the spare descriptor to accept it,
+// and turn it away if the spare cannot be had back. Returns the socket,
+// -2 if it was turned away or -1 with errno set.
+int accept_spare(int listenfd, struct sockaddr_in *cli_addr)
+{
+    socklen_t clen = sizeof(*cli_addr);
+    pthread_mutex_lock(&reserve_lock);
+    if (reserve_fd >= 0)
+        close(reserve_fd);
+    int fd = accept4(listenfd, (struct sockaddr *)cli_addr, &clen, SOCK_NONBLOCK);
+    int err = errno;
+    reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (reserve_fd < 0 && fd >= 0)
     {
-        char err[] = "Error: Username already exists in this room\n";
-        send(clisockfd, err, strlen(err), 0);
-        close(clisockfd);
-        return NULL;
+        close(fd);
+        fd = -2;
+        reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
     }
+    pthread_mutex_unlock(&reserve_lock);
+    errno = err;
+    return fd;
+}
 
-    if (room_number >= 1)
+// Sharded listener is edge triggered too, accept until the backlog is empty
+void accept_clients(EVLOOP *loop)
+{
+    while (1)
     {
-        char msg[128];
-        sprintf(msg, "Connected to %s with room number %d\n", inet_ntoa(cliaddr.sin_addr), room_number);
-        send(clisockfd, msg, strlen(msg), 0);
+        struct sockaddr_in cli_addr;
+        socklen_t clen = sizeof(cli_addr);
+        int newsockfd = accept4(loop->listenfd, (struct sockaddr *)&cli_addr, &clen, SOCK_NONBLOCK);
+        // No new edge comes while the backlog is not empty, so drain it
+        // even without descriptors to spare
+        if (newsockfd < 0 && (errno == EMFILE || errno == ENFILE))
+            newsockfd = accept_spare(loop->listenfd, &cli_addr);
+        if (newsockfd == -2)
+            continue;
+        if (newsockfd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("ERROR on accept");
+            return;
+        }
+        add_client(loop, newsockfd, cli_addr);
     }
+}
 
-    add_tail(clisockfd, cliaddr, uname, room_number);
-    free(targs);
+void *loop_main(void *args)
+{
+    EVLOOP *loop = (EVLOOP *)args;
+    struct epoll_event events[MAX_EVENTS];
 
-    char join_msg[256];
-    sprintf(join_msg, "%s (%s) joined the chat room!\n", uname, inet_ntoa(cliaddr.sin_addr));
-    broadcast(-1, join_msg);
-    printf("%s", join_msg);
+    if (loop->cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(loop->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
 
-    char buffer[BUFFER_SIZE];
-    int nrcv = recv(clisockfd, buffer, BUFFER_SIZE - 1, 0);
-    while (nrcv > 0)
+    while (1)
     {
-        buffer[nrcv] = '\0';
-        
-        // Check if it's a command or file transfer data
-        if (strncmp(buffer, "CMD", 3) == 0)
+        int nev = epoll_wait(loop->epfd, events, MAX_EVENTS, -1);
+        if (nev < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            error("ERROR on epoll_wait");
+        }
+
+        int expired = 0;
+        for (int i = 0; i < nev; i++)
         {
-            // Check if it's a file transfer command
-            if (strstr(buffer, FILE_TRANSFER_CMD) != NULL)
+            // The listener is tagged with the address of its fd field
+            if (events[i].data.ptr == &loop->listenfd)
             {
-                handle_file_transfer_command(clisockfd, buffer);
+                accept_clients(loop);
+                continue;
             }
-            // Check if it's a file transfer response
-            else if (strstr(buffer, FILE_TRANSFER_ACCEPT) != NULL || 
-                     strstr(buffer, FILE_TRANSFER_REJECT) != NULL)
+            // and the timerfd with its wheel
+            if (events[i].data.ptr == &loop->wheel)
             {
-                handle_file_transfer_response(clisockfd, buffer);
+                expired = 1;
+                continue;
             }
-        }
-        // Check if it's file transfer data
-        else if (strncmp(buffer, FILE_TRANSFER_START, strlen(FILE_TRANSFER_START)) == 0 ||
-                 strncmp(buffer, FILE_TRANSFER_CHUNK, strlen(FILE_TRANSFER_CHUNK)) == 0 ||
-                 strncmp(buffer, FILE_TRANSFER_END, strlen(FILE_TRANSFER_END)) == 0 ||
-                 strncmp(buffer, FILE_TRANSFER_ERROR, strlen(FILE_TRANSFER_ERROR)) == 0)
-        {
-            forward_transfer_data(clisockfd, buffer, nrcv);
-        }
-        // Regular chat message
-        else
-        {
-            buffer[strcspn(buffer, "\n")] = '\0';
-            broadcast(clisockfd, buffer);
-        }
-        
-        // Periodically clean up stale transfers (every ~10 messages)
-        static int cleanup_counter = 0;
-        if (++cleanup_counter % 10 == 0)
-        {
-            cleanup_transfers();
-        }
-        
-        nrcv = recv(clisockfd, buffer, BUFFER_SIZE - 1, 0);
-    }
 
-    char leave_msg[256];
-    sprintf(leave_msg, "%s (%s) left the room!\n", uname, inet_ntoa(cliaddr.sin_addr));
-    broadcast(-1, leave_msg);
-    printf("%s", leave_msg);
+            USR *usr = (USR *)events[i].data.ptr;
+            int alive = 1;
 
-    remove_client(clisockfd);
-    close(clisockfd);
+            if (events[i].events & EPOLLOUT)
+                handle_writable(usr);
+            // Resumed producers may have whole frames buffered already
+            if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) ||
+                (usr->inlen > 0 && atomic_load(&usr->paused) == 0))
+                alive = handle_readable(usr);
+            if (!alive || (events[i].events & (EPOLLHUP | EPOLLERR)))
+                close_client(usr);
+        }
+
+        // Timers may close connections, and later events of the batch
+        // would still point at them, so they run once the batch is done
+        if (expired)
+            wheel_advance(&loop->wheel);
+    }
 
     return NULL;
 }
 
-int main(int argc, char *argv[])
+// Bound and listening TCP socket on PORT_NUM
+int open_listener(int reuseport, int backlog)
 {
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd < 0)
@@ -715,6 +5444,9 @@ int main(int argc, char *argv[])
     // Allow address reuse to prevent 'address already in use' errors
     int opt = 1;
     setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    // Every shard binds the same port, the kernel spreads new connections
+    if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+        error("ERROR setting SO_REUSEPORT");
 
     struct sockaddr_in serv_addr;
     socklen_t slen = sizeof(serv_addr);
@@ -727,32 +5459,165 @@ int main(int argc, char *argv[])
     if (status < 0)
         error("ERROR on binding");
 
-    if (listen(sockfd, 5) < 0)
+    if (listen(sockfd, backlog) < 0)
         error("ERROR on listen");
 
-    printf("Server started on port %d\n", PORT_NUM);
+    return sockfd;
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-l event_loops] [-s shards] [-b backlog]\n"
+                    "          [-q queue_len] [-p drop|disconnect|block]\n"
+                    "          [-i idle_seconds] [-c store_mb] [-r replay]\n"
+                    "          [-d log_dir]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int nloops = ncpu;
+    int nshards = 0;
+    int backlog = SOMAXCONN;
+    int opt;
+    while ((opt = getopt(argc, argv, "l:s:b:q:p:i:c:r:d:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'l':
+            nloops = atoi(optarg);
+            break;
+        case 's':
+            nshards = atoi(optarg);
+            break;
+        case 'b':
+            backlog = atoi(optarg);
+            break;
+        case 'q':
+            max_queue = atoi(optarg);
+            if (max_queue < 2)
+                usage(argv[0]);
+            break;
+        case 'i':
+            idle_timeout = atoi(optarg);
+            break;
+        case 'c':
+        {
+            char *end;
+            long mb = strtol(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || mb <= 0 || (unsigned long)mb > SIZE_MAX >> 20)
+                usage(argv[0]);
+            store_max = (size_t)mb << 20;
+            break;
+        }
+        case 'd':
+            log_dir = optarg;
+            break;
+        case 'r':
+            history_replay = atoi(optarg);
+            if (history_replay < 0 || history_replay > HISTORY_LEN)
+                usage(argv[0]);
+            break;
+        case 'p':
+            if (strcmp(optarg, "drop") == 0)
+                slow_policy = SLOW_DROP_OLDEST;
+            else if (strcmp(optarg, "disconnect") == 0)
+                slow_policy = SLOW_DISCONNECT;
+            else if (strcmp(optarg, "block") == 0)
+                slow_policy = SLOW_BACKPRESSURE;
+            else
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    // Shards are event loops that each own a listener
+    if (nshards > 0)
+        nloops = nshards;
+    if (nloops < 1)
+        nloops = 1;
+    if (ncpu < 1)
+        ncpu = 1;
+
+    // Peers vanish mid-send all the time, report it through send() instead
+    signal(SIGPIPE, SIG_IGN);
+    reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (log_dir != NULL)
+        log_init();
+    sha256_init_cpu();
+
+    int sockfd = -1;
+    if (nshards == 0)
+        sockfd = open_listener(0, backlog);
+
+    // Fixed set of event loops, clients are spread over them round robin
+    // or, when sharded, by the kernel across the SO_REUSEPORT group
+    EVLOOP *loops = (EVLOOP *)calloc(nloops, sizeof(EVLOOP));
+    for (int i = 0; i < nloops; i++)
+    {
+        loops[i].epfd = epoll_create1(0);
+        if (loops[i].epfd < 0)
+            error("ERROR creating epoll instance");
+        loops[i].listenfd = -1;
+        loops[i].cpu = -1;
+
+        wheel_init(&loops[i].wheel);
+        struct epoll_event tev;
+        tev.events = EPOLLIN;
+        tev.data.ptr = &loops[i].wheel;
+        if (epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, loops[i].wheel.tfd, &tev) < 0)
+            error("ERROR registering timer");
+
+        if (nshards > 0)
+        {
+            loops[i].listenfd = open_listener(1, backlog);
+            fcntl(loops[i].listenfd, F_SETFL, O_NONBLOCK);
+            loops[i].cpu = i % ncpu;
+
+            struct epoll_event ev;
+            ev.events = EPOLLIN | EPOLLET;
+            ev.data.ptr = &loops[i].listenfd;
+            if (epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, loops[i].listenfd, &ev) < 0)
+                error("ERROR registering listener");
+        }
+
+        if (pthread_create(&loops[i].tid, NULL, loop_main, &loops[i]) != 0)
+            error("ERROR creating event loop thread");
+    }
+
+    if (nshards > 0)
+        printf("Server started on port %d (%d shards, backlog %d)\n", PORT_NUM, nshards, backlog);
+    else
+        printf("Server started on port %d (%d event loops, backlog %d)\n", PORT_NUM, nloops, backlog);
 
-    // Initialize random number generator (for transfer IDs if needed)
-    srand(time(NULL));
+    if (nshards > 0)
+    {
+        for (int i = 0; i < nloops; i++)
+            pthread_join(loops[i].tid, NULL);
+        return 0;
+    }
 
+    int next_loop = 0;
     while (1)
     {
         struct sockaddr_in cli_addr;
         socklen_t clen = sizeof(cli_addr);
-        int newsockfd = accept(sockfd, (struct sockaddr *)&cli_addr, &clen);
+        int newsockfd = accept4(sockfd, (struct sockaddr *)&cli_addr, &clen, SOCK_NONBLOCK);
+        // Turn connections away rather than spin while out of descriptors
+        if (newsockfd < 0 && (errno == EMFILE || errno == ENFILE))
+            newsockfd = accept_spare(sockfd, &cli_addr);
         if (newsockfd < 0)
+        {
+            if (newsockfd == -2 || errno == EINTR || errno == ECONNABORTED)
+                continue;
             error("ERROR on accept");
+        }
 
-        printf("Connected: %s\n", inet_ntoa(cli_addr.sin_addr));
-
-        ThreadArgs *args = (ThreadArgs *)malloc(sizeof(ThreadArgs));
-        args->clisockfd = newsockfd;
-        args->cliaddr = cli_addr;
-
-        pthread_t tid;
-        if (pthread_create(&tid, NULL, thread_main, (void *)args) != 0)
-            error("ERROR creating a new thread");
+        add_client(&loops[next_loop], newsockfd, cli_addr);
+        next_loop = (next_loop + 1) % nloops;
     }
 
     return 0;
-}
\ No newline at end of file
+}
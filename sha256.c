@@ -0,0 +1,169 @@
+// SHA-256, with the SHA extensions when the CPU has them. Shared by the
+// client, which keys the frames it offers, and the server's chunk store.
+#include <string.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include "sha256.h"
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static void (*sha256_blocks)(uint32_t *h, const unsigned char *p, size_t nblocks);
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_blocks_sw(uint32_t *h, const unsigned char *p, size_t nblocks)
+{
+    for (; nblocks > 0; nblocks--, p += 64)
+    {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++)
+        {
+            w[i] = (uint32_t)p[4 * i] << 24 | p[4 * i + 1] << 16 | p[4 * i + 2] << 8 | p[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++)
+        {
+            uint32_t s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+        for (int i = 0; i < 64; i++)
+        {
+            uint32_t t1 = k + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) +
+                          sha256_k[i] + w[i];
+            uint32_t t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            k = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+        h[5] += f;
+        h[6] += g;
+        h[7] += k;
+    }
+}
+
+#if defined(__x86_64__)
+// Two sha256rnds2 do four rounds on the state kept as ABEF and CDGH.
+// Message group g comes from the four before it, w holds the last four.
+#define SHA256_ROUNDS(g, w)                                                       \
+    msg = _mm_add_epi32(w, _mm_loadu_si128((const __m128i *)&sha256_k[4 * (g)])); \
+    cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg);                                \
+    abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(msg, 0x0e))
+#define SHA256_NEXT(w4, w3, w2, w1) \
+    w4 = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(w4, w3), _mm_alignr_epi8(w1, w2, 4)), w1)
+
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_hw(uint32_t *h, const unsigned char *p, size_t nblocks)
+{
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[0]), 0xb1);
+    __m128i cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[4]), 0x1b);
+    __m128i abef = _mm_alignr_epi8(tmp, cdgh, 8);
+    cdgh = _mm_blend_epi16(cdgh, tmp, 0xf0);
+
+    for (; nblocks > 0; nblocks--, p += 64)
+    {
+        __m128i abef_save = abef, cdgh_save = cdgh, msg;
+        __m128i w0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)p), bswap);
+        __m128i w1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16)), bswap);
+        __m128i w2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 32)), bswap);
+        __m128i w3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 48)), bswap);
+        SHA256_ROUNDS(0, w0);
+        SHA256_ROUNDS(1, w1);
+        SHA256_ROUNDS(2, w2);
+        SHA256_ROUNDS(3, w3);
+        for (int g = 4; g < 16; g += 4)
+        {
+            SHA256_NEXT(w0, w1, w2, w3);
+            SHA256_ROUNDS(g, w0);
+            SHA256_NEXT(w1, w2, w3, w0);
+            SHA256_ROUNDS(g + 1, w1);
+            SHA256_NEXT(w2, w3, w0, w1);
+            SHA256_ROUNDS(g + 2, w2);
+            SHA256_NEXT(w3, w0, w1, w2);
+            SHA256_ROUNDS(g + 3, w3);
+        }
+        abef = _mm_add_epi32(abef, abef_save);
+        cdgh = _mm_add_epi32(cdgh, cdgh_save);
+    }
+
+    tmp = _mm_shuffle_epi32(abef, 0x1b);
+    cdgh = _mm_shuffle_epi32(cdgh, 0xb1);
+    _mm_storeu_si128((__m128i *)&h[0], _mm_blend_epi16(tmp, cdgh, 0xf0));
+    _mm_storeu_si128((__m128i *)&h[4], _mm_alignr_epi8(cdgh, tmp, 8));
+}
+#endif
+
+void sha256_init(SHA256_CTX *ctx)
+{
+    static const uint32_t iv[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                   0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(ctx->h, iv, sizeof(iv));
+    ctx->used = 0;
+    ctx->total = 0;
+}
+
+void sha256_update(SHA256_CTX *ctx, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    ctx->total += len;
+    if (ctx->used > 0)
+    {
+        size_t n = 64 - ctx->used < len ? 64 - ctx->used : len;
+        memcpy(ctx->buf + ctx->used, p, n);
+        ctx->used += n;
+        p += n;
+        len -= n;
+        if (ctx->used < 64)
+            return;
+        sha256_blocks(ctx->h, ctx->buf, 1);
+        ctx->used = 0;
+    }
+    sha256_blocks(ctx->h, p, len / 64);
+    memcpy(ctx->buf, p + len / 64 * 64, len % 64);
+    ctx->used = len % 64;
+}
+
+void sha256_final(SHA256_CTX *ctx, unsigned char *out)
+{
+    uint64_t bits = htobe64(ctx->total * 8);
+    unsigned char pad[72] = {0x80};
+    size_t n = ctx->used < 56 ? 56 - ctx->used : 120 - ctx->used;
+    memcpy(pad + n, &bits, sizeof(bits));
+    sha256_update(ctx, pad, n + sizeof(bits));
+    for (int i = 0; i < 8; i++)
+    {
+        uint32_t v = htonl(ctx->h[i]);
+        memcpy(out + 4 * i, &v, sizeof(v));
+    }
+}
+
+void sha256_init_cpu()
+{
+    sha256_blocks = sha256_blocks_sw;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1"))
+        sha256_blocks = sha256_blocks_hw;
+#endif
+}
@@ -0,0 +1,23 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_LEN 32
+
+typedef struct
+{
+    uint32_t h[8];
+    unsigned char buf[64];
+    size_t used;    // bytes waiting in buf
+    uint64_t total; // bytes hashed so far
+} SHA256_CTX;
+
+// Picks the block function, call once before hashing
+void sha256_init_cpu();
+void sha256_init(SHA256_CTX *ctx);
+void sha256_update(SHA256_CTX *ctx, const void *data, size_t len);
+void sha256_final(SHA256_CTX *ctx, unsigned char *out);
+
+#endif